@@ -0,0 +1,107 @@
+/* run independent jobs on a pool of threads, finishing them in order */
+
+#include "ordered-jobs.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "xalloc.h"
+
+struct ordered_jobs
+{
+    size_t n;
+    size_t next;                /* the next job to hand out */
+    bool* finished;             /* which jobs WORK is through with */
+    ordered_work_fn work;
+    void* arg;
+    pthread_mutex_t lock;
+    pthread_cond_t progress;    /* a job was finished */
+};
+
+struct ordered_worker
+{
+    struct ordered_jobs* oj;
+    size_t id;
+    pthread_t thread;
+};
+
+static void* ordered_worker(void* p)
+{
+    struct ordered_worker* w = p;
+    struct ordered_jobs* oj = w->oj;
+    size_t i;
+
+    while(1)
+    {
+        pthread_mutex_lock(&oj->lock);
+        i = oj->next;
+        if(i < oj->n)
+            oj->next++;
+        pthread_mutex_unlock(&oj->lock);
+        if(i == oj->n)
+            break;
+
+        oj->work(i, w->id, oj->arg);
+
+        pthread_mutex_lock(&oj->lock);
+        oj->finished[i] = true;
+        pthread_cond_signal(&oj->progress);
+        pthread_mutex_unlock(&oj->lock);
+    }
+    return NULL;
+}
+
+void ordered_jobs(size_t n, size_t nworkers, ordered_work_fn work,
+                  ordered_done_fn done, void* arg)
+{
+    struct ordered_jobs oj;
+    struct ordered_worker* w;
+    size_t i, started;
+
+    if(nworkers > n)
+        nworkers = n;
+
+    oj.n = n;
+    oj.next = 0;
+    oj.finished = xnmalloc(n ? n : 1, sizeof *oj.finished);
+    for(i = 0; i < n; i++)
+        oj.finished[i] = false;
+    oj.work = work;
+    oj.arg = arg;
+    pthread_mutex_init(&oj.lock, NULL);
+    pthread_cond_init(&oj.progress, NULL);
+
+    w = xnmalloc(nworkers ? nworkers : 1, sizeof *w);
+    for(started = 0; started < nworkers; started++)
+    {
+        w[started].oj = &oj;
+        w[started].id = started;
+        if(pthread_create(&w[started].thread, NULL, ordered_worker,
+                          &w[started]) != 0)
+            break;
+    }
+
+    for(i = 0; i < n; i++)
+    {
+        if(started == 0)
+        {
+            work(i, 0, arg);
+            done(i, arg);
+            continue;
+        }
+
+        pthread_mutex_lock(&oj.lock);
+        while(!oj.finished[i])
+            pthread_cond_wait(&oj.progress, &oj.lock);
+        pthread_mutex_unlock(&oj.lock);
+        done(i, arg);
+    }
+
+    for(i = 0; i < started; i++)
+        pthread_join(w[i].thread, NULL);
+
+    pthread_cond_destroy(&oj.progress);
+    pthread_mutex_destroy(&oj.lock);
+    free(w);
+    free(oj.finished);
+}
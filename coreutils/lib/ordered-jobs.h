@@ -0,0 +1,25 @@
+/* run independent jobs on a pool of threads, finishing them in order */
+
+#ifndef ORDERED_JOBS_H
+#define ORDERED_JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Do job I on worker WORKER, one of 0 .. NWORKERS-1; a worker does one
+   job at a time, so anything indexed by WORKER is its own to use */
+typedef void (*ordered_work_fn)(size_t i, size_t worker, void* arg);
+
+/* Finish job I, once it and all jobs before it are done */
+typedef void (*ordered_done_fn)(size_t i, void* arg);
+
+/* Run jobs 0 .. N-1 through WORK on up to NWORKERS threads, calling
+   DONE for each in order from the calling thread, as soon as it can.
+   Whatever WORK finds out must be left where DONE can see it, by I.
+   If no thread can be started the calling thread does all the work
+   itself. */
+void ordered_jobs(size_t n, size_t nworkers, ordered_work_fn work,
+                  ordered_done_fn done, void* arg);
+
+
+#endif
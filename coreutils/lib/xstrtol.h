@@ -32,7 +32,7 @@ _DECLARE_XSTRTOL (xstrtoimax, intmax_t)
 _DECLARE_XSTRTOL (xstrtoumax, uintmax_t)
 
 #ifndef __attribute__
-# if __GNU__ < 2 || (__GNU__ == 2 && _GNU_MINOR__ < 8)
+# if __GNUC__ < 2 || (__GNUC__ == 2 && __GNUC_MINOR__ < 8)
 #   define __attribute__(x)
 # endif
 #endif
@@ -0,0 +1,50 @@
+#!/bin/sh
+# bench-sum.sh - time sum -r (BSD) and sum -s (SysV) over a 1 GiB file
+#
+# Creates a file of SIZE MiB (1024 by default) of random bytes, reads
+# it once so that it is cached, and times each sum given ROUNDS
+# times with -r and with -s. The tree builds objects only, so pass
+# the linked binaries to compare; the system's sum is used if none.
+# KEEP names a file to reuse between runs instead of a fresh one.
+#
+# usage: ./bench-sum.sh [sum ...]
+
+SIZE=${SIZE:-1024}
+ROUNDS=${ROUNDS:-3}
+
+if [ -n "$KEEP" ]
+then
+    data=$KEEP
+else
+    data=${TMPDIR:-/tmp}/bench-sum.$$
+    trap 'rm -f "$data"' 0 1 2 15
+fi
+if [ ! -s "$data" ]
+then
+    head -c $((SIZE * 1048576)) /dev/urandom > "$data" || exit 1
+fi
+cat "$data" > /dev/null
+
+# elapsed ms of one run of "$@" over the data
+run()
+{
+    t0=$(date +%s%N)
+    "$@" "$data" > /dev/null
+    t1=$(date +%s%N)
+    echo $(( (t1 - t0) / 1000000 ))
+}
+
+echo "$(( $(wc -c < "$data") / 1048576 )) MiB, $ROUNDS rounds, ms per run"
+[ $# -eq 0 ] && set -- sum
+for s in "$@"
+do
+    for o in -r -s
+    do
+        t=
+        for r in $(seq "$ROUNDS")
+        do
+            t="$t $(run "$s" $o)"
+        done
+        echo "$s $o: $("$s" $o "$data" | cut -d' ' -f1-2) $t"
+    done
+done
@@ -13,14 +13,23 @@
 #include <stdbool.h>
 #include <string.h>
 
+#if (defined __x86_64__ || defined __i386__) && __GNUC__ >= 5
+# define USE_PCLMUL_CRC32 1
+# include <immintrin.h>
+#endif
+
 #include "system.h"
-#include "long-options.h"
 #include "xfreopen.h"
 #include "closeout.h"
 #include "inttostr.h"
+#include "safe-read.h"
+#include "xalloc.h"
+#include "xstrtol.h"
+#include "quote.h"
+#include "ordered-jobs.h"
 
 /* Number of bytes to read at once. */
-#define BUFLEN (1 << 16)
+#define BUFLEN (1 << 18)
 
 #define STREQ(a, b) (strcmp((a), (b)) == 0)
 
@@ -84,9 +93,246 @@ static uint_fast32_t const crctab[256] =
   0xa2f33668, 0xbcb4666d, 0xb8757bda, 0xb5365d03, 0xb1f740b4
 };
 
+/* crctab, and for each k the CRC of each byte followed by k zero
+   bytes, so that crc_slice8() can take 8 bytes in one step */
+static uint32_t crc_slice[8][256];
+
+/* The buffers files are read into, page aligned: one for each worker,
+   and the last for what is read on the calling thread */
+static unsigned char** bufs;
+
 /* Nonzero if any of the files read were the standard input */
 static bool have_read_stdin;
 
+/* How many files, or parts of them, to checksum at once */
+static size_t nworkers = 1;
+
+/* With more than one worker, split regular files larger than this
+   into parts of this size, 0 for never */
+static uintmax_t chunk_size;
+
+/* For long options that have no equivalent short option, use a
+   non-character as a pseudo short option, starting with CHAR_MAX + 1 */
+enum
+{
+    CHUNK_SIZE_OPTION = CHAR_MAX + 1
+};
+
+static struct option const longopts[] =
+{
+    {"jobs", required_argument, NULL, 'j'},
+    {"chunk-size", required_argument, NULL, CHUNK_SIZE_OPTION},
+    {GETOPT_HELP_OPTION_DECL},
+    {GETOPT_VERSION_OPTION_DECL},
+    {NULL, 0, NULL, 0}
+};
+
+static void
+crc_init(void)
+{
+    int i, k;
+
+    for(i = 0; i < 256; i++)
+    {
+        crc_slice[0][i] = crctab[i];
+        for(k = 1; k < 8; k++)
+            crc_slice[k][i] = (crc_slice[k - 1][i] << 8) ^
+                              crctab[crc_slice[k - 1][i] >> 24];
+    }
+}
+
+/* Continue crc over the len bytes at cp, 8 at a time */
+static uint_fast32_t
+crc_slice8(uint_fast32_t crc, unsigned char const* cp, size_t len)
+{
+    uint32_t hi, lo;
+
+    for(; len >= 8; cp += 8, len -= 8)
+    {
+        hi = crc ^ ((uint32_t)cp[0] << 24 | (uint32_t)cp[1] << 16 |
+                    (uint32_t)cp[2] << 8 | cp[3]);
+        lo = (uint32_t)cp[4] << 24 | (uint32_t)cp[5] << 16 |
+             (uint32_t)cp[6] << 8 | cp[7];
+        crc = crc_slice[7][hi >> 24] ^ crc_slice[6][(hi >> 16) & 0xFF] ^
+              crc_slice[5][(hi >> 8) & 0xFF] ^ crc_slice[4][hi & 0xFF] ^
+              crc_slice[3][lo >> 24] ^ crc_slice[2][(lo >> 16) & 0xFF] ^
+              crc_slice[1][(lo >> 8) & 0xFF] ^ crc_slice[0][lo & 0xFF];
+    }
+    while(len--)
+        crc = ((crc << 8) & 0xFFFFFFFF) ^ crctab[((crc >> 24) ^ *cp++) & 0xFF];
+    return crc;
+}
+
+#ifdef USE_PCLMUL_CRC32
+/* Fold a, the 16 bytes some distance before b, into b: the two halves
+   of a are carried forward by multiplying them by x^d mod P, for the
+   distance d each has to go, as held in k */
+# define CRC_FOLD(a, k, b)                              \
+    _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(a, k, 0x00), \
+                                _mm_clmulepi64_si128(a, k, 0x11)), b)
+
+/* Continue crc over the len bytes at cp with carry-less multiplication,
+   as in Intel's "Fast CRC Computation for Generic Polynomials Using
+   PCLMULQDQ Instruction": four 16 byte lanes 64 bytes apart are folded
+   forward together, then into one, and the 16 bytes left over are
+   reduced with the tables */
+__attribute__((__target__("pclmul,ssse3")))
+static uint_fast32_t
+crc_pclmul(uint_fast32_t crc, unsigned char const* cp, size_t len)
+{
+    __m128i const swap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                      8, 9, 10, 11, 12, 13, 14, 15);
+    __m128i const k1 = _mm_set_epi64x(0xC5B9CD4C, 0xE8A45605);
+    __m128i const k4 = _mm_set_epi64x(0x8833794C, 0xE6228B11);
+    __m128i x0, x1, x2, x3;
+    unsigned char rest[16];
+
+# define LOAD(p) _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(p)), swap)
+
+    if(len < 64)
+        return crc_slice8(crc, cp, len);
+
+    /* the CRC so far goes in against the first 4 bytes */
+    x0 = _mm_xor_si128(LOAD(cp), _mm_set_epi32(crc, 0, 0, 0));
+    x1 = LOAD(cp + 16);
+    x2 = LOAD(cp + 32);
+    x3 = LOAD(cp + 48);
+    for(cp += 64, len -= 64; len >= 64; cp += 64, len -= 64)
+    {
+        x0 = CRC_FOLD(x0, k4, LOAD(cp));
+        x1 = CRC_FOLD(x1, k4, LOAD(cp + 16));
+        x2 = CRC_FOLD(x2, k4, LOAD(cp + 32));
+        x3 = CRC_FOLD(x3, k4, LOAD(cp + 48));
+    }
+
+    x0 = CRC_FOLD(x0, k1, x1);
+    x0 = CRC_FOLD(x0, k1, x2);
+    x0 = CRC_FOLD(x0, k1, x3);
+    for(; len >= 16; cp += 16, len -= 16)
+        x0 = CRC_FOLD(x0, k1, LOAD(cp));
+# undef LOAD
+
+    _mm_storeu_si128((__m128i*)rest, _mm_shuffle_epi8(x0, swap));
+    return crc_slice8(crc_slice8(0, rest, sizeof rest), cp, len);
+}
+#endif
+
+/* What crc_update() is, for this CPU */
+static uint_fast32_t (*crc_update)(uint_fast32_t, unsigned char const*,
+                                   size_t) = crc_slice8;
+
+static void
+crc_choose(void)
+{
+#ifdef USE_PCLMUL_CRC32
+    if(__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3"))
+        crc_update = crc_pclmul;
+#endif
+}
+
+/* a * b mod the CRC polynomial */
+static uint_fast32_t
+crc_mulmod(uint_fast32_t a, uint_fast32_t b)
+{
+    uint_fast32_t r = 0;
+    int i;
+
+    for(i = 31; i >= 0; i--)
+    {
+        r = ((r << 1) & 0xFFFFFFFF) ^ (r & 0x80000000 ? 0x04C11DB7 : 0);
+        if(b & ((uint_fast32_t)1 << i))
+            r ^= a;
+    }
+    return r;
+}
+
+/* The CRC of some data with the CRC crc, followed by len bytes that
+   on their own have the CRC crc2: crc moved on by len zero bytes,
+   that is times x^(8 len), with crc2 added */
+static uint_fast32_t
+crc_combine(uint_fast32_t crc, uint_fast32_t crc2, uintmax_t len)
+{
+    uint_fast32_t xn = 0x100;       /* x^8, then x^16, x^32, ... */
+
+    for(; len; len >>= 1)
+    {
+        if(len & 1)
+            crc = crc_mulmod(crc, xn);
+        xn = crc_mulmod(xn, xn);
+    }
+    return crc ^ crc2;
+}
+
+/* Continue *CRC and *LENGTH over what can be read from FD into BUF:
+   from where FD is up to its end if OFFSET is negative, else with
+   pread() SIZE bytes from OFFSET, or up to the end if SIZE is
+   negative. Return 0, or the errno of what went wrong */
+static int
+crc_fd(int fd, off_t offset, off_t size, unsigned char* buf,
+       uint_fast32_t* crc, uintmax_t* length)
+{
+    size_t want, bytes_read;
+    ssize_t n;
+
+    /* read straight through, so let it read ahead further */
+    (void)posix_fadvise(fd, offset < 0 ? 0 : offset,
+                        size < 0 ? 0 : size, POSIX_FADV_SEQUENTIAL);
+
+    while(1)
+    {
+        want = size < 0 || size > BUFLEN ? BUFLEN : (size_t)size;
+        if(want == 0)
+            break;
+        if(offset < 0)
+            bytes_read = safe_read(fd, buf, want);
+        else
+        {
+            while((n = pread(fd, buf, want, offset)) < 0 && errno == EINTR)
+                continue;
+            bytes_read = n < 0 ? SAFE_READ_ERROR : (size_t)n;
+        }
+        if(bytes_read == 0)
+            break;
+        if(bytes_read == SAFE_READ_ERROR)
+            return errno;
+
+        if(*length + bytes_read < *length)
+            return EOVERFLOW;
+        *length += bytes_read;
+        *crc = crc_update(*crc, buf, bytes_read);
+        if(offset >= 0)
+            offset += bytes_read;
+        if(size > 0)
+            size -= bytes_read;
+    }
+    return 0;
+}
+
+/* Print the checksum and length in bytes of FILE, as CRC and LENGTH,
+   with FILE if PRINT_NAME */
+static void
+cksum_print(char const* file, uint_fast32_t crc, uintmax_t length,
+            bool print_name)
+{
+    char length_buf[INT_BUFSIZE_BOUND(uintmax_t)];
+    char* hp;
+
+    hp = umaxtostr(length, length_buf);
+
+    for(; length; length >>= 8)
+        crc = ((crc << 8) & 0xFFFFFFFF) ^ crctab[((crc >> 24) ^ length) & 0xFF];
+
+    crc = ~crc & 0xFFFFFFFF;
+
+    if(print_name)
+        printf("%u %s %s\n", (unsigned int)crc, hp, file);
+    else
+        printf("%u %s\n", (unsigned int)crc, hp);
+
+    if(ferror(stdout))
+        error(EXIT_FAILURE, errno, "-: %s", _("write error"));
+}
+
 /* Calculate and print the checksum and length in bytes
    of the file FILE, or of the standard input if FILE is "-".
    If PRINT_NAME is true, print FILE next ot the checksum and size.
@@ -94,74 +340,180 @@ static bool have_read_stdin;
 static bool
 cksum(char* file, bool print_name)
 {
-    unsigned char buf[BUFLEN];
     uint_fast32_t crc = 0;
     uintmax_t length = 0;
-    size_t bytes_read;
-    FILE* fp;
-    char length_buf[INT_BUFSIZE_BOUND(uintmax_t)];
-    char* hp;
+    int fd, err;
 
     if(STREQ(file, "-"))
     {
-        fp = stdin;
+        fd = STDIN_FILENO;
         have_read_stdin = true;
         if(O_BINARY && ! isatty(STDIN_FILENO))
             xfreopen(NULL, "rb", stdin);
     }
     else
     {
-        fp = fopen(file, (O_BINARY ? "rb" : "r"));
-        if(fp == NULL)
+        fd = open(file, O_RDONLY | O_BINARY);
+        if(fd == -1)
         {
             error(0, errno, "%s", file);
             return false;
         }
     }
 
-    while((bytes_read = fread(buf, 1, BUFLEN, fp)) > 0)
+    err = crc_fd(fd, -1, -1, bufs[nworkers], &crc, &length);
+    if(err == EOVERFLOW)
+        error(EXIT_FAILURE, 0, _("%s: file too long"), file);
+    if(err != 0)
     {
-        unsigned char* cp = buf;
-
-        if(length + bytes_read < length)
-            error(EXIT_FAILURE, 0, _("%s: file too long"), file);
-        length += bytes_read;
-        while(bytes_read--)
-            crc = (crc << 8) ^ crctab[((crc >> 24) ^ *cp++) & 0xFF];
-        if(feof(fp))
-            break;
+        error(0, err, "%s", file);
+        if(!STREQ(file, "-"))
+            close(fd);
+        return false;
     }
 
-    if(ferror(fp))
+    if(!STREQ(file, "-") && close(fd) != 0)
     {
         error(0, errno, "%s", file);
-        if(!STREQ(file, "-"))
-            fclose(fp);
         return false;
     }
 
-    if(!STREQ(file, "-") && fclose(fp) == EOF)
+    cksum_print(file, crc, length, print_name);
+    return true;
+}
+
+/* With -j, a file, or a part of one, to checksum */
+struct job
+{
+    char* file;
+    off_t offset;               /* where the part starts */
+    off_t size;                 /* how long it is, -1 for to the end */
+    bool last;                  /* the last part of the file */
+    uint_fast32_t crc;          /* what came of it */
+    uintmax_t length;
+    int err;
+};
+
+/* What all the jobs are, and what the parts of the file being
+   finished add up to */
+struct jobs
+{
+    struct job* job;
+    uint_fast32_t crc;
+    uintmax_t length;
+    int err;
+    bool ok;
+};
+
+static void
+cksum_job(size_t i, size_t worker, void* arg)
+{
+    struct job* j = &((struct jobs*)arg)->job[i];
+    int fd;
+
+    j->crc = 0;
+    j->length = 0;
+    j->err = 0;
+
+    /* standard input is read when its turn comes, as it would be */
+    if(STREQ(j->file, "-"))
+        return;
+
+    if((fd = open(j->file, O_RDONLY | O_BINARY)) == -1)
     {
-        error(0, errno, "%s", file);
-        return false;
+        j->err = errno;
+        return;
     }
+    j->err = crc_fd(fd, j->offset, j->size, bufs[worker], &j->crc,
+                    &j->length);
+    if(close(fd) != 0 && j->err == 0)
+        j->err = errno;
+}
 
-    hp = umaxtostr(length, length_buf);
+/* Add part i to the file it is of, and when that is the last print
+   the file's checksum */
+static void
+cksum_job_done(size_t i, void* arg)
+{
+    struct jobs* js = arg;
+    struct job* j = &js->job[i];
 
-    for(; length; length >>= 8)
-        crc = (crc << 8) ^ crctab[((crc >> 24) ^ length) & 0xFF];
+    if(STREQ(j->file, "-"))
+    {
+        js->ok &= cksum(j->file, true);
+        return;
+    }
 
-    crc = ~crc & 0xFFFFFFFF;
+    if(j->offset == 0)
+    {
+        js->crc = j->crc;
+        js->length = j->length;
+        js->err = j->err;
+    } else if(js->err == 0)
+    {
+        js->err = j->err;
+        /* a part before this one came up short */
+        if(js->err == 0 && js->length != (uintmax_t)j->offset)
+            js->err = -1;
+        js->crc = crc_combine(js->crc, j->crc, j->length);
+        js->length += j->length;
+    }
 
-    if(print_name)
-        printf("%u %s %s\n", (unsigned int)crc, hp, file);
+    if(!j->last)
+        return;
+    if(js->err == EOVERFLOW)
+        error(EXIT_FAILURE, 0, _("%s: file too long"), j->file);
+    if(js->err == -1)
+        error(0, 0, _("%s: file changed as we read it"), j->file);
+    else if(js->err != 0)
+        error(0, js->err, "%s", j->file);
     else
-        printf("%u %s\n", (unsigned int)crc, hp);
+        cksum_print(j->file, js->crc, js->length, true);
+    js->ok &= js->err == 0;
+}
 
-    if(ferror(stdout))
-        error(EXIT_FAILURE, errno, "-: %s", _("write error"));
+/* Checksum the N files in FILES on nworkers threads, with big ones in
+   parts of chunk_size, and print them in order */
+static bool
+cksum_parallel(char** files, size_t n)
+{
+    struct jobs js;
+    size_t i, njobs = 0, alloc = n;
+    struct stat st;
+    off_t off;
 
-    return true;
+    js.job = XNMALLOC(alloc, struct job);
+    js.ok = true;
+    for(i = 0; i < n; i++)
+    {
+        off = 0;
+        if(chunk_size != 0 && !STREQ(files[i], "-") &&
+            stat(files[i], &st) == 0 && S_ISREG(st.st_mode))
+        {
+            for(; (uintmax_t)(st.st_size - off) > chunk_size;
+                off += chunk_size)
+            {
+                if(njobs == alloc)
+                    js.job = x2nrealloc(js.job, &alloc, sizeof *js.job);
+                js.job[njobs].file = files[i];
+                js.job[njobs].offset = off;
+                js.job[njobs].size = chunk_size;
+                js.job[njobs++].last = false;
+            }
+        }
+
+        /* the rest, and whatever it has grown by */
+        if(njobs == alloc)
+            js.job = x2nrealloc(js.job, &alloc, sizeof *js.job);
+        js.job[njobs].file = files[i];
+        js.job[njobs].offset = off;
+        js.job[njobs].size = -1;
+        js.job[njobs++].last = true;
+    }
+
+    ordered_jobs(njobs, nworkers, cksum_job, cksum_job_done, &js);
+    free(js.job);
+    return js.ok;
 }
 
 
@@ -173,13 +525,15 @@ void usage(int status)
     else
     {
         printf(_("\
-Usage: %s [FILE]...\n\
-   or: %s [OPTION]\n\
+Usage: %s [OPTION]... [FILE]...\n\
 "),
-                    program_name, program_name);
+                    program_name);
         fputs(_("\
 Print CRC checksum and bytes counts of each FILE.\n\
 \n\
+  -j, --jobs=N          checksum up to N files at once\n\
+      --chunk-size=SIZE  with -j, checksum files larger than SIZE bytes\n\
+                          in parts of SIZE at once\n\
 "), stdout);
         fputs(HELP_OPTION_DESCRIPTION, stdout);
         fputs(VERSION_OPTION_DESCRIPTION, stdout);
@@ -190,8 +544,9 @@ Print CRC checksum and bytes counts of each FILE.\n\
 
 int main(int argc, char** argv)
 {
-    int i;
+    int i, optc;
     bool ok;
+    uintmax_t n;
 
     initialize_main(&argc, &argv);
     set_program_name(argv[0]);
@@ -200,15 +555,48 @@ int main(int argc, char** argv)
 
     atexit(close_stdout);
 
-    parse_long_options(argc, argv, PROGRAM_NAME, PACKAGE, Version,
-                          usage, AUTHORS, (char*)NULL);
-    if(getopt_long(argc, argv, "", NULL, NULL) != -1)
-        usage(EXIT_FAILURE);
+    while((optc = getopt_long(argc, argv, "j:", longopts, NULL)) != -1)
+    {
+        switch(optc)
+        {
+            case 'j':
+                if(xstrtoumax(optarg, NULL, 10, &n, "") != LONGINT_OK ||
+                    n == 0 || n > 1024)
+                    error(EXIT_FAILURE, 0, _("invalid number of jobs: %s"),
+                            quote(optarg));
+                nworkers = n;
+                break;
+
+            case CHUNK_SIZE_OPTION:
+                if(xstrtoumax(optarg, NULL, 10, &chunk_size, "kKmMGT") !=
+                    LONGINT_OK || chunk_size == 0 ||
+                    chunk_size > TYPE_MAXIMUM(off_t))
+                    error(EXIT_FAILURE, 0, _("invalid chunk size: %s"),
+                            quote(optarg));
+                break;
+
+            case_GETOPT_HELP_CHAR;
+
+            case_GETOPT_VERSION_CHAR(PROGRAM_NAME, AUTHORS);
+
+            default:
+                usage(EXIT_FAILURE);
+        }
+    }
 
     have_read_stdin = false;
 
+    crc_init();
+    crc_choose();
+    bufs = XNMALLOC(nworkers + 1, unsigned char*);
+    for(n = 0; n <= nworkers; n++)
+        if(posix_memalign((void**)&bufs[n], getpagesize(), BUFLEN) != 0)
+            xalloc_die();
+
     if(optind == argc)
         ok = cksum("-", false);
+    else if(nworkers > 1)
+        ok = cksum_parallel(argv + optind, argc - optind);
     else
     {
         ok = true;
@@ -9,6 +9,7 @@
 #include <stdbool.h>
 #include <string.h>
 #include <ctype.h>
+#include <unistd.h>
 
 #include "system.h"
 #include "quote.h"
@@ -27,6 +28,9 @@
 # define STREQ(a, b) (strcmp((a), (b)) == 0)
 #endif
 
+/* Bytes of output gathered before each write() by seq_fast() */
+#define SEQ_BUFSIZE (128 * 1024)
+
 #define PROGRAM_NAME "seq"
 #define AUTHORS "Ulrich Drepper"
 
@@ -285,6 +289,136 @@ print_numbers(char* fmt, struct layout layout,
     }
 }
 
+/* Return true if S is all decimal digits, and some */
+static bool
+all_digits_p(char const* s)
+{
+    size_t n = strlen(s);
+    return n != 0 && strspn(s, "0123456789") == n;
+}
+
+/* S without its leading zeroes, but for the last digit */
+static char const*
+skip_zeroes(char const* s)
+{
+    while(*s == '0' && s[1])
+        s++;
+    return s;
+}
+
+/* Write the N bytes at BUF to standard output, or die trying */
+static void
+seq_write(char const* buf, size_t n)
+{
+    ssize_t w;
+
+    while(n > 0)
+    {
+        w = write(STDOUT_FILENO, buf, n);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            error(EXIT_FAILURE, errno, _("write error"));
+        buf += w;
+        n -= w;
+    }
+}
+
+/* Add the N bytes at S to the output gathered in OUT, *O bytes so far,
+   writing it out when it is full */
+static void
+seq_put(char* out, size_t* o, char const* s, size_t n)
+{
+    if(SEQ_BUFSIZE - *o < n)
+    {
+        seq_write(out, *o);
+        *o = 0;
+    }
+    if(n > SEQ_BUFSIZE)
+        seq_write(s, n);
+    else
+    {
+        memcpy(out + *o, s, n);
+        *o += n;
+    }
+}
+
+/* Print the integers from A to B in steps of STEP, all strings of
+   decimal digits and STEP not 0, as the default format would, but
+   without going through long double or printf: the current number is
+   kept as digits, added to in place, and the output gathered in a big
+   buffer. Numbers of any length come out exactly. */
+static void
+seq_fast(char const* a, char const* step, char const* b)
+{
+    size_t a_len, step_len, b_len, size, sep_len = strlen(separator);
+    char* x;
+    char* p;
+    char* end;
+    char* out;
+    size_t o = 0;
+
+    a = skip_zeroes(a);
+    step = skip_zeroes(step);
+    b = skip_zeroes(b);
+    a_len = strlen(a);
+    step_len = strlen(step);
+    b_len = strlen(b);
+
+    if(a_len > b_len || (a_len == b_len && memcmp(a, b, a_len) > 0))
+        return;
+
+    /* room for X to grow past B by STEP, with zeroes before it to add
+       into */
+    size = MAX(b_len, step_len) + 1;
+    x = xmalloc(size);
+    memset(x, '0', size - a_len);
+    end = x + size;
+    p = end - a_len;
+    memcpy(p, a, a_len);
+
+    out = xmalloc(SEQ_BUFSIZE);
+
+    while(1)
+    {
+        char* q = end;
+        char const* s = step + step_len;
+        int d, carry = 0;
+
+        seq_put(out, &o, p, end - p);
+
+        while(s > step)
+        {
+            d = *--q - '0' + *--s - '0' + carry;
+            carry = d >= 10;
+            *q = d - 10 * carry + '0';
+        }
+        while(carry)
+        {
+            if(*--q == '9')
+                *q = '0';
+            else
+            {
+                ++*q;
+                carry = 0;
+            }
+        }
+        if(q < p)
+            p = q;
+
+        if((size_t)(end - p) > b_len
+            || ((size_t)(end - p) == b_len && memcmp(p, b, b_len) > 0))
+            break;
+
+        seq_put(out, &o, separator, sep_len);
+    }
+
+    seq_put(out, &o, terminator, strlen(terminator));
+    seq_write(out, o);
+    free(out);
+    free(x);
+}
+
 /* Return the default format given FIRST, STEP, and LAST */
 static char*
 get_default_format(operand first, operand step, operand last)
@@ -330,6 +464,11 @@ int main(int argc, char** argv)
     operand last;
     struct layout layout = { 0, 0 };
 
+    /* the operands as given */
+    char const* first_str = "1";
+    char const* step_str = "1";
+    char const* last_str;
+
     /* the printf(3) format used for output */
     char* format_str = NULL;
 
@@ -389,16 +528,21 @@ int main(int argc, char** argv)
     if(format_str)
         format_str = long_double_format(format_str, &layout);
 
+    last_str = argv[optind];
     last = scan_arg(argv[optind++]);
 
     if(optind < argc)
     {
         first = last;
+        first_str = last_str;
+        last_str = argv[optind];
         last = scan_arg(argv[optind++]);
 
         if(optind < argc)
         {
             step = last;
+            step_str = last_str;
+            last_str = argv[optind];
             last = scan_arg(argv[optind++]);
         }
     }
@@ -410,6 +554,15 @@ format string may not be specified when printing equal width strings"));
         usage(EXIT_FAILURE);
     }
 
+    /* plain counting needs no floating point */
+    if(format_str == NULL && !equal_width && all_digits_p(first_str)
+        && all_digits_p(step_str) && all_digits_p(last_str)
+        && *skip_zeroes(step_str) != '0')
+    {
+        seq_fast(first_str, step_str, last_str);
+        exit(EXIT_SUCCESS);
+    }
+
     if(format_str == NULL)
         format_str = get_default_format(first, step, last);
 
@@ -10,11 +10,19 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#ifdef __SSE2__
+# include <emmintrin.h>
+#endif
+
 #include "system.h"
 #include "xfreopen.h"
 #include "human.h"
 #include "safe-read.h"
 #include "closeout.h"
+#include "xalloc.h"
+#include "xstrtol.h"
+#include "quote.h"
+#include "ordered-jobs.h"
 
 #define PROGRAM_NAME "sum"
 #define AUTHORS "Kayvan Aghaiepour & David Mackenzie"
@@ -25,12 +33,23 @@
 #define O_BINARY 0x0000
 #endif
 
+/* Number of bytes to read at once. */
+#define BUFLEN (1 << 18)
+
 /* True if any of the files read were the standard input */
 static bool have_read_stdin;
 
+/* How many files to checksum at once */
+static size_t nworkers = 1;
+
+/* The buffers files are read into, page aligned: one for each worker,
+   and the last for what is read on the calling thread */
+static unsigned char** bufs;
+
 static struct option longopts[] =
 {
     {"sysv", no_argument, NULL, 's'},
+    {"jobs", required_argument, NULL, 'j'},
     {GETOPT_HELP_OPTION_DECL},
     {GETOPT_VERSION_OPTION_DECL},
     {NULL, 0, NULL, 0}
@@ -50,6 +69,7 @@ Usage: %s [OPTION]... [FILE]...\n\
         fputs(_("\
 Print checksum and block counts for each FILE.\n\
 \n\
+  -j, --jobs=N  checksum up to N files at once\n\
   -r            use BSD sum algorithm, use 1K blocks\n\
   -s, --sysv    use System V sum algorithm, use 512 bytes blocks\n\
 "), stdout);
@@ -64,149 +84,239 @@ With no FILE, or when FILE is -, read standard input.\n\
     exit(status);
 }
 
-/* Calculate and print the rotated checksum and the size in 1K blocks
-   of file FILE, or of the standard input if FILE is "-".
-   If PRINT_NAME is >1, print FILE next to the checksum and size.
-   The checksum varies depending on sizeof (int).
-   Return true if sucessful. */
-static bool
-bsd_sum_file(char* file, int print_name)
+/* What a file's checksum came to */
+struct sum
 {
-    FILE* fp;
-    int checksum = 0;           /* The checksum mod 2^16 */
-    uintmax_t total_bytes = 0;  /* The number of bytes */
-    int ch;                     /* Each character read */
-    char hbuf[LONGEST_HUMAN_READABLE + 1];
-    bool is_stdin = STREQ(file, "-");
+    int checksum;
+    uintmax_t total_bytes;
+    int err;                    /* errno if it could not be read, else 0 */
+};
 
-    if(is_stdin)
+/* Open FILE, or take the standard input if FILE is "-", to be summed.
+   Return the descriptor, or -1 with errno set. */
+static int
+sum_open(char const* file)
+{
+    if(STREQ(file, "-"))
     {
-        fp = stdin;
         have_read_stdin = true;
         if(O_BINARY && ! isatty(STDIN_FILENO))
             xfreopen(NULL, "rb", stdin);
+        return STDIN_FILENO;
     }
-    else
+    return open(file, O_RDONLY | O_BINARY);
+}
+
+/* Read the rest of FD, opened by sum_open(FILE), a buffer at a time
+   into BUF, handing each to BLOCK with STATE; add up the bytes read
+   into *SUM, with the errno of what went wrong if anything did */
+static void
+sum_read(char const* file, int fd, unsigned char* buf,
+         void (*block)(void*, unsigned char const*, size_t), void* state,
+         struct sum* sum)
+{
+    size_t bytes_read;
+
+    sum->err = 0;
+    sum->total_bytes = 0;
+
+    /* read straight through, so let it read ahead further */
+    (void)posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    while((bytes_read = safe_read(fd, buf, BUFLEN)) != 0)
     {
-        fp = fopen(file, (O_BINARY ? "rb" : "r"));
-        if(fp == NULL)
+        if(bytes_read == SAFE_READ_ERROR)
         {
-            error(0, errno, "%s", file);
-            return false;
+            sum->err = errno;
+            break;
         }
+        block(state, buf, bytes_read);
+        sum->total_bytes += bytes_read;
     }
 
-    while((ch = getc(fp)) != EOF)
-    {
-        total_bytes++;
-        checksum = (checksum >> 1) + ((checksum & 1) << 15);
-        checksum += ch;
-        checksum &= 0xffff;     /* Keep it within bounds */
-    }
+    if(!STREQ(file, "-") && close(fd) != 0 && sum->err == 0)
+        sum->err = errno;
+}
 
-    if(ferror(fp))
-    {
-        error(0, errno, "%s", file);
-        if(!is_stdin)
-            fclose(fp);
-        return false;
-    }
+/* Rotate the BSD checksum at STATE on through the LEN bytes at BUF.
+   Each step rotates what came before, and the add carries out of the
+   low bits, so the sum of a block can't be worked out apart from what
+   came before it: this is as far as it goes, one byte at a time. Kept
+   in 16 bits the step is a 16 bit rotate and add, with nothing to mask */
+static void
+bsd_sum_block(void* state, unsigned char const* buf, size_t len)
+{
+    uint16_t checksum = *(unsigned int*)state;
+    unsigned char const* end = buf + len;
+
+    for(; buf < end; buf++)
+        checksum = (uint16_t)((checksum >> 1 | checksum << 15) + *buf);
+
+    *(unsigned int*)state = checksum;
+}
+
+/* Calculate the rotated checksum and the size of file FILE, or of the
+   standard input if FILE is "-", into *SUM, reading through BUF.
+   The checksum varies depending on sizeof (int). */
+static void
+bsd_sum(char const* file, unsigned char* buf, struct sum* sum)
+{
+    unsigned int checksum = 0;  /* The checksum mod 2^16 */
+    int fd;
 
-    if(!is_stdin && fclose(fp) != 0)
+    if((fd = sum_open(file)) == -1)
     {
-        error(0, errno, "%s", file);
-        return false;
+        sum->err = errno;
+        return;
     }
+    sum_read(file, fd, buf, bsd_sum_block, &checksum, sum);
+    sum->checksum = checksum;
+}
+
+/* Print SUM of FILE with the size in 1K blocks.
+   If PRINT_NAME is >1, print FILE next to the checksum and size. */
+static void
+bsd_sum_print(char const* file, struct sum const* sum, int print_name)
+{
+    char hbuf[LONGEST_HUMAN_READABLE + 1];
 
-    printf("%05d %5s", checksum,
-            human_readable(total_bytes, hbuf, human_ceiling, 1, 1024));
+    printf("%05d %5s", sum->checksum,
+            human_readable(sum->total_bytes, hbuf, human_ceiling, 1, 1024));
     if(print_name > 1)
         printf(" %s", file);
     putchar('\n');
-
-    return true;
 }
 
-/* Calculate and print the checksum and the size in 512-byte blocks
-   of file FILE, or of the standard input if FILE is "-".
-   If PRINT_NAME >0, print FILE next to the checksum and size.
-   Return true if successful. */
-static bool sysv_sum_file(char* file, int print_name)
+/* Add the LEN bytes at BUF to the SysV sum at STATE, a uint_fast64_t.
+   The sum is only kept mod 2^32, so the order doesn't matter: with
+   SSE2, PSADBW adds up 16 bytes at a time into two 64 bit lanes, four
+   of them side by side */
+static void
+sysv_sum_block(void* state, unsigned char const* buf, size_t len)
 {
-    int fd;
-    unsigned char buf[8192];
-    uintmax_t total_bytes = 0;
-    char hbuf[LONGEST_HUMAN_READABLE + 1];
-    int r;
-    int checksum;
+    uint_fast64_t s = 0;
 
-    /* The sum of all the input bytes, modulo (UINT_MAX + 1). */
-    unsigned int s = 0;
+#ifdef __SSE2__
+    __m128i const zero = _mm_setzero_si128();
+    __m128i a0 = zero, a1 = zero, a2 = zero, a3 = zero;
+    uint64_t lanes[2];
 
-    bool is_stdin = STREQ(file, "-");
+# define SAD(p) _mm_sad_epu8(_mm_loadu_si128((__m128i const*)(p)), zero)
 
-    if(is_stdin)
+    for(; len >= 64; len -= 64, buf += 64)
     {
-        fd = STDIN_FILENO;
-        have_read_stdin = true;
-        if(O_BINARY && ! isatty(STDIN_FILENO))
-            xfreopen(NULL, "rb", stdin);
-    }
-    else
-    {
-        fd = open(file, O_RDONLY | O_BINARY);
-        if(fd == -1)
-        {
-            error(0, errno, "%s", file);
-            return false;
-        }
+        a0 = _mm_add_epi64(a0, SAD(buf));
+        a1 = _mm_add_epi64(a1, SAD(buf + 16));
+        a2 = _mm_add_epi64(a2, SAD(buf + 32));
+        a3 = _mm_add_epi64(a3, SAD(buf + 48));
     }
+    for(; len >= 16; len -= 16, buf += 16)
+        a0 = _mm_add_epi64(a0, SAD(buf));
 
-    while(1)
-    {
-        size_t i;
-        size_t bytes_read = safe_read(fd, buf, sizeof buf);
+# undef SAD
 
-        if(bytes_read == 0)
-            break;
+    a0 = _mm_add_epi64(_mm_add_epi64(a0, a1), _mm_add_epi64(a2, a3));
+    _mm_storeu_si128((__m128i*)lanes, a0);
+    s = lanes[0] + lanes[1];
+#endif
 
-        if(bytes_read == SAFE_READ_ERROR)
-        {
-            error(0, errno, "%s", file);
-            if(!is_stdin)
-                close(fd);
-            return false;
-        }
+    for(; len > 0; len--)
+        s += *buf++;
 
-        for(i = 0; i < bytes_read; i++)
-            s += buf[i];
-        total_bytes += bytes_read;
-    }
+    *(uint_fast64_t*)state += s;
+}
+
+/* Calculate the checksum and the size of file FILE, or of the standard
+   input if FILE is "-", into *SUM, reading through BUF. */
+static void
+sysv_sum(char const* file, unsigned char* buf, struct sum* sum)
+{
+    int fd;
+    int r;
+
+    /* The sum of all the input bytes, modulo 2^32 or more. */
+    uint_fast64_t s = 0;
 
-    if(!is_stdin && close(fd) != 0)
+    if((fd = sum_open(file)) == -1)
     {
-        error(0, errno, "%s", file);
-        return false;
+        sum->err = errno;
+        return;
     }
+    sum_read(file, fd, buf, sysv_sum_block, &s, sum);
 
     r = (s & 0xffff) + ((s & 0xffffffff) >> 16);
-    checksum = (r & 0xffff) + (r >> 16);
+    sum->checksum = (r & 0xffff) + (r >> 16);
+}
+
+/* Print SUM of FILE with the size in 512-byte blocks.
+   If PRINT_NAME >0, print FILE next to the checksum and size. */
+static void
+sysv_sum_print(char const* file, struct sum const* sum, int print_name)
+{
+    char hbuf[LONGEST_HUMAN_READABLE + 1];
 
-    printf("%05d %5s", checksum,
-            human_readable(total_bytes, hbuf, human_ceiling, 1, 512));
+    printf("%05d %5s", sum->checksum,
+            human_readable(sum->total_bytes, hbuf, human_ceiling, 1, 512));
     if(print_name)
         printf(" %s", file);
     putchar('\n');
+}
 
+/* The algorithm chosen, -r or -s */
+static void (*sum_func)(char const*, unsigned char*, struct sum*) = bsd_sum;
+static void (*sum_print)(char const*, struct sum const*, int) = bsd_sum_print;
+
+/* Print SUM of FILE, or what went wrong reading it.
+   Return true if there was nothing wrong. */
+static bool
+sum_report(char const* file, struct sum const* sum, int print_name)
+{
+    if(sum->err != 0)
+    {
+        error(0, sum->err, "%s", file);
+        return false;
+    }
+    sum_print(file, sum, print_name);
     return true;
 }
 
+/* With -j, the files and what each came to */
+struct sum_jobs
+{
+    char** files;
+    struct sum* sums;
+    int print_name;
+    bool ok;
+};
+
+static void
+sum_job(size_t i, size_t worker, void* arg)
+{
+    struct sum_jobs* js = arg;
+
+    /* standard input is read when its turn comes, as it would be */
+    if(!STREQ(js->files[i], "-"))
+        sum_func(js->files[i], bufs[worker], &js->sums[i]);
+}
+
+static void
+sum_job_done(size_t i, void* arg)
+{
+    struct sum_jobs* js = arg;
+
+    if(STREQ(js->files[i], "-"))
+        sum_func(js->files[i], bufs[nworkers], &js->sums[i]);
+    js->ok &= sum_report(js->files[i], &js->sums[i], js->print_name);
+}
+
 int main(int argc, char** argv)
 {
     bool ok;
     int  optc;
     int  files_given;
-    bool (*sum_func)(char*, int) = bsd_sum_file;
+    uintmax_t n;
+    struct sum sum;
+    struct sum_jobs js;
 
     initialize_main(&argc, &argv);
     set_program_name(argv[0]);
@@ -222,16 +332,26 @@ int main(int argc, char** argv)
 
     have_read_stdin = false;
 
-    while((optc = getopt_long(argc, argv, "rs", longopts, NULL)) != -1)
+    while((optc = getopt_long(argc, argv, "j:rs", longopts, NULL)) != -1)
     {
         switch(optc)
         {
+            case 'j':
+                if(xstrtoumax(optarg, NULL, 10, &n, "") != LONGINT_OK ||
+                    n == 0 || n > 1024)
+                    error(EXIT_FAILURE, 0, _("invalid number of jobs: %s"),
+                            quote(optarg));
+                nworkers = n;
+                break;
+
             case 'r':       /* For SysV compatibility */
-                sum_func = bsd_sum_file;
+                sum_func = bsd_sum;
+                sum_print = bsd_sum_print;
                 break;
 
             case 's':
-                sum_func = sysv_sum_file;
+                sum_func = sysv_sum;
+                sum_print = sysv_sum_print;
                 break;
 
             case_GETOPT_HELP_CHAR;
@@ -243,12 +363,33 @@ int main(int argc, char** argv)
         }
     }
 
+    bufs = XNMALLOC(nworkers + 1, unsigned char*);
+    for(n = 0; n <= nworkers; n++)
+        if(posix_memalign((void**)&bufs[n], getpagesize(), BUFLEN) != 0)
+            xalloc_die();
+
     files_given = argc - optind;
     if(files_given <= 0)
-        ok = sum_func("-", files_given);
+    {
+        sum_func("-", bufs[nworkers], &sum);
+        ok = sum_report("-", &sum, files_given);
+    }
+    else if(nworkers > 1)
+    {
+        js.files = argv + optind;
+        js.sums = XNMALLOC(files_given, struct sum);
+        js.print_name = files_given;
+        js.ok = true;
+        ordered_jobs(files_given, nworkers, sum_job, sum_job_done, &js);
+        free(js.sums);
+        ok = js.ok;
+    }
     else
         for(ok = true; optind < argc; optind++)
-            ok &= sum_func(argv[optind], files_given);
+        {
+            sum_func(argv[optind], bufs[nworkers], &sum);
+            ok &= sum_report(argv[optind], &sum, files_given);
+        }
 
     if(have_read_stdin && fclose(stdin) == EOF)
         error(EXIT_FAILURE, errno, "-");
@@ -10,12 +10,20 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "system.h"
 #include "closeout.h"
 #include "long-options.h"
 #include "xalloc.h"
 #include "xfreopen.h"
+#include "argmatch.h"
+#include "inttostr.h"
+#include "quote.h"
+#include "xstrtol.h"
 
 #ifndef O_BINARY
 #define O_BINARY 0x0000
@@ -29,7 +37,15 @@
 
 #define AUTHORS "Mike Parker, Richard M. Stallman & David MacKenzie"
 
+/* Most bytes copied at once */
+#define TEE_BUFSIZE (128 * 1024)
+
+#if defined SPLICE_F_MOVE && defined F_GETPIPE_SZ
+# define USE_SPLICE 1
+#endif
+
 static bool tee_files(int nfiles, char** files);
+static void stats_handler(int sig ATTRIBUTE_UNUSED);
 
 /* If true, append to output files rather than truncating them */
 static bool append;
@@ -37,10 +53,65 @@ static bool append;
 /* If true, ignoring interrupts */
 static bool ignore_interrupts;
 
+/* With --nonblocking, what to do when an output's buffer is full */
+enum full_policy
+{
+    FULL_BLOCK,                 /* read no more until it has room */
+    FULL_DROP,                  /* throw away what does not fit */
+    FULL_DISCONNECT             /* stop writing to that output */
+};
+
+static char* full_args[] =
+{
+    "block", "drop", "disconnect", NULL
+};
+
+static enum full_policy full_types[] =
+{
+    FULL_BLOCK, FULL_DROP, FULL_DISCONNECT
+};
+
+ARGMATCH_VERIFY (full_args, full_types);
+
+/* If true, write to outputs without waiting on any one of them,
+   buffering what each can't take yet */
+static bool nonblocking;
+
+/* With --nonblocking, how much to buffer for each output */
+static size_t output_buffer_size = 1024 * 1024;
+
+/* With --nonblocking, what to do when that is full */
+static enum full_policy full_policy = FULL_BLOCK;
+
+/* If true, report what went to each output at the end and on SIGUSR1 */
+static bool print_stats;
+
+/* Set on SIGUSR1, for the stats to be printed */
+static volatile sig_atomic_t stats_wanted;
+
+/* With --nonblocking, the outputs made non-blocking and how many of
+   them, for their flags to be put back however tee ends */
+static struct tee_output* nonblocking_outputs;
+static volatile sig_atomic_t nonblocking_count;
+
+/* For long options that have no equivalent short option, use a
+   non-character as a pseudo short option, starting with CHAR_MAX + 1 */
+enum
+{
+    NONBLOCKING_OPTION = CHAR_MAX + 1,
+    OUTPUT_BUFFER_OPTION,
+    ON_FULL_OPTION,
+    STATS_OPTION
+};
+
 static struct option long_options[] =
 {
     {"append", no_argument, NULL, 'a'},
     {"ignore-interrupts", no_argument, NULL, 'i'},
+    {"nonblocking", no_argument, NULL, NONBLOCKING_OPTION},
+    {"output-buffer", required_argument, NULL, OUTPUT_BUFFER_OPTION},
+    {"on-full", required_argument, NULL, ON_FULL_OPTION},
+    {"stats", no_argument, NULL, STATS_OPTION},
     {GETOPT_HELP_OPTION_DECL},
     {GETOPT_VERSION_OPTION_DECL},
     {NULL, 0, NULL, 0}
@@ -59,6 +130,17 @@ Copy standard input to each FILE, and also to standard output.\n\
 \n\
   -a, --append              append to the given FILEs, do not overwrite\n\
   -i, --ignore-interrupts   ignore interrupts signals\n\
+      --nonblocking         don't let a slow output hold up the others:\n\
+                              keep what it can't take yet in a buffer\n\
+      --output-buffer=SIZE  with --nonblocking, buffer up to SIZE bytes\n\
+                              for each output (default 1M)\n\
+      --on-full=POLICY      with --nonblocking, when an output's buffer is\n\
+                              full: block (read no more until it has room),\n\
+                              drop (lose what does not fit) or disconnect\n\
+                              (stop writing to it); the default is block\n\
+      --stats               with --nonblocking, report the bytes written,\n\
+                              dropped and buffered for each output at the\n\
+                              end, and on SIGUSR1\n\
 "), stdout);
         fputs(HELP_OPTION_DESCRIPTION, stdout);
         fputs(VERSION_OPTION_DESCRIPTION, stdout);
@@ -98,6 +180,30 @@ int main(int argc, char** argv)
                 ignore_interrupts = true;
                 break;
 
+            case NONBLOCKING_OPTION:
+                nonblocking = true;
+                break;
+
+            case OUTPUT_BUFFER_OPTION:
+            {
+                uintmax_t n;
+                if(xstrtoumax(optarg, NULL, 10, &n, "kKmMGT") != LONGINT_OK
+                    || n == 0 || n > SIZE_MAX)
+                    error(EXIT_FAILURE, 0, _("invalid buffer size: %s"),
+                            quote(optarg));
+                output_buffer_size = n;
+                break;
+            }
+
+            case ON_FULL_OPTION:
+                full_policy = XARGMATCH("--on-full", optarg, full_args,
+                                        full_types);
+                break;
+
+            case STATS_OPTION:
+                print_stats = true;
+                break;
+
             case_GETOPT_HELP_CHAR;
 
             case_GETOPT_VERSION_CHAR(PROGRAM_NAME, AUTHORS);
@@ -109,6 +215,8 @@ int main(int argc, char** argv)
 
     if(ignore_interrupts)
         signal(SIGINT, SIG_DFL);
+    if(nonblocking && print_stats)
+        signal(SIGUSR1, stats_handler);
 
     /* Do *not* warn if tee is given no file arguments.
        POSIX requires that it work when given no arguments */
@@ -120,21 +228,606 @@ int main(int argc, char** argv)
     exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
+/* Write all N bytes at BUF to FD.
+   Return false, with errno set, if they can't all be written. */
+static bool
+write_all(int fd, char const* buf, size_t n)
+{
+    ssize_t w;
+
+    while(n > 0)
+    {
+        w = write(fd, buf, n);
+        if(w < 0 && errno == EINTR)
+            continue;
+        if(w <= 0)
+            return false;
+        buf += w;
+        n -= w;
+    }
+    return true;
+}
+
+/* Read N bytes, that are known to be there, from FD into BUF.
+   Return false, with errno set, if they can't be. */
+static bool
+read_all(int fd, char* buf, size_t n)
+{
+    ssize_t r;
+
+    while(n > 0)
+    {
+        r = read(fd, buf, n);
+        if(r < 0 && errno == EINTR)
+            continue;
+        if(r < 0)
+            return false;
+        if(r == 0)
+        {
+            errno = EIO;
+            return false;
+        }
+        buf += r;
+        n -= r;
+    }
+    return true;
+}
+
+/* Copy the standard input through BUF to the NFILES + 1 DESCRIPTORS,
+   named FILES, giving up on any that can't be written to.
+   Return true if successful. */
+static bool
+tee_copy(int nfiles, char** files, int* descriptors, char* buf)
+{
+    ssize_t bytes_read;
+    int i;
+    bool ok = true;
+
+    while(1)
+    {
+        bytes_read = read(STDIN_FILENO, buf, TEE_BUFSIZE);
+#ifdef EINTR
+        if(bytes_read < 0 && errno == EINTR)
+            continue;
+#endif
+        if(bytes_read <= 0)
+            break;
+
+        /* Write to all NFILES + 1 descriptors.
+           Standard output is the first one */
+        for(i = 0; i <= nfiles; i++)
+            if(descriptors[i] >= 0
+                && !write_all(descriptors[i], buf, bytes_read))
+            {
+                error(0, errno, "%s", files[i]);
+                descriptors[i] = -1;
+                ok = false;
+            }
+    }
+
+    if(bytes_read == -1)
+    {
+        error(0, errno, _("read error"));
+        ok = false;
+    }
+    return ok;
+}
+
+#ifdef USE_SPLICE
+/* Move N bytes out of the pipe FROM to FD, with splice() while *SPLICE_OK,
+   else through BUF; that goes for good once FD turns out not to take it.
+   Return false, with errno set, if they can't all be written. */
+static bool
+tee_drain(int from, int fd, size_t n, bool* splice_ok, char* buf)
+{
+    ssize_t m;
+
+    while(n > 0)
+    {
+        if(*splice_ok)
+        {
+            m = splice(from, NULL, fd, NULL, n, SPLICE_F_MOVE);
+            if(m < 0 && errno == EINTR)
+                continue;
+            if(m < 0 && errno == EINVAL)
+            {
+                *splice_ok = false;
+                continue;
+            }
+            if(m <= 0)
+                return false;
+        } else
+        {
+            m = n;
+            if(!read_all(from, buf, m) || !write_all(fd, buf, m))
+                return false;
+        }
+        n -= m;
+    }
+    return true;
+}
+
+/* Copy the standard input, a pipe, to the NFILES + 1 DESCRIPTORS without
+   bringing it into user space. A round at a time, tee() duplicates what
+   is in it into an empty pipe of ours for each output but the last,
+   the data is moved into the last one's, and each is spliced on to its
+   output. Should tee() fall short, which a pipe of ours as big as the
+   input shouldn't, the round is read into BUF.
+   Return true when the input is used up, with *OK false if anything
+   went wrong, or false to copy the rest the usual way: at the start if
+   tee() can't be had, or once there are no outputs left. */
+static bool
+tee_splice(int nfiles, char** files, int* descriptors, char* buf, bool* ok)
+{
+    int (*mid)[2];
+    size_t* got;
+    bool* splice_ok;
+    int pipe_size;
+    int i, first, last;
+    size_t n, moved;
+    ssize_t m;
+    bool done = true, started = false, fell_short;
+
+    if((pipe_size = fcntl(STDIN_FILENO, F_GETPIPE_SZ)) <= 0)
+        return false;
+    if(pipe_size > TEE_BUFSIZE)
+        pipe_size = TEE_BUFSIZE;
+
+    mid = xnmalloc(nfiles + 1, sizeof *mid);
+    got = xnmalloc(nfiles + 1, sizeof *got);
+    splice_ok = xnmalloc(nfiles + 1, sizeof *splice_ok);
+    for(i = 0; i <= nfiles; i++)
+    {
+        mid[i][0] = mid[i][1] = -1;
+        splice_ok[i] = true;
+        if(descriptors[i] >= 0 && pipe(mid[i]) != 0)
+        {
+            done = false;
+            goto free;
+        }
+        /* as big as what will be put in it at once */
+        if(descriptors[i] >= 0)
+            (void)fcntl(mid[i][1], F_SETPIPE_SZ, pipe_size);
+    }
+
+    while(1)
+    {
+        /* the first output and the last: the last takes the data */
+        for(first = 0; first <= nfiles && descriptors[first] < 0; first++)
+            continue;
+        for(last = nfiles; last >= 0 && descriptors[last] < 0; last--)
+            continue;
+        if(last < 0)
+        {
+            done = false;
+            break;
+        }
+
+        /* all but the last get a copy, the first saying how much */
+        n = pipe_size;
+        fell_short = false;
+        for(i = first; i < last; i++)
+        {
+            if(descriptors[i] < 0)
+                continue;
+            while((m = tee(STDIN_FILENO, mid[i][1], n, 0)) < 0 &&
+                    errno == EINTR)
+                continue;
+            if(m < 0 && !started && errno == EINVAL)
+            {
+                done = false;
+                goto free;
+            }
+            if(m < 0)
+            {
+                error(0, errno, _("read error"));
+                *ok = false;
+                goto free;
+            }
+            started = true;
+            if(i == first)
+                n = m;
+            if(n == 0)
+                goto free;
+            got[i] = m;
+            fell_short |= got[i] < n;
+        }
+
+        if(fell_short)
+        {
+            /* take the round out of the input the slow way, and give
+               each what tee() did not */
+            if(!read_all(STDIN_FILENO, buf, n))
+            {
+                error(0, errno, _("read error"));
+                *ok = false;
+                goto free;
+            }
+            for(i = first; i <= last; i++)
+                if(descriptors[i] >= 0
+                    && ((i < last &&
+                         !tee_drain(mid[i][0], descriptors[i], got[i],
+                                    &splice_ok[i], buf + n)) ||
+                        !write_all(descriptors[i], buf + (i < last ? got[i] : 0),
+                                   n - (i < last ? got[i] : 0))))
+                {
+                    error(0, errno, "%s", files[i]);
+                    descriptors[i] = -1;
+                    *ok = false;
+                }
+            continue;
+        }
+
+        /* the last takes the data itself, all n of it, or whatever
+           there is when it is the only one */
+        for(moved = 0; first == last ? moved == 0 : moved < n; moved += m)
+        {
+            while((m = splice(STDIN_FILENO, NULL, mid[last][1], NULL,
+                              n - moved, SPLICE_F_MOVE)) < 0 && errno == EINTR)
+                continue;
+            if(m < 0 && !started && errno == EINVAL)
+            {
+                done = false;
+                goto free;
+            }
+            if(m <= 0)
+            {
+                if(m < 0)
+                {
+                    error(0, errno, _("read error"));
+                    *ok = false;
+                }
+                goto free;
+            }
+            started = true;
+            if(descriptors[last] >= 0
+                && !tee_drain(mid[last][0], descriptors[last], m,
+                              &splice_ok[last], buf))
+            {
+                error(0, errno, "%s", files[last]);
+                descriptors[last] = -1;
+                *ok = false;
+            }
+        }
+        if(first == last)
+            n = moved;
+
+        for(i = first; i < last; i++)
+            if(descriptors[i] >= 0
+                && !tee_drain(mid[i][0], descriptors[i], n, &splice_ok[i],
+                              buf))
+            {
+                error(0, errno, "%s", files[i]);
+                descriptors[i] = -1;
+                *ok = false;
+            }
+    }
+
+free:
+    for(i = 0; i <= nfiles; i++)
+        if(mid[i][0] >= 0)
+        {
+            close(mid[i][0]);
+            close(mid[i][1]);
+        }
+    free(mid);
+    free(got);
+    free(splice_ok);
+    return done;
+}
+#endif
+
+static void
+stats_handler(int sig ATTRIBUTE_UNUSED)
+{
+    stats_wanted = 1;
+}
+
+/* With --nonblocking, an output and what is waiting to go to it */
+struct tee_output
+{
+    char* name;
+    int index;                  /* in the descriptors */
+    int fd;
+    int flags;                  /* its file status flags, to put back */
+    int copies;                 /* times each read goes to it: "-" is
+                                   standard output again */
+    char* ring;                 /* what it could not take yet */
+    size_t size, start, len;
+    uintmax_t written, dropped, peak;
+    bool live;
+};
+
+/* Put back the file status flags of the outputs made non-blocking.
+   Their open file descriptions can be shared with other processes,
+   which would otherwise be left with O_NONBLOCK set. */
+static void
+restore_flags(void)
+{
+    int j;
+
+    for(j = 0; j < nonblocking_count; j++)
+        if(nonblocking_outputs[j].flags != -1)
+            (void)fcntl(nonblocking_outputs[j].fd, F_SETFL,
+                        nonblocking_outputs[j].flags);
+    nonblocking_count = 0;
+}
+
+/* Put back the outputs' flags, then die of SIG as tee would have */
+static void
+restore_handler(int sig)
+{
+    restore_flags();
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/* Print what has gone to each of the N OUTPUTS so far */
+static void
+tee_stats(struct tee_output* outputs, int n)
+{
+    char b1[INT_BUFSIZE_BOUND(uintmax_t)], b2[INT_BUFSIZE_BOUND(uintmax_t)];
+    char b3[INT_BUFSIZE_BOUND(uintmax_t)], b4[INT_BUFSIZE_BOUND(uintmax_t)];
+    int i;
+
+    for(i = 0; i < n; i++)
+        error(0, 0, _("%s: %s bytes written, %s dropped, %s buffered, "
+                      "%s at most%s"),
+                outputs[i].name, umaxtostr(outputs[i].written, b1),
+                umaxtostr(outputs[i].dropped, b2),
+                umaxtostr(outputs[i].len, b3), umaxtostr(outputs[i].peak, b4),
+                outputs[i].live ? "" : _(", stopped"));
+}
+
+/* Write out as much of what O has waiting as it will take now.
+   Return false, with errno set, if it can't be written to. */
+static bool
+tee_output_flush(struct tee_output* o)
+{
+    struct iovec iov[2];
+    size_t first = MIN(o->len, o->size - o->start);
+    ssize_t w;
+
+    iov[0].iov_base = o->ring + o->start;
+    iov[0].iov_len = first;
+    iov[1].iov_base = o->ring;
+    iov[1].iov_len = o->len - first;
+    while((w = writev(o->fd, iov, iov[1].iov_len ? 2 : 1)) < 0
+            && errno == EINTR)
+        continue;
+    if(w < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK;
+
+    o->written += w;
+    o->len -= w;
+    o->start = o->len ? (o->start + w) % o->size : 0;
+    return true;
+}
+
+/* Give O the N bytes at BUF: straight away if nothing is waiting and it
+   takes them, else into its buffer, as far as the policy allows.
+   Return false, with errno set, if it can't be written to. */
+static bool
+tee_output_put(struct tee_output* o, char const* buf, size_t n)
+{
+    ssize_t w;
+    size_t end, part;
+
+    if(o->len == 0)
+    {
+        while((w = write(o->fd, buf, n)) < 0 && errno == EINTR)
+            continue;
+        if(w < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return false;
+        if(w > 0)
+        {
+            o->written += w;
+            buf += w;
+            n -= w;
+        }
+    }
+    if(n == 0)
+        return true;
+
+    if(n > o->size - o->len)
+    {
+        if(full_policy == FULL_DISCONNECT)
+        {
+            error(0, 0, _("%s: output too slow, no longer written to"),
+                    o->name);
+            o->live = false;
+            o->dropped += o->len;
+            o->len = 0;
+        }
+        o->dropped += n;
+        return true;
+    }
+
+    end = (o->start + o->len) % o->size;
+    part = MIN(n, o->size - end);
+    memcpy(o->ring + end, buf, part);
+    memcpy(o->ring, buf + part, n - part);
+    o->len += n;
+    o->peak = MAX(o->peak, o->len);
+    return true;
+}
+
+/* Copy the standard input through BUF to the NFILES + 1 DESCRIPTORS,
+   named FILES, with them in non-blocking mode, so that one that is slow
+   only holds up the rest if its buffer fills and the policy is block.
+   Regular files always take writes at once (if slowly), so this helps
+   with pipes and sockets. Terminals are left blocking: theirs is most
+   likely the shell's open file description too, and a kill that can't
+   be caught would leave it non-blocking.
+   Return true if successful. */
+static bool
+tee_nonblocking(int nfiles, char** files, int* descriptors, char* buf)
+{
+    struct tee_output* outputs;
+    struct tee_output* o;
+    struct pollfd* fds;
+    int i, j, n = 0, nfds;
+    size_t want;
+    ssize_t bytes_read;
+    bool ok = true, eof = false, pending;
+    static int const sigs[] = {SIGHUP, SIGINT, SIGPIPE, SIGTERM};
+
+    outputs = xnmalloc(nfiles + 1, sizeof *outputs);
+    fds = xnmalloc(nfiles + 2, sizeof *fds);
+
+    /* whether it exits, is killed or dies of a broken pipe, put the
+       outputs' flags back first */
+    nonblocking_outputs = outputs;
+    atexit(restore_flags);
+    for(i = 0; i < (int)(sizeof sigs / sizeof *sigs); i++)
+        if(signal(sigs[i], restore_handler) == SIG_IGN)
+            signal(sigs[i], SIG_IGN);
+
+    /* one output for each descriptor; writing some to one and some to
+       another that is the same would mix up the copies */
+    for(i = 0; i <= nfiles; i++)
+    {
+        if(descriptors[i] < 0)
+            continue;
+        for(j = 0; j < n && outputs[j].fd != descriptors[i]; j++)
+            continue;
+        if(j < n)
+        {
+            outputs[j].copies++;
+            continue;
+        }
+        o = &outputs[n++];
+        memset(o, 0, sizeof *o);
+        o->name = files[i];
+        o->index = i;
+        o->fd = descriptors[i];
+        o->copies = 1;
+        o->live = true;
+        o->flags = isatty(o->fd) ? -1 : fcntl(o->fd, F_GETFL);
+        nonblocking_count = n;
+        if(o->flags != -1)
+            (void)fcntl(o->fd, F_SETFL, o->flags | O_NONBLOCK);
+    }
+    for(j = 0; j < n; j++)
+    {
+        outputs[j].ring = xnmalloc(output_buffer_size, outputs[j].copies);
+        outputs[j].size = output_buffer_size * outputs[j].copies;
+    }
+
+    while(1)
+    {
+        if(stats_wanted)
+        {
+            stats_wanted = 0;
+            tee_stats(outputs, n);
+        }
+
+        /* how much to read: with block, only what all have room for */
+        want = eof ? 0 : TEE_BUFSIZE;
+        pending = false;
+        for(j = 0; j < n; j++)
+        {
+            o = &outputs[j];
+            if(!o->live)
+                continue;
+            if(full_policy == FULL_BLOCK)
+                want = MIN(want, (o->size - o->len) / o->copies);
+            pending |= o->len != 0;
+        }
+        if(eof && !pending)
+            break;
+
+        fds[0].fd = want ? STDIN_FILENO : -1;
+        fds[0].events = POLLIN;
+        for(nfds = 1, j = 0; j < n; j++)
+            if(outputs[j].live && outputs[j].len)
+            {
+                fds[nfds].fd = outputs[j].fd;
+                fds[nfds++].events = POLLOUT;
+            }
+        if(poll(fds, nfds, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            error(EXIT_FAILURE, errno, _("poll error"));
+        }
+
+        /* let the outputs that can take some have it first */
+        for(nfds = 1, j = 0; j < n; j++)
+        {
+            o = &outputs[j];
+            if(!o->live || !o->len)
+                continue;
+            if(fds[nfds++].revents && !tee_output_flush(o))
+            {
+                error(0, errno, "%s", o->name);
+                descriptors[o->index] = -1;
+                o->live = false;
+                ok = false;
+            }
+        }
+
+        if(!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+            continue;
+        bytes_read = read(STDIN_FILENO, buf, want);
+        if(bytes_read < 0 && (errno == EINTR || errno == EAGAIN))
+            continue;
+        if(bytes_read <= 0)
+        {
+            if(bytes_read < 0)
+            {
+                error(0, errno, _("read error"));
+                ok = false;
+            }
+            eof = true;
+            continue;
+        }
+
+        for(j = 0; j < n; j++)
+        {
+            o = &outputs[j];
+            for(i = 0; i < o->copies && o->live; i++)
+                if(!tee_output_put(o, buf, bytes_read))
+                {
+                    error(0, errno, "%s", o->name);
+                    descriptors[o->index] = -1;
+                    o->live = false;
+                    ok = false;
+                }
+            /* stopped for being too slow */
+            if(!o->live && descriptors[o->index] >= 0)
+                ok = false;
+        }
+    }
+
+    if(print_stats)
+        tee_stats(outputs, n);
+
+    restore_flags();
+    for(j = 0; j < n; j++)
+        free(outputs[j].ring);
+    free(outputs);
+    free(fds);
+    return ok;
+}
+
 /* Copy the standard input into each of the FILEs in FILES
    and into the standard output.
    Return true if successful. */
 static bool tee_files(int nfiles, char** files)
 {
-    FILE** descriptors;
-    char   buffer[BUFSIZ];
-    ssize_t bytes_read;
+    int* descriptors;
+    char* buffer;
     int i;
     bool ok = true;
-    char* mode_string = (O_BINARY
-                         ? (append ? "ab" : "wb")
-                         : (append ? "a" : "w"));
+    int flags = (O_WRONLY | O_CREAT | O_BINARY
+                 | (append ? O_APPEND : O_TRUNC));
+#ifdef USE_SPLICE
+    struct stat st;
+#endif
 
     descriptors = xnmalloc(nfiles + 1, sizeof *descriptors);
+    buffer = xmalloc(2 * TEE_BUFSIZE);
 
     /* Move all the names `up' one in the argv array to make room for
        the entry for standard output. This writes into argv[argc]. */
@@ -148,60 +841,41 @@ static bool tee_files(int nfiles, char** files)
 
     /* In the array of NFILES + 1 descriptors, make
        the first one correspond to standard output */
-    descriptors[0] = stdout;
+    descriptors[0] = STDOUT_FILENO;
     files[0] = (char*) _("standard output");
-    setvbuf(stdout, NULL, _IONBF, 0);
 
     for(i = 1; i <= nfiles; i++)
     {
         descriptors[i] = (STREQ(files[i], "-")
-                            ? stdout
-                            : fopen(files[i], mode_string));
-        if(descriptors[i] == NULL)
+                            ? STDOUT_FILENO
+                            : open(files[i], flags, 0666));
+        if(descriptors[i] < 0)
         {
             error(0, errno, "%s", files[i]);
             ok = false;
         }
-        else
-            setvbuf(descriptors[i], NULL, _IONBF, 0);
     }
-    while(1)
-    {
-        bytes_read = read(0, buffer, sizeof buffer);
-#ifdef EINTR
-        if(bytes_read < 0 && errno == EINTR)
-            continue;
-#endif
-        if(bytes_read <= 0)
-            break;
 
-        /* Write to all NFILES + 1 descriptors.
-           Standard output is the first one */
-        for(i = 0; i <= nfiles; i++)
-            if(descriptors[i]
-                && fwrite(buffer, bytes_read, 1, descriptors[i]) != 1)
-            {
-                error(0, errno, "%s", files[i]);
-                descriptors[i] = NULL;
-                ok = false;
-            }
-    }
-
-    if(bytes_read == -1)
-    {
-        error(0, errno, _("read error"));
-        ok = false;
-    }
+    if(nonblocking)
+        ok &= tee_nonblocking(nfiles, files, descriptors, buffer);
+    else
+#ifdef USE_SPLICE
+    /* a pipe in need not pass through here at all */
+    if(!(fstat(STDIN_FILENO, &st) == 0 && S_ISFIFO(st.st_mode)
+         && tee_splice(nfiles, files, descriptors, buffer, &ok)))
+#endif
+        ok &= tee_copy(nfiles, files, descriptors, buffer);
 
     /* Close the files, but not standard output */
     for(i = 1; i <= nfiles; i++)
         if(!STREQ(files[i], "-")
-            && descriptors[i] && fclose(descriptors[i]) != 0)
+            && descriptors[i] >= 0 && close(descriptors[i]) != 0)
         {
             error(0, errno, "%s", files[i]);
             ok = false;
         }
 
+    free(buffer);
     free(descriptors);
 
     return ok;
@@ -4,17 +4,26 @@
 #include <sys/types.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 
 #include "system.h"
 #include "closeout.h"
 #include "long-options.h"
 #include "version.h"
 #include "error.h"
+#include "xalloc.h"
 
 #define PROGRAM_NAME "yes"
 #define AUTHORS "David MacKenzie"
 
+/* Least number of bytes written at once */
+#define YES_BUFSIZE (64 * 1024)
+
 void usage(int status)
 {
     if(status != EXIT_SUCCESS)
@@ -40,6 +49,15 @@ Repeatedly output a line with all specified STRING(s), or `y'.\n\
 
 int main(int argc, char** argv)
 {
+    char* buf;
+    size_t linelen, size, filled, len, off;
+    ssize_t n;
+    int i;
+#ifdef SPLICE_F_GIFT
+    bool use_vmsplice = false;
+    struct stat st;
+#endif
+
     initialize_main(&argc, &argv);
     set_program_name(argv[0]);
     setlocale(LC_ALL, "");
@@ -59,15 +77,58 @@ int main(int argc, char** argv)
         argv[argc++] = bad_cast("y");
     }
 
-    for(;;)
+    /* Put the line in a buffer, then double it up to the size of a
+       write, in whole lines */
+    for(linelen = 0, i = optind; i < argc; i++)
+        linelen += strlen(argv[i]) + 1;
+    size = YES_BUFSIZE + linelen - 1;
+    size -= size % linelen;
+    if(posix_memalign((void**)&buf, getpagesize(), size) != 0)
+        xalloc_die();
+    for(filled = 0, i = optind; i < argc; i++)
     {
-        int i;
-        for(i = optind; i < argc; i++)
-            if(fputs(argv[i], stdout) == EOF
-                || putchar(i == argc - 1 ? '\n' : ' ') == EOF)
+        len = strlen(argv[i]);
+        memcpy(buf + filled, argv[i], len);
+        filled += len;
+        buf[filled++] = i == argc - 1 ? '\n' : ' ';
+    }
+    for(; filled < size; filled += len)
+    {
+        len = MIN(filled, size - filled);
+        memcpy(buf + filled, buf, len);
+    }
+
+#ifdef SPLICE_F_GIFT
+    /* into a pipe, the pages themselves can go: they never change */
+    if(fstat(STDOUT_FILENO, &st) == 0 && S_ISFIFO(st.st_mode))
+        use_vmsplice = true;
+#endif
+
+    for(off = 0;; off = (off + n) % size)
+    {
+#ifdef SPLICE_F_GIFT
+        if(use_vmsplice)
+        {
+            struct iovec iov;
+
+            iov.iov_base = buf + off;
+            iov.iov_len = size - off;
+            n = vmsplice(STDOUT_FILENO, &iov, 1, 0);
+            if(n < 0 && (errno == EINVAL || errno == ENOSYS))
             {
-                error(0, errno, _("standard output"));
-                exit(EXIT_FAILURE);
+                use_vmsplice = false;
+                n = 0;
+                continue;
             }
+        } else
+#endif
+            n = write(STDOUT_FILENO, buf + off, size - off);
+        if(n < 0 && errno == EINTR)
+            n = 0;
+        else if(n <= 0)
+        {
+            error(0, errno, _("standard output"));
+            exit(EXIT_FAILURE);
+        }
     }
 }
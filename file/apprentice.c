@@ -15,6 +15,7 @@
 #include <dirent.h>
 #include <errno.h>
 #include <ctype.h>
+#include <pthread.h>
 
 //#define _ISOC99_SOURCE
 #include <stdlib.h>
@@ -28,6 +29,7 @@
 
 #define ALLOC_CHUNK (size_t)10
 #define ALLOC_INCR  (size_t)200
+#define LOAD_JOBS   16          /* most threads parsing a magic directory */
 
 
 int file_formats[FILE_NAMES_SIZE];
@@ -41,14 +43,21 @@ struct magic_entry
     struct magic* mp;
     uint32_t cont_count;
     uint32_t max_count;
+    uint32_t src;                   /* its file, in a magic directory */
 };
 
 struct magic_map
 {
     void* p;
     size_t len;
+    char* name;
     struct magic* magic[MAGIC_SETS];
     uint32_t nmagic[MAGIC_SETS];
+    struct magic_aux* aux[MAGIC_SETS];
+    struct magic_index* index[MAGIC_SETS];
+    char** src;                     /* files of a parsed magic directory */
+    size_t nsrc;
+    uint32_t* srcidx[MAGIC_SETS];   /* each entry's file in src[] */
 };
 
 int file_formats[FILE_NAMES_SIZE];
@@ -85,8 +94,6 @@ struct type_tbl_s
     const int  format;
 };
 
-static size_t maxmagic[MAGIC_SETS] = { 0 };
-
 static const char usg_hdr[] = "cont\toffset\ttype\topcode\tmask\tvalue\tdesc";
 
 
@@ -265,15 +272,10 @@ get_standard_integer_type(const char* l, const char** t)
 
 
 static void
-init_file_tables(void)
+init_file_tables_once(void)
 {
-    static int done = 0;
     const struct type_tbl_s* p;
 
-    if(done)
-        return;
-    done++;
-
     for(p = type_tbl; p->len; p++)
     {
         assert(p->type < FILE_NAMES_SIZE);
@@ -283,6 +285,15 @@ init_file_tables(void)
     assert(p - type_tbl == FILE_NAMES_SIZE);
 }
 
+/* sets may be loaded on several threads at once */
+static void
+init_file_tables(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+    (void)pthread_once(&once, init_file_tables_once);
+}
+
 
 /* Parse a file or directory of files
    const char* fn: name of magic file or directory */
@@ -1028,9 +1039,6 @@ static int
 parse(struct magic_set* ms, struct magic_entry* me, const char* line,
             size_t lineno, int action)
 {
-#ifdef ENABLE_CONDITIONALS
-    static uint32_t last_cont_level = 0;
-#endif
     size_t i;
     struct magic* m;
     const char* l = line;
@@ -1048,10 +1056,10 @@ parse(struct magic_set* ms, struct magic_entry* me, const char* line,
         cont_level++;
     }
 #ifdef ENABLE_CONDITIONALS
-    if(cont_level == 0 || cont_level > last_cont_level)
+    if(cont_level == 0 || cont_level > ms->last_cont_level)
         if(file_check_mem(ms, cont_level) == -1)
             return -1;
-    last_cont_level = cont_level;
+    ms->last_cont_level = cont_level;
 #endif
     if(cont_level != 0)
     {
@@ -1507,7 +1515,8 @@ parse(struct magic_set* ms, struct magic_entry* me, const char* line,
 
 static int
 addentry(struct magic_set* ms, struct magic_entry* me,
-            struct magic_entry** mentry, uint32_t *mentrycount)
+            struct magic_entry** mentry, uint32_t *mentrycount,
+            size_t* maxmagic)
 {
     size_t i = me->mp->type == FILE_NAME ? 1 : 0;
     if(mentrycount[i] == maxmagic[i])
@@ -1531,10 +1540,11 @@ addentry(struct magic_set* ms, struct magic_entry* me,
 
 
 
-/* Load and parse one file */
+/* Load and parse one file, the src'th of a magic directory */
 static void
-load_1(struct magic_set* ms, int action, const char* fn, int *errs,
-        struct magic_entry** mentry, uint32_t *mentrycount)
+load_1(struct magic_set* ms, int action, const char* fn, uint32_t src,
+        int *errs, struct magic_entry** mentry, uint32_t *mentrycount,
+        size_t* maxmagic)
 {
     size_t lineno = 0, llen = 0;
     char* line = NULL;
@@ -1609,7 +1619,9 @@ load_1(struct magic_set* ms, int action, const char* fn, int *errs,
                     case 0:
                         continue;
                     case 1:
-                        (void)addentry(ms, &me, mentry, mentrycount);
+                        me.src = src;
+                        (void)addentry(ms, &me, mentry, mentrycount,
+                                       maxmagic);
                         goto again;
                     default:
                         (*errs)++;
@@ -1618,7 +1630,10 @@ load_1(struct magic_set* ms, int action, const char* fn, int *errs,
         }
     }
     if(me.mp)
-        (void)addentry(ms, &me, mentry, mentrycount);
+    {
+        me.src = src;
+        (void)addentry(ms, &me, mentry, mentrycount, maxmagic);
+    }
     free(line);
     (void)fclose(f);
 }
@@ -1944,17 +1959,61 @@ static const uint32_t ar[] =
 };
 
 
-/* handle an mmaped file */
+/* Kept after the counts in a database compiled on the fly from text
+   magic, so that it can be told from one made with -C, and whether
+   the sources have changed since */
+struct cache_stamp
+{
+    uint32_t magic;                 /* CACHENO */
+    uint32_t pad;
+    uint64_t gen;                   /* file_source_gen() of the sources */
+};
+
+#define CACHENO     0x4d474341      /* "ACGM" */
+#define STAMP_OFF   (sizeof(ar) + sizeof(uint32_t) * MAGIC_SETS)
+
+
+/* write map out as a database to fd, stamped with cs if not NULL */
 static int
-apprentice_compile(struct magic_set* ms, struct magic_map* map, const char* fn)
+apprentice_write(int fd, const struct magic_map* map,
+                 const struct cache_stamp* cs)
 {
     static const size_t nm = sizeof(*map->nmagic) * MAGIC_SETS;
     static const size_t m  = sizeof(**map->magic);
-    int fd = -1;
     size_t len;
+    uint32_t i;
+
+    if(write(fd, ar, sizeof(ar)) != (ssize_t)sizeof(ar))
+        return -1;
+
+    if(write(fd, map->nmagic, nm) != (ssize_t)nm)
+        return -1;
+
+    assert(STAMP_OFF + sizeof(*cs) <= m);
+
+    if(cs != NULL && write(fd, cs, sizeof(*cs)) != (ssize_t)sizeof(*cs))
+        return -1;
+
+    if(lseek(fd, (off_t)m, SEEK_SET) != (off_t)m)
+        return -1;
+
+    for(i = 0; i < MAGIC_SETS; i++)
+    {
+        len = m * map->nmagic[i];
+        if(write(fd, map->magic[i], len) != (ssize_t)len)
+            return -1;
+    }
+    return 0;
+}
+
+
+/* handle an mmaped file */
+static int
+apprentice_compile(struct magic_set* ms, struct magic_map* map, const char* fn)
+{
+    int fd = -1;
     char* dbname;
     int rv = -1;
-    uint32_t i;
 
     dbname = mkdbname(ms, fn, 1);
 
@@ -1967,41 +2026,16 @@ apprentice_compile(struct magic_set* ms, struct magic_map* map, const char* fn)
         goto out;
     }
 
-    if(write(fd, ar, sizeof(ar)) != (ssize_t)sizeof(ar))
-    {
-        file_error(ms, errno, "error writing `%s'", dbname);
-        goto out;
-    }
-
-    if(write(fd, map->nmagic, nm) != (ssize_t)nm)
+    if(apprentice_write(fd, map, NULL) == -1)
     {
         file_error(ms, errno, "error writing `%s'", dbname);
         goto out;
     }
 
-    assert(nm + sizeof(ar) < m);
-
-    if(lseek(fd, (off_t)m, SEEK_SET) != (off_t)m)
-    {
-        file_error(ms, errno, "error seeking `%s'", dbname);
-        goto out;
-    }
-
-    for(i = 0; i < MAGIC_SETS; i++)
-    {
-        len = m * map->nmagic[i];
-        if(write(fd, map->magic[i], len) != (ssize_t)len)
-        {
-            file_error(ms, errno, "error writing `%s'", dbname);
-            goto out;
-        }
-    }
-
-    if(fd != -1)
-        (void)close(fd);
-
     rv = 0;
 out:
+    if(fd != -1)
+        (void)close(fd);
     free(dbname);
     return rv;
 }
@@ -2050,11 +2084,12 @@ set_last_default(struct magic_set* ms, struct magic_entry* me, uint32_t nme)
 }
 
 
+/* with srcidx, also note the file each entry came from */
 static int
 coalesce_entries(struct magic_set* ms, struct magic_entry* me, uint32_t nme,
-                    struct magic** ma, uint32_t* nma)
+                    struct magic** ma, uint32_t* nma, uint32_t** srcidx)
 {
-    uint32_t i, mentrycount = 0;
+    uint32_t i, k, mentrycount = 0;
     size_t slen;
 
     for(i = 0; i < nme; i++)
@@ -2066,12 +2101,21 @@ coalesce_entries(struct magic_set* ms, struct magic_entry* me, uint32_t nme,
         file_oomem(ms, slen);
         return -1;
     }
+    if(srcidx != NULL && (*srcidx = CAST(uint32_t*,
+                    malloc(sizeof(**srcidx) * (mentrycount + 1)))) == NULL)
+    {
+        file_oomem(ms, sizeof(**srcidx) * (mentrycount + 1));
+        return -1;
+    }
 
     mentrycount = 0;
     for(i = 0; i < nme; i++)
     {
         (void)memcpy(*ma + mentrycount, me[i].mp,
                 me[i].cont_count * sizeof(**ma));
+        if(srcidx != NULL)
+            for(k = 0; k < me[i].cont_count; k++)
+                (*srcidx)[mentrycount + k] = me[i].src;
         mentrycount += me[i].cont_count;
     }
     *nma = mentrycount;
@@ -2091,12 +2135,169 @@ magic_entry_free(struct magic_entry* me, uint32_t nme)
 }
 
 
+/* One file of a magic directory, parsed by a thread of its own into
+   entry arrays of its own */
+struct load_job
+{
+    const char* fn;
+    struct magic_set* ms;           /* parse() keeps its state here */
+    int errs;
+    struct magic_entry* mentry[MAGIC_SETS];
+    uint32_t mentrycount[MAGIC_SETS];
+    size_t maxmagic[MAGIC_SETS];
+};
+
+struct load_pool
+{
+    struct load_job* job;
+    size_t njob;
+    size_t next;                    /* next job to take, atomically */
+    int action;
+};
+
+
+static void*
+load_worker(void* arg)
+{
+    struct load_pool* lp = CAST(struct load_pool*, arg);
+    struct load_job* j;
+    size_t i;
+
+    while((i = __atomic_fetch_add(&lp->next, 1, __ATOMIC_RELAXED)) <
+            lp->njob)
+    {
+        j = &lp->job[i];
+        if(j->ms != NULL)
+            load_1(j->ms, lp->action, j->fn, (uint32_t)i, &j->errs, j->mentry,
+                    j->mentrycount, j->maxmagic);
+    }
+    return NULL;
+}
+
+
+/* Parse the files of a magic directory, on as many threads as there
+   are processors to spare, and append their entries to mentry in the
+   order of the names, as load_1() on each in turn would have. Errors
+   are reported as the first file in that order to have one saw it */
+static void
+load_dir(struct magic_set* ms, int action, char** filearr, size_t files,
+         int* errs, struct magic_entry** mentry, uint32_t* mentrycount,
+         size_t* maxmagic)
+{
+    struct load_pool lp;
+    struct load_job* j;
+    pthread_t tid[LOAD_JOBS];
+    size_t nthread, n, i, k;
+    uint32_t total;
+    long ncpu;
+
+    ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    nthread = ncpu > 0 ? (size_t)ncpu : 1;
+    nthread = MIN(MIN(nthread, files), LOAD_JOBS);
+
+    /* -c dumps each entry as it is parsed: keep that in order */
+    if(action == FILE_CHECK || nthread < 2 ||
+        (lp.job = CAST(struct load_job*,
+                       calloc(files, sizeof(*lp.job)))) == NULL)
+    {
+        for(i = 0; i < files; i++)
+            load_1(ms, action, filearr[i], (uint32_t)i, errs, mentry,
+                    mentrycount, maxmagic);
+        return;
+    }
+
+    lp.njob = files;
+    lp.next = 0;
+    lp.action = action;
+    for(i = 0; i < files; i++)
+    {
+        lp.job[i].fn = filearr[i];
+        if((lp.job[i].ms = file_ms_alloc(ms->flags)) == NULL)
+            lp.job[i].errs++;
+    }
+
+    /* this thread takes jobs too */
+    for(n = 0; n < nthread - 1; n++)
+        if(pthread_create(&tid[n], NULL, load_worker, &lp) != 0)
+            break;
+    (void)load_worker(&lp);
+    while(n > 0)
+        (void)pthread_join(tid[--n], NULL);
+
+    for(i = 0; i < files; i++)
+    {
+        j = &lp.job[i];
+        if(j->ms == NULL)
+            file_oomem(ms, sizeof(*j->ms));
+        else if((j->ms->event_flags & EVENT_HAD_ERR) != 0 &&
+                (ms->event_flags & EVENT_HAD_ERR) == 0)
+        {
+            file_error(ms, 0, "%s", j->ms->o.buf);
+            ms->error = j->ms->error;
+        }
+        *errs += j->errs;
+    }
+
+    for(k = 0; k < MAGIC_SETS; k++)
+    {
+        struct magic_entry* mp;
+
+        total = mentrycount[k];
+        for(i = 0; i < files; i++)
+            total += lp.job[i].mentrycount[k];
+        if(total > maxmagic[k])
+        {
+            if((mp = CAST(struct magic_entry*, realloc(mentry[k],
+                            sizeof(*mp) * total))) == NULL)
+            {
+                file_oomem(ms, sizeof(*mp) * total);
+                (*errs)++;
+                break;
+            }
+            mentry[k] = mp;
+            maxmagic[k] = total;
+        }
+        for(i = 0; i < files; i++)
+        {
+            j = &lp.job[i];
+            if(j->mentrycount[k] == 0)
+                continue;
+            (void)memcpy(&mentry[k][mentrycount[k]], j->mentry[k],
+                    sizeof(*mentry[k]) * j->mentrycount[k]);
+            mentrycount[k] += j->mentrycount[k];
+            j->mentrycount[k] = 0;
+        }
+    }
+
+    for(i = 0; i < files; i++)
+    {
+        j = &lp.job[i];
+        for(k = 0; k < MAGIC_SETS; k++)
+            magic_entry_free(j->mentry[k], j->mentrycount[k]);
+        file_ms_free(j->ms);
+    }
+    free(lp.job);
+}
+
+
+static void
+src_free(struct magic_map* map)
+{
+    size_t i;
+
+    for(i = 0; i < map->nsrc; i++)
+        free(map->src[i]);
+    free(map->src);
+}
+
+
 static struct magic_map*
 apprentice_load(struct magic_set* ms, const char* fn, int action)
 {
     int errs = 0;
     struct magic_entry* mentry[MAGIC_SETS] = { NULL };
     uint32_t mentrycount[MAGIC_SETS] = { 0 };
+    size_t maxmagic[MAGIC_SETS] = { 0 };
     uint32_t i, j;
     size_t files = 0, maxfiles = 0;
     char** filearr = NULL;
@@ -2161,15 +2362,13 @@ apprentice_load(struct magic_set* ms, const char* fn, int action)
         }
         closedir(dir);
         qsort(filearr, files, sizeof(*filearr), cmpstrp);
-        for(i = 0; i < files; i++)
-        {
-            load_1(ms, action, filearr[i], &errs, mentry,
-                    mentrycount);
-            free(filearr[i]);
-        }
-        free(filearr);
+        load_dir(ms, action, filearr, files, &errs, mentry, mentrycount,
+                 maxmagic);
+        /* the map keeps the names, for --profile to tell them apart */
+        map->src = filearr;
+        map->nsrc = files;
     } else
-        load_1(ms, action, fn, &errs, mentry, mentrycount);
+        load_1(ms, action, fn, 0, &errs, mentry, mentrycount, maxmagic);
     if(errs)
         goto out;
 
@@ -2194,7 +2393,8 @@ apprentice_load(struct magic_set* ms, const char* fn, int action)
 
         /* coalesce per file arrays into a single one */
         if(coalesce_entries(ms, mentry[j], mentrycount[j],
-                &map->magic[j], &map->nmagic[j]) == -1)
+                &map->magic[j], &map->nmagic[j],
+                map->src != NULL ? &map->srcidx[j] : NULL) == -1)
         {
             errs++;
             goto out;
@@ -2210,7 +2410,9 @@ out:
         {
             if(map->magic[j])
                 free(map->magic[j]);
+            free(map->srcidx[j]);
         }
+        src_free(map);
         free(map);
         return NULL;
     }
@@ -2296,19 +2498,307 @@ byteswap(struct magic* magic, uint32_t nmagic)
 }
 
 
+/* compiled regexes of every loaded magic file, hashed by pattern;
+   the chains and the reference counts are shared by every magic_set
+   in the process, so they are only touched with regex_lock held */
+#define REGEX_HASHSIZE  64
+static struct magic_regex* regex_hash[REGEX_HASHSIZE];
+static pthread_mutex_t regex_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct magic_regex**
+regex_bucket(const char* pattern)
+{
+    size_t h = 0;
+
+    while(*pattern)
+        h = h * 31 + (unsigned char)*pattern++;
+    return &regex_hash[h % REGEX_HASHSIZE];
+}
+
+/* find or compile a pattern; a bad pattern is kept too, with its
+   regcomp() error, so that magiccheck() can report it */
+static struct magic_regex*
+regex_get(const char* pattern, int cflags)
+{
+    struct magic_regex** bp = regex_bucket(pattern);
+    struct magic_regex* rx;
+
+    (void)pthread_mutex_lock(&regex_lock);
+    for(rx = *bp; rx != NULL; rx = rx->next)
+    {
+        if(rx->cflags == cflags && strcmp(rx->pattern, pattern) == 0)
+        {
+            rx->refs++;
+            goto out;
+        }
+    }
+
+    if((rx = CAST(struct magic_regex*, calloc(1, sizeof(*rx)))) == NULL)
+        goto out;
+    (void)strlcpy(rx->pattern, pattern, sizeof(rx->pattern));
+    rx->cflags = cflags;
+    rx->rc = regcomp(&rx->rx, rx->pattern, cflags);
+    rx->refs = 1;
+    rx->next = *bp;
+    *bp = rx;
+out:
+    (void)pthread_mutex_unlock(&regex_lock);
+    return rx;
+}
+
+static void
+regex_put(struct magic_regex* rx)
+{
+    struct magic_regex** bp;
+
+    (void)pthread_mutex_lock(&regex_lock);
+    if(--rx->refs > 0)
+    {
+        (void)pthread_mutex_unlock(&regex_lock);
+        return;
+    }
+
+    for(bp = regex_bucket(rx->pattern); *bp != NULL; bp = &(*bp)->next)
+    {
+        if(*bp == rx)
+        {
+            *bp = rx->next;
+            break;
+        }
+    }
+    (void)pthread_mutex_unlock(&regex_lock);
+    if(rx->rc == 0)
+        regfree(&rx->rx);
+    free(rx);
+}
+
+/* the byte a top-level entry needs at offset 0 of the buffer, or -1
+   if it can't be told from the entry alone.  mcopy() pads a short
+   buffer with zeros, so this holds for any nbytes */
+static int
+index_key(const struct magic* m)
+{
+    if(m->cont_level != 0 || m->offset != 0 || (m->flag & INDIR) ||
+        m->reln != '=')
+        return -1;
+
+    switch(m->type)
+    {
+        case FILE_STRING:
+            if(m->vallen == 0 ||
+                (m->str_flags & ~(STRING_TEXTTEST | STRING_BINTEST)) != 0)
+                return -1;
+            return (unsigned char)m->value.s[0];
+        case FILE_BYTE:
+        case FILE_BESHORT:
+        case FILE_LESHORT:
+        case FILE_BELONG:
+        case FILE_LELONG:
+            if(m->num_mask != 0 || (m->mask_op & FILE_OPINVERSE))
+                return -1;
+            break;
+        default:
+            return -1;
+    }
+
+    switch(m->type)
+    {
+        case FILE_BESHORT:
+            return (int)((m->value.q >> 8) & 0xff);
+        case FILE_BELONG:
+            return (int)((m->value.q >> 24) & 0xff);
+        default:
+            return (int)(m->value.q & 0xff);
+    }
+}
+
+static void
+index_free(struct magic_index* idx)
+{
+    if(idx == NULL)
+        return;
+    free(idx->ent);
+    free(idx);
+}
+
+/* bucket the top-level entries of magic[] by index_key(); each bucket
+   and any[] stay in magic[] order, which is strength order */
+static struct magic_index*
+apprentice_index(struct magic* magic, uint32_t nmagic)
+{
+    struct magic_index* idx;
+    uint32_t i, ntop = 0, nkey = 0;
+    uint32_t pos[256];
+    int key;
+
+    if((idx = CAST(struct magic_index*, calloc(1, sizeof(*idx)))) == NULL)
+        return NULL;
+
+    for(i = 0; i < nmagic; i++)
+    {
+        if(magic[i].cont_level != 0)
+            continue;
+        ntop++;
+        if((key = index_key(&magic[i])) != -1)
+        {
+            idx->start[key + 1]++;
+            nkey++;
+        }
+    }
+
+    if((idx->ent = CAST(uint32_t*,
+                    malloc((ntop + 1) * sizeof(*idx->ent)))) == NULL)
+    {
+        free(idx);
+        return NULL;
+    }
+    idx->any = idx->ent + nkey;
+
+    for(i = 0; i < 256; i++)
+    {
+        idx->start[i + 1] += idx->start[i];
+        pos[i] = idx->start[i];
+    }
+
+    for(i = 0; i < nmagic; i++)
+    {
+        if(magic[i].cont_level != 0)
+            continue;
+        if((key = index_key(&magic[i])) != -1)
+            idx->ent[pos[key]++] = i;
+        else
+            idx->any[idx->nany++] = i;
+    }
+    return idx;
+}
+
+/* The shift for each byte that can end the window in a Horspool scan
+   for a FILE_SEARCH string: how far the pattern can move on before
+   that byte would line up with one in it. Only for searches that are
+   a plain compare, and only = and ! care where it was found, not how
+   the bytes there compare */
+static unsigned char*
+search_skip(const struct magic* m)
+{
+    size_t slen = MIN(m->vallen, sizeof(m->value.s));
+    unsigned char* skip;
+    size_t k;
+
+    if(m->type != FILE_SEARCH || slen == 0 ||
+        (m->reln != '=' && m->reln != '!') ||
+        (m->str_flags & (STRING_COMPACT_WHITESPACE |
+            STRING_COMPACT_OPTIONAL_WHITESPACE | STRING_IGNORE_CASE)) != 0)
+        return NULL;
+
+    if((skip = CAST(unsigned char*, malloc(256))) == NULL)
+        return NULL;
+    (void)memset(skip, (int)slen, 256);
+    for(k = 0; k < slen - 1; k++)
+        skip[(unsigned char)m->value.s[k]] = (unsigned char)(slen - 1 - k);
+    return skip;
+}
+
+
+/* build the side tables of a loaded or mapped file, compiling each
+   FILE_REGEX once here instead of on every test, and working out the
+   shifts of each FILE_SEARCH */
+static int
+apprentice_aux(struct magic_set* ms, struct magic_map* map)
+{
+    size_t i;
+    uint32_t j;
+    struct magic* m;
+    char pattern[MAXstring], errmsg[512];
+
+    for(i = 0; i < MAGIC_SETS; i++)
+    {
+        if(map->nmagic[i] == 0)
+            continue;
+        map->aux[i] = CAST(struct magic_aux*,
+                calloc(map->nmagic[i], sizeof(*map->aux[i])));
+        if(map->aux[i] == NULL)
+        {
+            file_oomem(ms, map->nmagic[i] * sizeof(*map->aux[i]));
+            return -1;
+        }
+        if((map->index[i] = apprentice_index(map->magic[i],
+                        map->nmagic[i])) == NULL)
+        {
+            file_oomem(ms, sizeof(*map->index[i]));
+            return -1;
+        }
+
+        for(j = 0; j < map->nmagic[i]; j++)
+        {
+            m = &map->magic[i][j];
+            if(map->srcidx[i] != NULL)
+                map->aux[i][j].src = map->srcidx[i][j];
+            if(m->type == FILE_SEARCH)
+                map->aux[i][j].skip = search_skip(m);
+            if(m->type != FILE_REGEX)
+                continue;
+            (void)memcpy(pattern, m->value.s, sizeof(pattern) - 1);
+            pattern[sizeof(pattern) - 1] = '\0';
+            if((map->aux[i][j].regex = regex_get(pattern,
+                            FILE_REGEX_CFLAGS(m))) == NULL)
+            {
+                file_oomem(ms, sizeof(struct magic_regex));
+                return -1;
+            }
+            if(map->aux[i][j].regex->rc && (ms->flags & MAGIC_CHECK))
+            {
+                regerror(map->aux[i][j].regex->rc,
+                        &map->aux[i][j].regex->rx,
+                        errmsg, sizeof(errmsg));
+                ms->line = m->lineno;
+                file_magwarn(ms, "regex error %d, (%s)",
+                        map->aux[i][j].regex->rc, errmsg);
+            }
+        }
+    }
+    return 0;
+}
+
+
 static void
 apprentice_unmap(struct magic_map* map)
 {
+    size_t i;
+    uint32_t j;
+
     if(map == NULL)
         return;
-    if(map->p == NULL)
-        return;
 
-    if(map->len)
+    for(i = 0; i < MAGIC_SETS; i++)
+    {
+        index_free(map->index[i]);
+        map->index[i] = NULL;
+        if(map->aux[i] == NULL)
+            continue;
+        for(j = 0; j < map->nmagic[i]; j++)
+        {
+            if(map->aux[i][j].regex != NULL)
+                regex_put(map->aux[i][j].regex);
+            free(map->aux[i][j].skip);
+        }
+        free(map->aux[i]);
+        map->aux[i] = NULL;
+    }
+
+    if(map->p == NULL)
+    {
+        /* from apprentice_load(), an array per set */
+        for(i = 0; i < MAGIC_SETS; i++)
+            free(map->magic[i]);
+    } else if(map->len)
         (void)munmap(map->p, map->len);
     else
         free(map->p);
 
+    for(i = 0; i < MAGIC_SETS; i++)
+        free(map->srcidx[i]);
+    src_free(map);
+    free(map->name);
     free(map);
 }
 
@@ -2341,8 +2831,10 @@ apprentice_map(struct magic_set* ms, const char* fn)
         goto error;
 
     if(fstat(fd, &st) == -1)
+    {
         file_error(ms, errno, "cannot stat `%s'", dbname);
         goto error;
+    }
 
     if(st.st_size < 8)
     {
@@ -2350,11 +2842,14 @@ apprentice_map(struct magic_set* ms, const char* fn)
         goto error;
     }
 
+    /* the entries are never written once loaded, so every process
+       using this database shares the one page cache copy */
     map->len = (size_t)st.st_size;
 
-    if((map->p = mmap(0, (size_t)st.st_size, PROT_READ | PROT_WRITE,
-                    MAP_PRIVATE | MAP_FILE, fd, (off_t)0)) == MAP_FAILED)
+    if((map->p = mmap(0, (size_t)st.st_size, PROT_READ,
+                    MAP_SHARED | MAP_FILE, fd, (off_t)0)) == MAP_FAILED)
     {
+        map->p = NULL;
         file_error(ms, errno, "cannot map `%s'", dbname);
         goto error;
     }
@@ -2372,6 +2867,24 @@ apprentice_map(struct magic_set* ms, const char* fn)
         needsbyteswap = 1;
     } else
         needsbyteswap = 0;
+
+    if(needsbyteswap)
+    {
+        /* compiled on a machine of the other byte order: swap a
+           private copy instead (map->len == 0 marks it malloc'ed) */
+        void* p;
+
+        if((p = malloc(map->len)) == NULL)
+        {
+            file_oomem(ms, map->len);
+            goto error;
+        }
+        (void)memcpy(p, map->p, map->len);
+        (void)munmap(map->p, map->len);
+        map->p = p;
+        map->len = 0;
+        ptr = CAST(uint32_t*, map->p);
+    }
     if(needsbyteswap)
         version = swap4(ptr[1]);
     else
@@ -2452,6 +2965,7 @@ static int
 add_mlist(struct mlist* mlp, struct magic_map* map, size_t idx)
 {
     struct mlist* ml;
+    uint32_t i;
 
     if((ml = CAST(struct mlist*, malloc(sizeof(*ml)))) == NULL)
         return -1;
@@ -2459,6 +2973,17 @@ add_mlist(struct mlist* mlp, struct magic_map* map, size_t idx)
     ml->map = idx == 0 ? map : NULL;
     ml->magic = map->magic[idx];
     ml->nmagic = map->nmagic[idx];
+    ml->aux = map->aux[idx];
+    ml->index = map->index[idx];
+    ml->name = map->name;
+    ml->src = map->src;
+
+    /* so that text need not be made into UTF-8 for no entries */
+    ml->ntext = 0;
+    for(i = 0; i < ml->nmagic; i++)
+        if(ml->magic[i].cont_level == 0 && (ml->magic[i].type == FILE_NAME ||
+            (ml->magic[i].flag & TEXTTEST) != 0))
+            ml->ntext++;
 
     mlp->prev->next = ml;
     ml->prev = mlp->prev;
@@ -2505,12 +3030,239 @@ apprentice_list(struct mlist* mlist, int mode)
 }
 
 
+static uint64_t
+gen_hash(uint64_t h, const void* p, size_t len)
+{
+    const unsigned char* s = CAST(const unsigned char*, p);
+
+    /* FNV-1a */
+    while(len-- > 0)
+        h = (h ^ *s++) * 0x100000001b3ULL;
+    return h;
+}
+
+#define GEN_INIT    0xcbf29ce484222325ULL
+
+
+static uint64_t
+gen_stat(const char* name, const struct stat* st)
+{
+    uint64_t h = gen_hash(GEN_INIT, name, strlen(name));
+    int64_t t = (int64_t)st->st_mtim.tv_sec * 1000000000LL +
+                st->st_mtim.tv_nsec;
+
+    h = gen_hash(h, &st->st_dev, sizeof(st->st_dev));
+    h = gen_hash(h, &st->st_ino, sizeof(st->st_ino));
+    h = gen_hash(h, &st->st_size, sizeof(st->st_size));
+    return gen_hash(h, &t, sizeof(t));
+}
+
+
+/* Something that changes whenever the text magic in fn does: made
+   from the name, size and time of the file, or of the directory and
+   of each file in it. 0 if there is no text magic to go by */
+uint64_t
+file_source_gen(const char* fn)
+{
+    size_t len = strlen(fn);
+    uint64_t h, sum = 0;
+    struct stat st;
+    struct dirent* d;
+    char* mfn;
+    DIR* dir;
+
+    if((len >= sizeof(ext) - 1 && strcmp(fn + len - (sizeof(ext) - 1),
+            ext) == 0) || stat(fn, &st) == -1)
+        return 0;
+    h = gen_stat(fn, &st);
+
+    if(S_ISDIR(st.st_mode))
+    {
+        if((dir = opendir(fn)) == NULL)
+            return 0;
+        while((d = readdir(dir)) != NULL)
+        {
+            if(asprintf(&mfn, "%s/%s", fn, d->d_name) < 0)
+            {
+                closedir(dir);
+                return 0;
+            }
+            /* summed, as readdir() order is no order */
+            if(stat(mfn, &st) == 0 && S_ISREG(st.st_mode))
+                sum += gen_stat(d->d_name, &st);
+            free(mfn);
+        }
+        closedir(dir);
+    }
+    h = gen_hash(h, &sum, sizeof(sum));
+    return h ? h : 1;
+}
+
+
+/* Where the database for the text magic in fn is kept when it can't
+   be kept beside it: $XDG_CACHE_HOME/file, or ~/.cache/file, named
+   after the full path of fn. With mk, make the directories for it */
+static char*
+cache_path(const char* fn, int mk)
+{
+    const char* base = getenv("XDG_CACHE_HOME");
+    char *dir, *path, *real;
+    uint64_t h;
+    int rv;
+
+    if(base != NULL && *base == '/')
+        rv = asprintf(&dir, "%s/file", base);
+    else if((base = getenv("HOME")) != NULL && *base == '/')
+        rv = asprintf(&dir, "%s/.cache/file", base);
+    else
+        return NULL;
+    if(rv < 0)
+        return NULL;
+
+    if(mk && mkdir(dir, 0755) == -1 && errno == ENOENT)
+    {
+        /* no ~/.cache either */
+        *strrchr(dir, '/') = '\0';
+        (void)mkdir(dir, 0700);
+        dir[strlen(dir)] = '/';
+        (void)mkdir(dir, 0755);
+    }
+
+    real = realpath(fn, NULL);
+    h = gen_hash(GEN_INIT, real ? real : fn, strlen(real ? real : fn));
+    free(real);
+    rv = asprintf(&path, "%s/%016llx%s", dir, (unsigned long long)h, ext);
+    free(dir);
+    return rv < 0 ? NULL : path;
+}
+
+
+static const struct cache_stamp*
+map_stamp(const struct magic_map* map)
+{
+    const struct cache_stamp* cs = CAST(const struct cache_stamp*,
+            CAST(const char*, map->p) + STAMP_OFF);
+
+    return cs->magic == CACHENO ? cs : NULL;
+}
+
+
+/* A database for the text magic in fn, whose file_source_gen() is gen:
+   the one beside it, as has always been used, unless it was compiled
+   on the fly from sources that have changed since; else the one kept
+   in the user's cache directory, if it is up to date */
+static struct magic_map*
+cache_map(struct magic_set* ms, const char* fn, uint64_t gen)
+{
+    const struct cache_stamp* cs;
+    struct magic_map* map;
+    char* path;
+
+    if((map = apprentice_map(ms, fn)) != NULL)
+    {
+        if(gen == 0 || (cs = map_stamp(map)) == NULL || cs->gen == gen)
+            return map;
+        apprentice_unmap(map);
+        map = NULL;
+    }
+
+    if(gen == 0 || (path = cache_path(fn, 0)) == NULL)
+        return NULL;
+    if(access(path, R_OK) == 0 && (map = apprentice_map(ms, path)) != NULL)
+    {
+        if((cs = map_stamp(map)) == NULL || cs->gen != gen)
+        {
+            apprentice_unmap(map);
+            map = NULL;
+        }
+    }
+    free(path);
+    return map;
+}
+
+
+/* may a database be written at path: there is none, or it is one
+   of ours */
+static int
+cache_ours(const char* path)
+{
+    struct cache_stamp cs;
+    ssize_t n;
+    int fd;
+
+    if((fd = open(path, O_RDONLY | O_BINARY)) == -1)
+        return errno == ENOENT;
+    n = pread(fd, &cs, sizeof(cs), (off_t)STAMP_OFF);
+    (void)close(fd);
+    return n == (ssize_t)sizeof(cs) && cs.magic == CACHENO;
+}
+
+
+static int
+cache_put(const struct magic_map* map, const char* path,
+          const struct cache_stamp* cs)
+{
+    char* tmp;
+    int fd, rv = -1;
+
+    if(asprintf(&tmp, "%s.XXXXXX", path) < 0)
+        return -1;
+
+    /* written aside and renamed in, so that it is never seen half
+       done by someone mapping it */
+    if((fd = mkstemp(tmp)) != -1)
+    {
+        if(fchmod(fd, 0644) == 0 && apprentice_write(fd, map, cs) == 0)
+            rv = 0;
+        if(close(fd) == -1 || (rv == 0 && rename(tmp, path) == -1))
+            rv = -1;
+        if(rv == -1)
+            (void)unlink(tmp);
+    }
+    free(tmp);
+    return rv;
+}
+
+
+/* Keep map, just parsed from the text magic in fn, as a database so
+   that later runs can map it instead: beside fn when that can be
+   written, else in the user's cache directory. Nothing is said if
+   neither can be */
+static void
+cache_write(const struct magic_map* map, const char* fn, uint64_t gen)
+{
+    struct cache_stamp cs;
+    char* path;
+
+    (void)memset(&cs, 0, sizeof(cs));
+    cs.magic = CACHENO;
+    cs.gen = gen;
+
+    if(asprintf(&path, "%s%s", fn, ext) >= 0)
+    {
+        /* never over one made with -C, stale or not */
+        if(cache_ours(path) && cache_put(map, path, &cs) == 0)
+        {
+            free(path);
+            return;
+        }
+        free(path);
+    }
+    if((path = cache_path(fn, 1)) != NULL)
+    {
+        (void)cache_put(map, path, &cs);
+        free(path);
+    }
+}
+
+
 /* Handle one file or directory */
 static int
 apprentice_1(struct magic_set* ms, const char* fn, int action)
 {
     struct mlist* ml;
     struct magic_map* map;
+    uint64_t gen;
     size_t i;
 
     if(magicsize != FILE_MAGICSIZE)
@@ -2530,7 +3282,14 @@ apprentice_1(struct magic_set* ms, const char* fn, int action)
     }
 
 #ifndef COMPILE_ONLY
-    map = apprentice_map(ms, fn);
+    /* only plain loads use, and leave behind, databases of their own */
+    gen = action == FILE_LOAD ? file_source_gen(fn) : 0;
+    /* a database doesn't know which file of a magic directory each
+       entry came from, and --profile wants to say */
+    if(gen != 0 && (ms->flags & MAGIC_PROFILE) != 0)
+        map = NULL;
+    else
+        map = cache_map(ms, fn, gen);
     if(map == NULL)
     {
         if(ms->flags & MAGIC_CHECK)
@@ -2538,6 +3297,15 @@ apprentice_1(struct magic_set* ms, const char* fn, int action)
         map = apprentice_load(ms, fn, action);
         if(map == NULL)
             return -1;
+        if(gen != 0)
+            cache_write(map, fn, gen);
+    }
+
+    if(apprentice_aux(ms, map) == -1 ||
+        (map->name = strdup(fn)) == NULL)
+    {
+        apprentice_unmap(map);
+        return -1;
     }
 
     for(i = 0; i < MAGIC_SETS; i++)
@@ -2662,6 +3430,138 @@ int file_apprentice(struct magic_set* ms, const char* fn, int action)
 }
 
 
+struct prof_entry
+{
+    const struct magic* m;
+    const struct magic_prof* prof;
+    const char* name;
+};
+
+static int
+prof_cmp(const void* a, const void* b)
+{
+    const struct prof_entry* pa = CAST(const struct prof_entry*, a);
+    const struct prof_entry* pb = CAST(const struct prof_entry*, b);
+
+    if(pa->prof->ns != pb->prof->ns)
+        return pa->prof->ns < pb->prof->ns ? 1 : -1;
+    return pa->prof->calls < pb->prof->calls ? 1 :
+           pa->prof->calls > pb->prof->calls ? -1 : 0;
+}
+
+
+/* print the n entries (all if 0) that MAGIC_PROFILE found to take
+   the most time, costliest first, one per line as
+   "ns calls hits file:line type description" */
+int file_apprentice_profile(struct magic_set* ms, FILE* f, size_t n)
+{
+    struct prof_entry* pe = NULL;
+    size_t i, npe = 0, maxpe = 0;
+    struct mlist* ml;
+    uint32_t j;
+
+    for(i = 0; i < MAGIC_SETS; i++)
+    {
+        if(ms->mlist[i] == NULL)
+            continue;
+        for(ml = ms->mlist[i]->next; ml != ms->mlist[i]; ml = ml->next)
+        {
+            if(ml->aux == NULL)
+                continue;
+            for(j = 0; j < ml->nmagic; j++)
+            {
+                if(ml->aux[j].prof.calls == 0)
+                    continue;
+                if(npe == maxpe)
+                {
+                    struct prof_entry* npp;
+                    maxpe = maxpe ? maxpe * 2 : 256;
+                    if((npp = CAST(struct prof_entry*,
+                            realloc(pe, maxpe * sizeof(*pe)))) == NULL)
+                    {
+                        free(pe);
+                        file_oomem(ms, maxpe * sizeof(*pe));
+                        return -1;
+                    }
+                    pe = npp;
+                }
+                pe[npe].m = &ml->magic[j];
+                pe[npe].prof = &ml->aux[j].prof;
+                pe[npe].name = ml->src != NULL ?
+                               ml->src[ml->aux[j].src] : ml->name;
+                npe++;
+            }
+        }
+    }
+
+    qsort(pe, npe, sizeof(*pe), prof_cmp);
+    if(n == 0 || n > npe)
+        n = npe;
+
+    (void)fprintf(f, "%12s %10s %10s  %s\n", "ns", "calls", "hits",
+                  "entry");
+    for(i = 0; i < n; i++)
+    {
+        const struct magic* m = pe[i].m;
+        const char* type = m->type < file_nnames ? file_names[m->type]
+                                                 : NULL;
+
+        (void)fprintf(f, "%12" INT64_T_FORMAT "u %10" INT64_T_FORMAT
+                      "u %10" INT64_T_FORMAT "u  %s:%u %.*s%s %s\n",
+                      (unsigned long long)pe[i].prof->ns,
+                      (unsigned long long)pe[i].prof->calls,
+                      (unsigned long long)pe[i].prof->hits,
+                      pe[i].name ? pe[i].name : "?", m->lineno,
+                      (int)MIN(m->cont_level, 16), ">>>>>>>>>>>>>>>>",
+                      type ? type : "?", m->desc);
+    }
+    free(pe);
+    return 0;
+}
+
+
+/* give ms the magic already loaded into from, for use by another
+   thread: the entries, side tables and maps stay owned by from,
+   which must outlive ms */
+int file_apprentice_share(struct magic_set* ms, const struct magic_set* from)
+{
+    size_t i;
+    struct mlist *ml, *nml;
+
+    for(i = 0; i < MAGIC_SETS; i++)
+    {
+        if(from->mlist[i] == NULL)
+        {
+            file_error(ms, 0, "no magic files loaded");
+            return -1;
+        }
+        mlist_free(ms->mlist[i]);
+        if((ms->mlist[i] = mlist_alloc()) == NULL)
+        {
+            file_oomem(ms, sizeof(*ms->mlist[i]));
+            return -1;
+        }
+
+        for(ml = from->mlist[i]->next; ml != from->mlist[i]; ml = ml->next)
+        {
+            if((nml = CAST(struct mlist*, malloc(sizeof(*nml)))) == NULL)
+            {
+                file_oomem(ms, sizeof(*nml));
+                return -1;
+            }
+            *nml = *ml;
+            nml->map = NULL;    /* not ours to unmap */
+
+            ms->mlist[i]->prev->next = nml;
+            nml->prev = ms->mlist[i]->prev;
+            nml->next = ms->mlist[i];
+            ms->mlist[i]->prev = nml;
+        }
+    }
+    return 0;
+}
+
+
 /* parse a MIME annotation line from magic file, put into magic[index - 1]
    if valid */
 static int 
@@ -2829,6 +3729,7 @@ file_ms_alloc(int flags)
     }
 
     ms->o.buf = ms->o.pbuf = NULL;
+    ms->o.blen = ms->o.bsize = ms->o.psize = 0;
     len = (ms->c.len = 0) * sizeof(*ms->c.li);
 
     if((ms->c.li = CAST(struct level_info*, malloc(len))) == NULL)
@@ -2858,6 +3759,12 @@ void file_ms_free(struct magic_set* ms)
     free(ms->o.pbuf);
     free(ms->o.buf);
     free(ms->c.li);
+    free(ms->w.buf);
+    for(i = 0; i < __arraycount(ms->sc); i++)
+        free(ms->sc[i].p);
+    magic_strings_reset(ms);
+    free(ms->st.str);
+    free(ms->st.slot);
     free(ms);
 }
 
@@ -2936,6 +3843,8 @@ int file_magicfind(struct magic_set* ms, const char* name, struct mlist* v)
             if(strcmp(ma[i].value.s, name) == 0)
             {
                 v->magic = &ma[i];
+                v->aux = ml->aux == NULL ? NULL : &ml->aux[i];
+                v->index = NULL;
                 for(j = i + 1; j < nma; j++)
                     if(ma[j].cont_level == 0)
                         break;
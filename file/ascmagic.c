@@ -7,9 +7,6 @@
 #include <string.h>
 
 
-#define MAXLINELEN  300     /* longest sane line length */
-
-
 /* Undo the NUL-terminating kindly provided  by process()
    but leave at least one byte to look at */
 static size_t
@@ -85,31 +82,31 @@ encode_utf8(unsigned char* buf, size_t len, unichar* ubuf, size_t ulen)
 }
 
 
+/* ts is what file_encoding() counted while decoding buf into ubuf */
 int
 file_ascmagic_with_encoding(struct magic_set* ms, const unsigned char* buf,
                             size_t nbytes, unichar* ubuf, size_t ulen, 
-                            const char* code, const char* type, int text)
+                            const char* code, const char* type,
+                            const struct text_stats* ts, int text)
 {
     unsigned char *utf8_buf = NULL, *utf8_end;
-    size_t mlen, i;
+    size_t mlen = 0;
     int rv = -1;
     int mime = ms->flags & MAGIC_MIME;
 
     const char* subtype = NULL;
     const char* subtype_mime = NULL;
 
-    int has_escapes = 0;
-    int has_backspace = 0;
-    int seen_cr = 0;
+    int has_escapes = ts->has_escapes;
+    int has_backspace = ts->has_backspace;
 
-    int n_crlf = 0;
-    int n_lf = 0;
-    int n_cr = 0;
-    int n_nel = 0;
+    int n_crlf = ts->n_crlf;
+    int n_lf = ts->n_lf;
+    int n_cr = ts->n_cr;
+    int n_nel = ts->n_nel;
     int executable = 0;
 
-    size_t last_line_end = (size_t)-1;
-    int has_long_lines = 0;
+    int has_long_lines = ts->has_long_lines;
 
     if(ms->flags & MAGIC_APPLE)
         return 0;
@@ -123,62 +120,36 @@ file_ascmagic_with_encoding(struct magic_set* ms, const unsigned char* buf,
         goto done;
     }
 
-    if(ulen > 0 && (ms->flags & MAGIC_NO_CHECK_SOFT) == 0)
+    /* Try text soft magic, on the text as UTF-8, if there is any */
+    if(ulen > 0 && (ms->flags & MAGIC_NO_CHECK_SOFT) == 0 &&
+        file_softmagic_any(ms, TEXTTEST))
     {
-        /* Convert ubuf to UTF-8 and try text soft magic */
-        /* malloc size os a conservative overestimate; could be
-           improved, or at least reallocated after conversion */
-        mlen = ulen * 6;
-        if((utf8_buf = CAST(unsigned char*, malloc(mlen))) == NULL)
+        if(strcmp(code, "ASCII") == 0)
         {
-            file_oomem(ms, mlen);
-            goto done;
-        }
-        if((utf8_end = encode_utf8(utf8_buf, mlen, ubuf, ulen)) == NULL)
-            goto done;
-        if((rv = file_softmagic(ms, utf8_buf,
-                    (size_t)(utf8_end - utf8_buf), TEXTTEST, text)) == 0)
-            rv = -1;
-    }
-
-    /* Now try to discover other details about the file */
-    for(i = 0; i < ulen; i++)
-    {
-        if(ubuf[i] == '\n')
+            /* which is what it is already */
+            rv = file_softmagic(ms, buf, ulen, TEXTTEST, text);
+        } else
         {
-            if(seen_cr)
-                n_crlf++;
-            else
-                n_lf++;
-            last_line_end = i;
-        } else if(seen_cr)
-            n_cr++;
-
-        seen_cr = (ubuf[i] == 'r');
-        if(seen_cr)
-            last_line_end = i;
-
-        if(ubuf[i] == 0x85)
-        {
-            n_nel++;
-            last_line_end = i;
+            /* a conservative overestimate, but only what is written
+               to is ever touched, and it is kept for the next file */
+            mlen = ulen * 6;
+            if((utf8_buf = CAST(unsigned char*,
+                        file_scratch_get(ms, SCRATCH_UTF8, &mlen))) == NULL)
+                goto done;
+            if((utf8_end = encode_utf8(utf8_buf, mlen, ubuf, ulen)) == NULL)
+                goto done;
+            rv = file_softmagic(ms, utf8_buf,
+                        (size_t)(utf8_end - utf8_buf), TEXTTEST, text);
         }
-
-        /* If this line is _longer_ than MAXLINELEN, remember it */
-        if(i > last_line_end + MAXLINELEN)
-            has_long_lines = 1;
-
-        if(ubuf[i] == '\033')
-            has_escapes = 1;
-        if(ubuf[i] == '\b')
-            has_backspace = 1;
+        if(rv == 0)
+            rv = -1;
     }
 
     /* Beware, if the data has been truncated, the final CR could have
        been followed by a LF. If we have HOWMANY bytes, it indicates
        that the data might have been truncated, probably even before
        this function was called */
-    if(seen_cr && nbytes < HOWMANY)
+    if(ts->seen_cr && nbytes < HOWMANY)
         n_cr++;
 
     if(strcmp(type, "binary") == 0)
@@ -300,7 +271,7 @@ file_ascmagic_with_encoding(struct magic_set* ms, const unsigned char* buf,
     }
     rv = 1;
 done:
-    free(utf8_buf);
+    file_scratch_put(ms, SCRATCH_UTF8, utf8_buf, mlen);
 
     return rv;
 }
@@ -309,8 +280,9 @@ done:
 int file_ascmagic(struct magic_set* ms, const unsigned char* buf, 
                     size_t nbytes, int text)
 {
-    unichar* ubuf = NULL;
-    size_t ulen;
+    unichar* ubuf;
+    size_t ulen, len;
+    struct text_stats ts;
     int rv = 1;
 
     const char* code = NULL;
@@ -320,17 +292,28 @@ int file_ascmagic(struct magic_set* ms, const unsigned char* buf,
     if(ms->flags & MAGIC_APPLE)
         return 0;
 
+    /* NULs at the end of the window may be a hole in the middle of
+       the file */
+    if(trim_nuls(buf, nbytes) < nbytes &&
+        file_window_want(ms, buf, nbytes, nbytes + 1))
+        return 0;
+
     nbytes = trim_nuls(buf, nbytes);
 
+    len = (nbytes + 1) * sizeof(*ubuf);
+    if((ubuf = CAST(unichar*,
+                file_scratch_get(ms, SCRATCH_TEXT, &len))) == NULL)
+        return -1;
+
     /* If file doesn't look like any sort of text, give up */
-    if(file_encoding(ms, buf, nbytes, &ubuf, &ulen, &code,
-                    &code_mime, &type) == 0)
+    if(file_encoding(ms, buf, nbytes, ubuf, &ulen, &code,
+                    &code_mime, &type, &ts) == 0)
         rv = 0;
     else
         rv = file_ascmagic_with_encoding(ms, buf, nbytes, ubuf, ulen, 
-                                        code, type, text);
+                                        code, type, &ts, text);
 
-    free(ubuf);
+    file_scratch_put(ms, SCRATCH_TEXT, ubuf, len);
 
     return rv;
 }
@@ -0,0 +1,63 @@
+#!/bin/sh
+# bench-encoding.sh - time file_encoding() on binary, ASCII, UTF-8
+# and UTF-16 input
+#
+# Makes COPIES files of 256 KiB (HOWMANY, all that is looked at) of
+# each kind and runs each file(1) given, ./file by default, over each
+# kind ROUNDS times. The magic holds one entry that none of them
+# matches, so that the time goes to the encoding pass and the
+# ASCII/text tests after it.
+#
+# usage: ./bench-encoding.sh [file ...]
+
+FLAGS=${FLAGS:--r -e tar}
+COPIES=${COPIES:-50}
+ROUNDS=${ROUNDS:-5}
+
+tmp=${TMPDIR:-/tmp}/bench-encoding.$$
+trap 'rm -rf "$tmp"' 0 1 2 15
+mkdir -p "$tmp/binary" "$tmp/ascii" "$tmp/utf8" "$tmp/utf16" || exit 1
+
+printf '0\tstring\t\\001\\002\\003\\004nomatch\tnever\n' > "$tmp/magic"
+
+# one 256 KiB sample of each kind
+head -c 262144 /dev/urandom > "$tmp/binary.1"
+yes 'The quick brown fox jumps over the lazy dog, 0123456789.' |
+    head -c 262144 > "$tmp/ascii.1"
+yes 'Příliš žluťoučký kůň úpěl ďábelské ódy, ça va? Ωμέγα.' |
+    head -c 262144 > "$tmp/utf8.1"
+{
+    printf '\377\376'
+    head -c 131071 "$tmp/ascii.1" | sed 's/./&\x00/g'
+} | head -c 262144 > "$tmp/utf16.1"
+
+for k in binary ascii utf8 utf16
+do
+    for i in $(seq "$COPIES")
+    do
+        cp "$tmp/$k.1" "$tmp/$k/$i"
+    done
+done
+
+# elapsed ms of ROUNDS runs of file $1 over the files of kind $2
+run()
+{
+    t0=$(date +%s%N)
+    for r in $(seq "$ROUNDS")
+    do
+        "$1" $FLAGS -m "$tmp/magic" "$tmp/$2"/* > /dev/null 2>&1
+    done
+    t1=$(date +%s%N)
+    echo $(( (t1 - t0) / 1000000 ))
+}
+
+echo "$COPIES files of 256 KiB per kind, $ROUNDS rounds"
+[ $# -eq 0 ] && set -- ./file
+for f in "$@"
+do
+    for k in binary ascii utf8 utf16
+    do
+        echo "$f: $k ($("$f" $FLAGS -m "$tmp/magic" "$tmp/$k/1" 2> /dev/null |
+            tail -1 | cut -c1-40)) $(run "$f" "$k") ms"
+    done
+done
@@ -0,0 +1,94 @@
+#!/bin/sh
+# bench-match.sh - time match() over a corpus of mixed file types
+#
+# Builds a magic file of ENTRIES top-level tests, most of them on a
+# constant leading byte (what the top-level index buckets) and some
+# it can't bucket (search, offsets past 0), and a corpus of ELF,
+# gzip, PDF, PNG, text, random, short and empty files. Then each
+# file(1) given, ./file by default, types the corpus ROUNDS times,
+# with and without -k. FLAGS go to every run; the default of raw
+# output and no tar test lets builds of older trees, which crash in
+# file_getbuffer() and is_tar(), be timed too.
+#
+# usage: ./bench-match.sh [file ...]
+
+FLAGS=${FLAGS:--r -e tar}
+ENTRIES=${ENTRIES:-4000}
+ROUNDS=${ROUNDS:-10}
+COPIES=${COPIES:-200}
+
+tmp=${TMPDIR:-/tmp}/bench-match.$$
+trap 'rm -rf "$tmp"' 0 1 2 15
+mkdir -p "$tmp/corpus" || exit 1
+
+awk -v n="$ENTRIES" 'BEGIN {
+    srand(1)
+    for(i = 0; i < n; i++)
+    {
+        r = int(rand() * 10)
+        if(r < 3)
+            printf("0\tbelong\t0x%08x\tentry%d\n", int(rand() * 4294967296), i)
+        else if(r < 5)
+        {
+            printf("0\tbyte\t0x%02x\tentry%d\n", int(rand() * 256), i)
+            printf(">1\tbyte\t0x%02x\tsub\n", int(rand() * 256))
+        }
+        else if(r < 7)
+            printf("0\tstring\t\\x%02x\\x%02x\\x%02x\tentry%d\n",
+                int(rand() * 256), int(rand() * 256), int(rand() * 256), i)
+        else if(r < 8)
+            printf("0\tbeshort\t0x%04x\tentry%d\n", int(rand() * 65536), i)
+        else if(r < 9)
+            printf("%d\tbelong\t0x%08x\tentry%d\n", 4 + int(rand() * 60),
+                int(rand() * 4294967296), i)
+        else
+            printf("0\tsearch/64\tzq%d\tsearch%d\n", i, i)
+    }
+    print "0\tstring\t\\177ELF\tELF"
+    print ">4\tbyte\t2\t64-bit"
+    print "0\tstring\t\\037\\213\tgzip compressed data"
+    print "0\tstring\t%PDF-\tPDF document"
+    print "0\tstring\t\\211PNG\tPNG image data"
+}' > "$tmp/magic"
+
+for i in $(seq "$COPIES")
+do
+    d="$tmp/corpus/$i"
+    mkdir "$d"
+    cp "$(command -v sh)" "$d/elf"
+    head -c 8192 /dev/urandom > "$d/random"
+    printf '%s\n' "int main(void) { return $i; }" > "$d/c.c"
+    seq 1 2000 > "$d/text"
+    gzip -c "$d/text" > "$d/text.gz"
+    printf '%%PDF-1.4\n%s\n' "$i" > "$d/doc.pdf"
+    printf '\211PNG\r\n\032\n%s' "$i" > "$d/image.png"
+    printf 'x' > "$d/short"
+    : > "$d/empty"
+done
+
+# elapsed ms of ROUNDS runs of "$@" over the corpus
+run()
+{
+    t0=$(date +%s%N)
+    for r in $(seq "$ROUNDS")
+    do
+        "$@" $FLAGS -m "$tmp/magic" "$tmp"/corpus/*/* > /dev/null 2>&1
+    done
+    t1=$(date +%s%N)
+    echo $(( (t1 - t0) / 1000000 ))
+}
+
+n=$(ls "$tmp"/corpus/*/* | wc -l)
+echo "$ENTRIES entries, $n files, $ROUNDS rounds"
+[ $# -eq 0 ] && set -- ./file
+for f in "$@"
+do
+    # one untimed run, so both columns start warm
+    "$f" $FLAGS -m "$tmp/magic" "$tmp"/corpus/1/* > /dev/null 2>&1
+    if [ $? -gt 128 ]
+    then
+        echo "$f: crashed"
+        continue
+    fi
+    echo "$f: $(run "$f") ms, with -k $(run "$f" -k) ms"
+done
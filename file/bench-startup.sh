@@ -0,0 +1,75 @@
+#!/bin/sh
+# bench-startup.sh - time starting up from a compiled .mgc against
+# parsing the text magic
+#
+# Makes a text magic file of ENTRIES entries, compiles it with -C,
+# and runs each file(1) given, ./file by default, RUNS times on one
+# small file: once from the .mgc, once from the text. For the text
+# runs a directory sits where the .mgc would be and XDG_CACHE_HOME
+# can't be created, so that builds which keep a database of parsed
+# text magic can't, and every run parses.
+#
+# usage: ./bench-startup.sh [file ...]
+
+FLAGS=${FLAGS:--r -e tar}
+ENTRIES=${ENTRIES:-4000}
+RUNS=${RUNS:-200}
+
+tmp=${TMPDIR:-/tmp}/bench-startup.$$
+trap 'rm -rf "$tmp"' 0 1 2 15
+mkdir -p "$tmp/mgc" "$tmp/text/magic.mgc" || exit 1
+: > "$tmp/nocache"
+
+awk -v n="$ENTRIES" 'BEGIN {
+    srand(2)
+    for(i = 0; i < n; i++)
+    {
+        if(i % 4 == 0)
+            printf("0\tstring\tmagic%05d\tkind %d\n", i, i)
+        else if(i % 4 == 1)
+            printf("0\tbelong\t0x%08x\tkind %d\n", int(rand() * 4294967296), i)
+        else if(i % 4 == 2)
+        {
+            printf("0\tbyte\t0x%02x\tkind %d\n", int(rand() * 256), i)
+            printf(">2\tbeshort\tx\t\\b, version %%d\n")
+        }
+        else
+            printf("8\tleshort\t0x%04x\tkind %d\n", int(rand() * 65536), i)
+    }
+}' > "$tmp/text/magic"
+cp "$tmp/text/magic" "$tmp/mgc/magic"
+printf 'magic00400 sample\n' > "$tmp/sample"
+
+# elapsed ms of RUNS runs of file $1 with magic $2, or "fails" if
+# that doesn't type the sample
+run()
+{
+    if ! XDG_CACHE_HOME="$tmp/nocache/x" "$1" $FLAGS -m "$2" \
+            "$tmp/sample" 2> /dev/null | grep -q "kind 400"
+    then
+        echo fails
+        return
+    fi
+    t0=$(date +%s%N)
+    for r in $(seq "$RUNS")
+    do
+        XDG_CACHE_HOME="$tmp/nocache/x" \
+            "$1" $FLAGS -m "$2" "$tmp/sample" > /dev/null 2>&1
+    done
+    t1=$(date +%s%N)
+    echo $(( (t1 - t0) / 1000000 )) ms
+}
+
+echo "$ENTRIES entries, $RUNS runs"
+[ $# -eq 0 ] && set -- ./file
+for f in "$@"
+do
+    case "$f" in
+        /*) ;;
+        *) f="$PWD/$f" ;;
+    esac
+    rm -f "$tmp/mgc/magic.mgc"
+    (cd "$tmp/mgc" && "$f" -C -m magic) > /dev/null 2>&1
+    echo "$f: .mgc $(run "$f" "$tmp/mgc/magic.mgc")," \
+         "text $(run "$f" "$tmp/text/magic")"
+done
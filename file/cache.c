@@ -0,0 +1,379 @@
+/* cache.c - remember what file(1) said about files that have not
+   changed since
+
+   The cache lives next to the first magic file, as <magicfile>.cache,
+   and is a fixed table of CACHE_SLOTS slots mapped shared, so that
+   concurrent runs and the -P threads all see each other's results.
+   A file is known by its device, inode, size, mtime and ctime; when
+   those all match, the stored result is used without opening it.
+   A file changed in the same clock tick as it was looked at could
+   change again without any of them moving, so for those entries a
+   fingerprint of the first block is kept and checked as well.
+
+   Each slot holds the generation, built from the magic files, the
+   library version and the flags, that its result was made under;
+   runs with other magic or other flags don't see it, and keep their
+   own results in other slots of the same table. Old entries are
+   simply overwritten, and a slot torn by two writers fails its
+   checksum and is ignored. A table that is in use is never resized
+   or cleared: one of the wrong size or format is replaced by a new
+   one, made aside and renamed in */
+
+#include "file_.h"
+#include "magic_.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <pthread.h>
+
+
+#define CACHE_MAGIC     "FILECCH2"
+#define CACHE_SLOTS     (1 << 16)       /* 16 MiB, sparse until used */
+#define CACHE_PROBE     4               /* slots tried per file */
+#define CACHE_RACY      2000000000LL    /* 2s in ns: timestamps not to trust */
+#define CACHE_FPLEN     4096            /* bytes in the fingerprint */
+
+struct cache_head
+{
+    char magic[8];
+    uint32_t nslot;
+    uint32_t slotsize;
+    char fill[240];
+};
+
+struct file_cache
+{
+    int fd;
+    int rdonly;
+    uint64_t gen;                   /* generation() of this run */
+    struct cache_head* head;
+    struct cache_slot* slot;
+    pthread_mutex_t lock;
+};
+
+
+static uint64_t
+hash_bytes(uint64_t h, const void* p, size_t len)
+{
+    const unsigned char* s = CAST(const unsigned char*, p);
+
+    /* FNV-1a */
+    while(len-- > 0)
+        h = (h ^ *s++) * 0x100000001b3ULL;
+    return h;
+}
+
+#define HASH_INIT   0xcbf29ce484222325ULL
+
+
+static int64_t
+ts_ns(const struct timespec* ts)
+{
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+
+static uint64_t
+slot_sum(const struct cache_slot* s)
+{
+    uint64_t h = hash_bytes(HASH_INIT, &s->gen,
+            offsetof(struct cache_slot, res) - offsetof(struct cache_slot, gen));
+
+    h = hash_bytes(h, s->res, strlen(s->res));
+    return h ? h : 1;
+}
+
+
+/* the first block of a file, for entries whose timestamps can't be
+   trusted; 0 if it can't be read */
+static uint64_t
+fingerprint(const char* name)
+{
+    unsigned char buf[CACHE_FPLEN];
+    ssize_t n;
+    int fd;
+
+    if((fd = open(name, O_RDONLY | O_BINARY)) == -1)
+        return 0;
+    n = pread(fd, buf, sizeof(buf), (off_t)0);
+    (void)close(fd);
+    if(n < 0)
+        return 0;
+    return hash_bytes(HASH_INIT, buf, (size_t)n) | 1;
+}
+
+
+/* everything a cached result depends on besides the file itself:
+   the library, the flags, and each of the magic files (and their
+   compiled forms) as they are now. file_source_gen() covers each
+   file in a magic directory, and so also whatever database was built
+   from them, wherever apprentice.c keeps it */
+static uint64_t
+generation(const char* magicfile, int flags)
+{
+    uint64_t h = HASH_INIT;
+    int version = MAGIC_VERSION;
+    char* list, *p, *fn;
+    struct stat st;
+    uint64_t g;
+    int64_t t;
+
+    h = hash_bytes(h, &version, sizeof(version));
+    h = hash_bytes(h, &flags, sizeof(flags));
+
+    if((list = strdup(magicfile)) == NULL)
+        return 0;
+    for(p = list; (fn = strsep(&p, ":")) != NULL; )
+    {
+        char* mgc;
+        int i;
+
+        if(asprintf(&mgc, "%s.mgc", fn) < 0)
+            break;
+        g = file_source_gen(fn);
+        h = hash_bytes(h, &g, sizeof(g));
+        for(i = 0; i < 2; i++)
+        {
+            if(stat(i ? mgc : fn, &st) == -1)
+                (void)memset(&st, 0, sizeof(st));
+            h = hash_bytes(h, &st.st_dev, sizeof(st.st_dev));
+            h = hash_bytes(h, &st.st_ino, sizeof(st.st_ino));
+            h = hash_bytes(h, &st.st_size, sizeof(st.st_size));
+            t = ts_ns(&st.st_mtim);
+            h = hash_bytes(h, &t, sizeof(t));
+        }
+        free(mgc);
+    }
+    free(list);
+    return h;
+}
+
+
+/* a new, empty table at path, made aside and renamed over whatever
+   is there, so that runs still using the old one are not disturbed;
+   the descriptor, or -1 */
+static int
+cache_create(const char* path, const struct cache_head* head, size_t size)
+{
+    char* tmp;
+    int fd;
+
+    if(asprintf(&tmp, "%s.XXXXXX", path) < 0)
+        return -1;
+    if((fd = mkstemp(tmp)) != -1)
+    {
+        if(fchmod(fd, 0644) == -1 || ftruncate(fd, (off_t)size) == -1 ||
+            pwrite(fd, head, sizeof(*head), (off_t)0) !=
+                (ssize_t)sizeof(*head) ||
+            rename(tmp, path) == -1)
+        {
+            (void)close(fd);
+            (void)unlink(tmp);
+            fd = -1;
+        }
+    }
+    free(tmp);
+    return fd;
+}
+
+
+/* Open or create the cache kept for magicfile, a list as given to
+   magic_load(). Returns NULL, with errno set, if there is none to
+   be had */
+struct file_cache*
+file_cache_open(const char* magicfile, int flags)
+{
+    struct file_cache* c;
+    struct cache_head head, old;
+    size_t size = sizeof(struct cache_head) +
+                  CACHE_SLOTS * sizeof(struct cache_slot);
+    char* path;
+    size_t len;
+    void* p;
+    int prot = PROT_READ | PROT_WRITE;
+    struct stat st;
+
+    if((c = CAST(struct file_cache*, calloc(1, sizeof(*c)))) == NULL)
+        return NULL;
+    c->gen = generation(magicfile, flags);
+
+    len = strcspn(magicfile, ":");
+    if(asprintf(&path, "%.*s.cache", (int)len, magicfile) < 0)
+        goto free;
+
+    (void)memset(&head, 0, sizeof(head));
+    (void)memcpy(head.magic, CACHE_MAGIC, sizeof(head.magic));
+    head.nslot = CACHE_SLOTS;
+    head.slotsize = sizeof(struct cache_slot);
+
+    if((c->fd = open(path, O_RDWR)) == -1)
+    {
+        /* someone else's cache: use it, but leave it be */
+        if(errno != ENOENT && (c->fd = open(path, O_RDONLY)) != -1)
+        {
+            c->rdonly = 1;
+            prot = PROT_READ;
+        } else if((c->fd = cache_create(path, &head, size)) == -1)
+            goto free;
+    }
+
+    if(fstat(c->fd, &st) == -1)
+        goto close;
+
+    if((size_t)st.st_size != size ||
+        pread(c->fd, &old, sizeof(old), (off_t)0) != (ssize_t)sizeof(old) ||
+        memcmp(&old, &head, sizeof(head)) != 0)
+    {
+        /* made by another version: start afresh */
+        (void)close(c->fd);
+        if(c->rdonly)
+        {
+            errno = EACCES;
+            goto free;
+        }
+        if((c->fd = cache_create(path, &head, size)) == -1)
+            goto free;
+    }
+
+    if((p = mmap(NULL, size, prot, MAP_SHARED, c->fd, (off_t)0)) ==
+        MAP_FAILED)
+        goto close;
+
+    c->head = CAST(struct cache_head*, p);
+    c->slot = CAST(struct cache_slot*, c->head + 1);
+    (void)pthread_mutex_init(&c->lock, NULL);
+    free(path);
+    return c;
+close:
+    (void)close(c->fd);
+free:
+    free(path);
+    free(c);
+    return NULL;
+}
+
+
+void
+file_cache_close(struct file_cache* c)
+{
+    if(c == NULL)
+        return;
+    (void)munmap(c->head, sizeof(struct cache_head) +
+                          CACHE_SLOTS * sizeof(struct cache_slot));
+    (void)close(c->fd);
+    (void)pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+
+static uint32_t
+slot_of(const struct cache_slot* key)
+{
+    uint64_t h = hash_bytes(HASH_INIT, &key->gen, sizeof(key->gen));
+
+    h = hash_bytes(h, &key->dev, sizeof(key->dev));
+    h = hash_bytes(h, &key->ino, sizeof(key->ino));
+    return (uint32_t)(h % CACHE_SLOTS);
+}
+
+
+static int
+same_file(const struct cache_slot* s, const struct cache_slot* key)
+{
+    return s->gen == key->gen && s->dev == key->dev && s->ino == key->ino;
+}
+
+
+/* Look name up. Returns 1 and fills res if the cached result still
+   holds, 0 if it has to be worked out (key is then ready to hand to
+   file_cache_put()), or -1 if name is not something to cache */
+int
+file_cache_get(struct file_cache* c, const char* name, int follow,
+               struct cache_slot* key, char* res, size_t reslen)
+{
+    struct cache_slot s;
+    struct stat st;
+    uint32_t i, n;
+    int hit = 0;
+
+    if((follow ? stat(name, &st) : lstat(name, &st)) == -1 ||
+        !S_ISREG(st.st_mode))
+        return -1;
+
+    (void)memset(key, 0, sizeof(*key));
+    key->gen = c->gen;
+    key->dev = (uint64_t)st.st_dev;
+    key->ino = (uint64_t)st.st_ino;
+    key->size = (int64_t)st.st_size;
+    key->mtime = ts_ns(&st.st_mtim);
+    key->ctime = ts_ns(&st.st_ctim);
+
+    i = slot_of(key);
+    (void)pthread_mutex_lock(&c->lock);
+    for(n = 0; n < CACHE_PROBE; n++, i = (i + 1) % CACHE_SLOTS)
+    {
+        s = c->slot[i];
+        if(s.sum != 0 && same_file(&s, key))
+            break;
+    }
+    (void)pthread_mutex_unlock(&c->lock);
+
+    if(n == CACHE_PROBE || s.size != key->size || s.mtime != key->mtime ||
+        s.ctime != key->ctime || memchr(s.res, '\0', sizeof(s.res)) == NULL ||
+        slot_sum(&s) != s.sum)
+        return 0;
+
+    /* looked at too soon after a change to be sure of it */
+    if(s.fp != 0 && fingerprint(name) != s.fp)
+        return 0;
+
+    if(strlcpy(res, s.res, reslen) < reslen)
+        hit = 1;
+    return hit;
+}
+
+
+/* Remember res as what name, last seen as key, is */
+void
+file_cache_put(struct file_cache* c, const char* name,
+               struct cache_slot* key, const char* res)
+{
+    struct timespec now;
+    uint32_t i, n, victim;
+
+    if(c->rdonly || strlen(res) >= sizeof(key->res))
+        return;
+
+    (void)clock_gettime(CLOCK_REALTIME, &now);
+    key->stored = ts_ns(&now);
+    key->fp = 0;
+    if(key->stored - MAX(key->mtime, key->ctime) < CACHE_RACY &&
+        (key->fp = fingerprint(name)) == 0)
+        return;
+    (void)strlcpy(key->res, res, sizeof(key->res));
+    key->sum = slot_sum(key);
+
+    /* the slot it had, else a free one, else the one stored longest
+       ago */
+    i = victim = slot_of(key);
+    (void)pthread_mutex_lock(&c->lock);
+    for(n = 0; n < CACHE_PROBE; n++, i = (i + 1) % CACHE_SLOTS)
+    {
+        if(c->slot[i].sum == 0 || same_file(&c->slot[i], key))
+        {
+            victim = i;
+            break;
+        }
+        if(c->slot[i].stored < c->slot[victim].stored)
+            victim = i;
+    }
+    c->slot[victim] = *key;
+    (void)pthread_mutex_unlock(&c->lock);
+}
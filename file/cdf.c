@@ -4,6 +4,8 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <err.h>        /* warn(const char* fmt, ...) */
@@ -23,11 +25,13 @@
             memcpy((a), &buf[len], sizeof(a)), len += sizeof(a)
 
 
-static union
+/* set here rather than in cdf_read_header(), which file -P runs
+   from several threads at once */
+static const union
 {
     char s[4];
     uint32_t u;
-} cdf_bo;
+} cdf_bo = { { 1, 2, 3, 4 } };
 
 
 /* swap a short */
@@ -243,6 +247,12 @@ cdf_read(const cdf_info_t* info, off_t off, void* buf, size_t len)
         return (ssize_t)len;
     }
 
+    if(info->i_map != NULL && info->i_maplen >= siz)
+    {
+        memcpy(buf, &info->i_map[off], len);
+        return (ssize_t)len;
+    }
+
     if(info->i_fd == -1)
         return -1;
 
@@ -254,11 +264,71 @@ cdf_read(const cdf_info_t* info, off_t off, void* buf, size_t len)
     return (ssize_t)len;
 }
 
+/* Map the file behind info->i_fd when it is more than i_buf holds,
+   so that the sectors past it come from memory instead of a pread()
+   each. Without a mapping, reads go to the file as before */
+void
+cdf_map(cdf_info_t* info)
+{
+    struct stat st;
+    void* p;
+
+    info->i_map = NULL;
+    info->i_maplen = 0;
+    if(info->i_fd == -1 || fstat(info->i_fd, &st) == -1 ||
+        !S_ISREG(st.st_mode) || (size_t)st.st_size <= info->i_len ||
+        (off_t)(size_t)st.st_size != st.st_size)
+        return;
+
+    if((p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE,
+                 info->i_fd, (off_t)0)) == MAP_FAILED)
+        return;
+    info->i_map = CAST(const unsigned char*, p);
+    info->i_maplen = (size_t)st.st_size;
+}
+
+
+void
+cdf_unmap(cdf_info_t* info)
+{
+    if(info->i_map != NULL)
+        (void)munmap(CAST(void*, info->i_map), info->i_maplen);
+    info->i_map = NULL;
+    info->i_maplen = 0;
+}
+
+
+/* Read the n sectors from id on, which are also next to each other
+   in the file, with one read */
+static ssize_t
+cdf_read_sectors(const cdf_info_t* info, void* buf, size_t offs,
+                 const cdf_header_t* h, cdf_secid_t id, size_t n)
+{
+    size_t pos = CDF_SEC_POS(h, id);
+
+    return cdf_read(info, (off_t)pos, ((char*)buf) + offs,
+                    n * CDF_SEC_SIZE(h));
+}
+
+
+/* How many sectors of the chain through sat, from sid on and at most
+   max of them, are each the one after the last in the file too */
+static size_t
+cdf_chain_run(const cdf_sat_t* sat, cdf_secid_t sid, size_t max)
+{
+    size_t n;
+
+    for(n = 1; n < max; n++, sid++)
+        if(CDF_TOLE4((uint32_t)sat->sat_tab[sid]) != (uint32_t)sid + 1)
+            break;
+    return n;
+}
+
+
 int cdf_read_header(const cdf_info_t* info, cdf_header_t* h)
 {
     char buf[512];
 
-    memcpy(cdf_bo.s, "\01\02\03\04", 4);
     if(cdf_read(info, (off_t)0, buf, sizeof(buf)) == -1)
         return -1;
 
@@ -412,7 +482,7 @@ void cdf_dump_dir(const cdf_info_t* info, const cdf_header_t* h,
 int
 cdf_read_sat(const cdf_info_t* info, cdf_header_t* h, cdf_sat_t* sat)
 {
-    size_t i, j, k;
+    size_t i, j, k, n;
     size_t ss = CDF_SEC_SIZE(h);
     cdf_secid_t *msa, mid, sec;
     size_t nsatpersec = (ss / sizeof(mid)) - 1;
@@ -438,12 +508,18 @@ cdf_read_sat(const cdf_info_t* info, cdf_header_t* h, cdf_sat_t* sat)
     if((sat->sat_tab = CAST(cdf_secid_t*, calloc(sat->sat_len, ss))) == NULL)
         return -1;
 
-    for(i = 0; i < __arraycount(h->h_master_sat); i++)
+    for(i = 0; i < __arraycount(h->h_master_sat); i += n)
     {
         if(h->h_master_sat[i] < 0)
             break;
-        if(cdf_read_sector(info, sat->sat_tab, ss * i, ss, h,
-            h->h_master_sat[i]) != (ssize_t)ss)
+        /* SAT sectors that are next to each other go in one read */
+        for(n = 1; i + n < __arraycount(h->h_master_sat) &&
+            h->h_master_sat[i + n] >= 0 &&
+            (uint32_t)h->h_master_sat[i + n] ==
+                (uint32_t)h->h_master_sat[i] + n; n++)
+            continue;
+        if(cdf_read_sectors(info, sat->sat_tab, ss * i, h,
+            h->h_master_sat[i], n) != (ssize_t)(n * ss))
         {
             DPRINTF(("Reading error %d", h->h_master_sat[i]));
             goto out1;
@@ -532,7 +608,7 @@ size_t cdf_count_chain(const cdf_sat_t* sat, cdf_secid_t sid, size_t size)
 int cdf_read_long_sector_chain(const cdf_info_t* info, const cdf_header_t* h,
         const cdf_sat_t* sat, cdf_secid_t sid, size_t len, cdf_stream_t* scn)
 {
-    size_t ss = CDF_SEC_SIZE(h), i, j;
+    size_t ss = CDF_SEC_SIZE(h), i, j, n;
     ssize_t nr;
     scn->sst_len = cdf_count_chain(sat, sid, ss);
     scn->sst_dirlen = len;
@@ -544,7 +620,7 @@ int cdf_read_long_sector_chain(const cdf_info_t* info, const cdf_header_t* h,
     if(scn->sst_tab == NULL)
         return -1;
 
-    for(i = j = 0; sid >= 0; i++, j++)
+    for(i = j = 0; sid >= 0; i += n, j += n)
     {
         if(j >= CDF_LOOP_LIMIT)
         {
@@ -560,10 +636,12 @@ int cdf_read_long_sector_chain(const cdf_info_t* info, const cdf_header_t* h,
             errno = EFTYPE;
             goto out;
         }
-        if((nr = cdf_read_sector(info, scn->sst_tab, i * ss, ss, h,
-                                sid)) != (ssize_t)ss)
+        /* a run of sectors next to each other goes in one read */
+        n = cdf_chain_run(sat, sid, scn->sst_len - i);
+        if((nr = cdf_read_sectors(info, scn->sst_tab, i * ss, h, sid,
+                                  n)) != (ssize_t)(n * ss))
         {
-            if(i == scn->sst_len - 1 && nr > 0)
+            if(i + n == scn->sst_len && nr > 0)
             {
                 /* last sector might be truncated */
                 return 0;
@@ -572,7 +650,7 @@ int cdf_read_long_sector_chain(const cdf_info_t* info, const cdf_header_t* h,
             goto out;
         }
 
-        sid = CDF_TOLE4((uint32_t)sat->sat_tab[sid]);
+        sid = CDF_TOLE4((uint32_t)sat->sat_tab[sid + n - 1]);
     }
     return 0;
 
@@ -607,7 +685,7 @@ cdf_read_sector(const cdf_info_t* info, void* buf, size_t offs,
 int cdf_read_ssat(const cdf_info_t* info, const cdf_header_t* h,
                  const cdf_sat_t* sat, cdf_sat_t* ssat)
 {
-    size_t i, j;
+    size_t i, j, n;
     size_t ss = CDF_SEC_SIZE(h);
     cdf_secid_t sid = h->h_secid_first_sector_in_short_sat;
 
@@ -619,7 +697,7 @@ int cdf_read_ssat(const cdf_info_t* info, const cdf_header_t* h,
     if(ssat->sat_tab == NULL)
         return -1;
 
-    for(j = i = 0; sid >= 0; i++, j++)
+    for(j = i = 0; sid >= 0; i += n, j += n)
     {
         if(j >= CDF_LOOP_LIMIT)
         {
@@ -635,12 +713,14 @@ int cdf_read_ssat(const cdf_info_t* info, const cdf_header_t* h,
             errno = EFTYPE;
             goto out;
         }
-        if(cdf_read_sector(info, ssat->sat_tab, i * ss, ss, h, sid) != (ssize_t)ss)
+        n = cdf_chain_run(sat, sid, ssat->sat_len - i);
+        if(cdf_read_sectors(info, ssat->sat_tab, i * ss, h, sid, n) !=
+            (ssize_t)(n * ss))
         {
             DPRINTF(("Reading short sat sector %d", sid));
             goto out;
         }
-        sid = CDF_TOLE4((uint32_t)sat->sat_tab[sid]);
+        sid = CDF_TOLE4((uint32_t)sat->sat_tab[sid + n - 1]);
     }
     return 0;
 out:
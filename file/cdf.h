@@ -23,6 +23,8 @@ typedef struct
     int i_fd;
     const unsigned char* i_buf;
     size_t i_len;
+    const unsigned char* i_map;     /* all of i_fd, see cdf_map() */
+    size_t i_maplen;
 } cdf_info_t;
 
 typedef struct
@@ -250,6 +252,8 @@ typedef struct
 } cdf_dir_t;
 
 
+void cdf_map(cdf_info_t* info);
+void cdf_unmap(cdf_info_t* info);
 int cdf_read_header(const cdf_info_t* info, cdf_header_t* h);
 int cdf_read_sat(const cdf_info_t*, cdf_header_t*, cdf_sat_t*);
 
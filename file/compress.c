@@ -3,6 +3,11 @@
                 information if recognized
     uncompress(method, old, n, newch) - uncompress old into new,
                 using method, return sizof new 
+
+   gzip, zip (deflate or stored), and, when built with their libraries,
+   bzip2 and xz are decoded in-process, and only the first HOWMANY bytes
+   of output are ever produced. The rest still go through a pipe to the
+   external program.
  */
 
 #include "file_.h"
@@ -14,34 +19,72 @@
 #include <errno.h>
 #include <string.h>
 #include <zlib.h>
+#ifdef HAVE_BZLIB_H
+#include <bzlib.h>
+#endif
+#ifdef HAVE_LZMA_H
+#include <lzma.h>
+#endif
 #include <stdlib.h>
 
 
+/* In-process decoders. They fill newch with at most HOWMANY bytes and
+   return 0, -1 if the data is broken, or 1 if they don't handle this
+   variant and the external program should be asked instead */
+typedef int (*decompress_t)(struct magic_set*, int, const unsigned char*,
+                            size_t, unsigned char*, size_t*);
+
+static int uncompressgzipped(struct magic_set*, int, const unsigned char*,
+                             size_t, unsigned char*, size_t*);
+static int uncompresszip(struct magic_set*, int, const unsigned char*,
+                         size_t, unsigned char*, size_t*);
+#ifdef HAVE_BZLIB_H
+static int uncompressbzip2(struct magic_set*, int, const unsigned char*,
+                           size_t, unsigned char*, size_t*);
+#else
+#define uncompressbzip2     NULL
+#endif
+#ifdef HAVE_LZMA_H
+static int uncompressxz(struct magic_set*, int, const unsigned char*,
+                        size_t, unsigned char*, size_t*);
+#else
+#define uncompressxz        NULL
+#endif
+
 static const struct {
     const char magic[8];
     size_t maglen;
     const char *argv[3];
     int silent;
+    decompress_t decompress;
 } compr[] = {
-    { "\037\235", 2, { "gzip", "-cdq", NULL }, 1 },     /* compressed */
+    { "\037\235", 2, { "gzip", "-cdq", NULL }, 1, NULL },     /* compressed */
     /* Uncompress can get stuck; so use gzip first if we have it
     * Idea from Damien Clark, thanks! */
-    { "\037\235", 2, { "uncompress", "-c", NULL }, 1 },	/* compressed */
-    { "\037\213", 2, { "gzip", "-cdq", NULL }, 1 },     /* gzipped */
-    { "\037\236", 2, { "gzip", "-cdq", NULL }, 1 },     /* frozen */
-    { "\037\240", 2, { "gzip", "-cdq", NULL }, 1 },     /* SCO LZH */
+    { "\037\235", 2, { "uncompress", "-c", NULL }, 1, NULL },	/* compressed */
+    { "\037\213", 2, { "gzip", "-cdq", NULL }, 1,             /* gzipped */
+        uncompressgzipped },
+    { "\037\236", 2, { "gzip", "-cdq", NULL }, 1, NULL },     /* frozen */
+    { "\037\240", 2, { "gzip", "-cdq", NULL }, 1, NULL },     /* SCO LZH */
     /* the standard pack utilities do not accept standard input */
-    { "\037\036", 2, { "gzip", "-cdq", NULL }, 0 },     /* packed */
-    { "PK\3\4",   4, { "gzip", "-cdq", NULL }, 1 },     /* pkzipped, */
+    { "\037\036", 2, { "gzip", "-cdq", NULL }, 0, NULL },     /* packed */
+    { "PK\3\4",   4, { "gzip", "-cdq", NULL }, 1,             /* pkzipped, */
+        uncompresszip },
                         /* ...only first file examined */
-    { "BZh",      3, { "bzip2", "-cd", NULL }, 1 },     /* bzip2-ed */
-    { "LZIP",     4, { "lzip", "-cdq", NULL }, 1 },
-    { "\3757zXZ\0",6,{ "xz", "-cd", NULL }, 1 },        /* XZ Utils */
-    { "LRZI",     4, { "lrzip", "-dqo-", NULL }, 1 },   /* LRZIP */
+    { "BZh",      3, { "bzip2", "-cd", NULL }, 1,             /* bzip2-ed */
+        uncompressbzip2 },
+    { "LZIP",     4, { "lzip", "-cdq", NULL }, 1, NULL },
+    { "\3757zXZ\0",6,{ "xz", "-cd", NULL }, 1,                /* XZ Utils */
+        uncompressxz },
+    { "LRZI",     4, { "lrzip", "-dqo-", NULL }, 1, NULL },   /* LRZIP */
 };
 
 #define NODATA  ((size_t)~0)
 
+/* how much compressed input to read at a time once the caller's
+   buffer runs out */
+#define ZCHUNK  (16 * 1024)
+
 
 /* `safe' read for sockets and pipes */
 ssize_t 
@@ -98,79 +141,239 @@ swrite(int fd, const void* buf, size_t n)
     return rn;
 }
 
-#define FHCRC       (1 << 1)
-#define FEXTRA      (1 << 2)
-#define FNAME       (1 << 3)
-#define FCOMMENT    (1 << 4)
+/* Fetch the next stretch of compressed input. The caller's buffer
+   holds the start of the file; if that was not all of it, read on from
+   fd, as long as fd is a file we can pread from. Returns 0 when there
+   is nothing more */
+static size_t
+zfill(int fd, off_t* off, unsigned char* buf, size_t len)
+{
+    ssize_t r;
 
+    if(fd == -1)
+        return 0;
 
-static size_t
-uncompressgzipped(struct magic_set* ms, const unsigned char* old,
-                unsigned char** newch, size_t n)
+    while((r = pread(fd, buf, len, *off)) == -1 && errno == EINTR)
+        continue;
+    if(r <= 0)
+        return 0;
+
+    *off += r;
+    return (size_t)r;
+}
+
+
+/* inflate raw (bits < 0) or gzip-wrapped (bits > 15) deflate data */
+static int
+uncompresszlib(struct magic_set* ms, int fd, const unsigned char* old,
+               size_t n, off_t off, int bits, unsigned char* newch,
+               size_t* nnew)
 {
-    unsigned char flg = old[3];
-    size_t data_start = 10;
+    unsigned char in[ZCHUNK];
     z_stream z;
     int rc;
 
-    if(flg & FEXTRA)
-    {
-        if(data_start + 1 >= n)
-            return 0;
+    z.next_in = (Bytef*)(intptr_t)old;
+    z.avail_in = CAST(uInt, n);
+    z.next_out = newch;
+    z.avail_out = HOWMANY;
+    z.zalloc = Z_NULL;
+    z.zfree = Z_NULL;
+    z.opaque = Z_NULL;
 
-        data_start += 2 + old[data_start] + old[data_start + 1] * 256;
+    /* LINTED bug in header macro */
+    rc = inflateInit2(&z, bits);
+    if(rc != Z_OK)
+    {
+        file_error(ms, 0, "zlib: %s", z.msg ? z.msg : zError(rc));
+        return -1;
     }
 
-    if(flg & FNAME)
+    while(z.avail_out > 0)
     {
-        while(data_start < n && old[data_start])
-            data_start++;
-        data_start++;
+        if(z.avail_in == 0)
+        {
+            z.avail_in = CAST(uInt, zfill(fd, &off, in, sizeof(in)));
+            if(z.avail_in == 0)
+                break;
+            z.next_in = in;
+        }
+
+        rc = inflate(&z, Z_SYNC_FLUSH);
+        if(rc == Z_STREAM_END)
+            break;
+        if(rc != Z_OK)
+            break;
     }
 
-    if(flg & FCOMMENT)
+    *nnew = (size_t)z.total_out;
+    (void)inflateEnd(&z);
+
+    /* a damaged stream still gives us what was decoded before the
+       damage; only say no when there was nothing at all */
+    if(*nnew == 0 && rc != Z_STREAM_END)
+        return -1;
+    return 0;
+}
+
+
+static int
+uncompressgzipped(struct magic_set* ms, int fd, const unsigned char* old,
+                  size_t n, unsigned char* newch, size_t* nnew)
+{
+    /* zlib reads the gzip header itself */
+    return uncompresszlib(ms, fd, old, n, (off_t)n, MAX_WBITS + 16,
+                          newch, nnew);
+}
+
+
+/* the first member of a zip archive, like gzip -cd does it */
+#define ZIP_HDRLEN      30
+#define ZIP_DESCRIPTOR  (1 << 3)    /* sizes follow the data */
+#define ZIP_STORED      0
+#define ZIP_DEFLATED    8
+
+static int
+uncompresszip(struct magic_set* ms, int fd, const unsigned char* old,
+              size_t n, unsigned char* newch, size_t* nnew)
+{
+    unsigned char in[ZCHUNK];
+    size_t data_start, len, size;
+    unsigned int flags, method;
+    off_t off;
+
+    if(n < ZIP_HDRLEN)
+        return -1;
+
+    flags = old[6] | (old[7] << 8);
+    method = old[8] | (old[9] << 8);
+    data_start = ZIP_HDRLEN + (old[26] | (old[27] << 8)) +
+                 (old[28] | (old[29] << 8));
+    if(data_start > n)
+        return -1;
+
+    switch(method)
     {
-        while(data_start < n && old[data_start])
-            data_start++;
-        data_start++;
+        case ZIP_DEFLATED:
+            return uncompresszlib(ms, fd, old + data_start, n - data_start,
+                                  (off_t)n, -MAX_WBITS, newch, nnew);
+
+        case ZIP_STORED:
+            /* stop at the end of the member, not of the archive */
+            size = HOWMANY;
+            if((flags & ZIP_DESCRIPTOR) == 0)
+                size = MIN(size, (size_t)(old[18] | (old[19] << 8) |
+                            (old[20] << 16) | ((uint32_t)old[21] << 24)));
+
+            len = MIN(n - data_start, size);
+            (void)memcpy(newch, old + data_start, len);
+            off = (off_t)n;
+            while(len < size)
+            {
+                size_t r = zfill(fd, &off, in, MIN(sizeof(in), size - len));
+                if(r == 0)
+                    break;
+                (void)memcpy(newch + len, in, r);
+                len += r;
+            }
+            *nnew = len;
+            return 0;
+
+        default:
+            return 1;
     }
+}
 
-    if(flg & FHCRC)
-        data_start += 2;
 
-    if(data_start >= n)
-        return 0;
-    if((*newch = CAST(unsigned char*, malloc(HOWMANY + 1))) == NULL)
+#ifdef HAVE_BZLIB_H
+static int
+uncompressbzip2(struct magic_set* ms, int fd, const unsigned char* old,
+                size_t n, unsigned char* newch, size_t* nnew)
+{
+    unsigned char in[ZCHUNK];
+    off_t off = (off_t)n;
+    bz_stream bz;
+    int rc;
+
+    (void)memset(&bz, 0, sizeof(bz));
+    bz.next_in = (char*)(intptr_t)old;
+    bz.avail_in = CAST(unsigned int, n);
+    bz.next_out = (char*)newch;
+    bz.avail_out = HOWMANY;
+
+    if((rc = BZ2_bzDecompressInit(&bz, 0, 0)) != BZ_OK)
     {
-        return 0;
+        file_error(ms, 0, "bzip2: error %d", rc);
+        return -1;
     }
 
-    /* XXX: const castaway, via strchr */
-    z.next_in = (Bytef*)strchr((const char*)old + data_start,
-                old[data_start]);
-    z.avail_in = CAST(uint32_t, (n - data_start));
-    z.next_out = *newch;
-    z.avail_out = HOWMANY;
-    z.zalloc = Z_NULL;
-    z.zfree = Z_NULL;
-    z.opaque = Z_NULL;
+    while(bz.avail_out > 0)
+    {
+        if(bz.avail_in == 0)
+        {
+            bz.avail_in = CAST(unsigned int, zfill(fd, &off, in, sizeof(in)));
+            if(bz.avail_in == 0)
+                break;
+            bz.next_in = (char*)in;
+        }
 
-    /* LINTED bug in header macro */
-    rc = inflateInit2(&z, -15);
-    if(rc != Z_OK)
+        if((rc = BZ2_bzDecompress(&bz)) != BZ_OK)
+            break;
+    }
+
+    *nnew = HOWMANY - bz.avail_out;
+    (void)BZ2_bzDecompressEnd(&bz);
+
+    if(*nnew == 0 && rc != BZ_STREAM_END)
+        return -1;
+    return 0;
+}
+#endif
+
+
+#ifdef HAVE_LZMA_H
+static int
+uncompressxz(struct magic_set* ms, int fd, const unsigned char* old,
+             size_t n, unsigned char* newch, size_t* nnew)
+{
+    unsigned char in[ZCHUNK];
+    off_t off = (off_t)n;
+    lzma_stream xz = LZMA_STREAM_INIT;
+    lzma_ret rc;
+
+    xz.next_in = old;
+    xz.avail_in = n;
+    xz.next_out = newch;
+    xz.avail_out = HOWMANY;
+
+    if((rc = lzma_stream_decoder(&xz, UINT64_MAX, 0)) != LZMA_OK)
     {
-        file_error(ms, 0, "zlib: %s", z.msg);
-        return 0;
+        file_error(ms, 0, "xz: error %d", (int)rc);
+        return -1;
     }
 
-    n = (size_t)z.total_out;
-    (void)inflateEnd(&z);
+    while(xz.avail_out > 0)
+    {
+        if(xz.avail_in == 0)
+        {
+            xz.avail_in = zfill(fd, &off, in, sizeof(in));
+            if(xz.avail_in == 0)
+                break;
+            xz.next_in = in;
+        }
+
+        if((rc = lzma_code(&xz, LZMA_RUN)) != LZMA_OK)
+            break;
+    }
 
-    /* let's keep the nul-ternimate tradition */
-    (*newch)[n] = '\0';
+    *nnew = HOWMANY - xz.avail_out;
+    lzma_end(&xz);
 
-    return n;
+    if(*nnew == 0 && rc != LZMA_STREAM_END)
+        return -1;
+    return 0;
 }
+#endif
 
 
 static size_t 
@@ -181,8 +384,31 @@ uncompressbuf(struct magic_set* ms, int fd, size_t method,
     ssize_t r;
     pid_t pid;
 
-    if(method == 2)
-        return uncompressgzipped(ms, old, newch, n);
+    if(compr[method].decompress != NULL)
+    {
+        size_t nnew = 0;
+        int rv;
+
+        if((*newch = CAST(unsigned char*, malloc(HOWMANY + 1))) == NULL)
+        {
+            file_oomem(ms, HOWMANY + 1);
+            return NODATA;
+        }
+
+        rv = (*compr[method].decompress)(ms, fd, old, n, *newch, &nnew);
+        if(rv == 0)
+        {
+            /* let's keep the nul-ternimate tradition */
+            (*newch)[nnew] = '\0';
+            return nnew;
+        }
+
+        free(*newch);
+        *newch = NULL;
+        if(rv == -1)
+            return NODATA;
+        /* not one we know; let the program have a go */
+    }
 
     fflush(stdout);
     fflush(stderr);
@@ -11,7 +11,7 @@
     {
         case ET_CORE:
             flags |= FLAGS_IS_CORE;
-            if(dophn_core(ms, clazz, swap, fd,
+            if(dophn_core(ms, clazz, swap, ef,
                         (off_t)elf_getu(swap, elfhdr.e_phoff),
                         elf_getu16(swap, elfhdr.e_phnum),
                         (size_t)elf_getu16(swap, elfhdr.e_phentsize),
@@ -21,7 +21,7 @@
 
         case ET_EXEC:
         case ET_DYN:
-            if(dophn_exec(ms, clazz, swap, fd,
+            if(dophn_exec(ms, clazz, swap, ef,
                         (off_t)elf_getu(swap, elfhdr.e_phoff),
                         elf_getu16(swap, elfhdr.e_phnum),
                         (size_t)elf_getu16(swap, elfhdr.e_phentsize),
@@ -30,7 +30,7 @@
                 return -1;
             /* FALLTHROUGH */
         case ET_REL:
-            if(doshn(ms, clazz, swap, fd,
+            if(doshn(ms, clazz, swap, ef,
                         (off_t)elf_getu(swap, elfhdr.e_shoff),
                         elf_getu16(swap, elfhdr.e_shnum),
                         (size_t)elf_getu16(swap, elfhdr.e_shentsize),
@@ -5,6 +5,7 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #ifdef DEBUG_ENCODING
 # define DPRINTF(a) printf a
@@ -12,58 +13,168 @@
 # define DPRINTF(a)
 #endif
 
-static int looks_ascii(const unsigned char*, size_t, unichar*, size_t*);
-static int looks_utf8_with_BOM(const unsigned char*, size_t, unichar*, size_t*);
-static int looks_ucs16(const unsigned char*, size_t, unichar*, size_t*);
-static int looks_latin1(const unsigned char*, size_t, unichar*, size_t*);
-static int looks_extended(const unsigned char*, size_t, unichar*, size_t*);
-static void from_ebcdic(const unsigned char*, size_t, unsigned char*);
+static int looks_utf8(const unsigned char*, size_t, unichar*, size_t*,
+                      struct text_stats*);
+static int looks_ucs16(const unsigned char*, size_t, unichar*, size_t*,
+                       struct text_stats*);
+static int looks_ebcdic(const unsigned char*, size_t);
+static int text_classes(const unsigned char*, size_t);
+static size_t decode_bytes(const unsigned char*, size_t,
+                           const unsigned char*, unichar*,
+                           struct text_stats*);
+
+static unsigned char ebcdic_to_ascii[256];
+
+/* what text_classes() returns: which of the text_chars[] classes
+   below occur in the buffer */
+#define CLASS_F     0x01
+#define CLASS_T     0x02
+#define CLASS_I     0x04
+#define CLASS_X     0x08
+
+#define MAXLINELEN  300     /* longest sane line length */
+
+
+/* ts counts, as the text is decoded, what file_ascmagic_with_encoding()
+   reports: line terminators, overlong lines, escapes and overstriking.
+   Only the characters STATS_SPECIAL() picks out are handed to
+   stats_char(), so that the rest cost one lookup: what they would
+   tell, how long a line got and whether a CR was followed by LF, is
+   worked out from where the special ones are, and by stats_done() at
+   the end. The callers keep ts on their stack, not where it could
+   alias the unichars they are writing, so that it can live in
+   registers */
+static const char stats_chars[256] = {
+    ['\b'] = 1, ['\n'] = 1, ['\r'] = 1, ['\033'] = 1, [0x85] = 1
+};
+
+#define STATS_SPECIAL(c)    ((c) < 256 && stats_chars[c])
+
+static void
+stats_init(struct text_stats* ts)
+{
+    (void)memset(ts, 0, sizeof(*ts));
+    ts->last_line_end = (size_t)-1;
+}
+
+
+/* count in c, character i */
+static void
+stats_char(struct text_stats* ts, unichar c, size_t i)
+{
+    /* a CR with something else after it, and the characters up
+       to this one, at most as long a line as those before */
+    if(ts->seen_cr && (c != '\n' || i != ts->last_line_end + 1))
+    {
+        ts->n_cr++;
+        ts->seen_cr = 0;
+    }
+    if(i > 0 && i - 1 > ts->last_line_end + MAXLINELEN)
+        ts->has_long_lines = 1;
+
+    if(c == '\n')
+    {
+        if(ts->seen_cr)
+            ts->n_crlf++;
+        else
+            ts->n_lf++;
+        ts->last_line_end = i;
+    }
+
+    ts->seen_cr = (c == '\r');
+    if(ts->seen_cr)
+        ts->last_line_end = i;
+
+    if(c == 0x85)
+    {
+        ts->n_nel++;
+        ts->last_line_end = i;
+    }
+
+    /* If this line is _longer_ than MAXLINELEN, remember it */
+    if(i > ts->last_line_end + MAXLINELEN)
+        ts->has_long_lines = 1;
+
+    if(c == '\033')
+        ts->has_escapes = 1;
+    if(c == '\b')
+        ts->has_backspace = 1;
+}
+
+
+/* ... and the n characters in all, so the last line and a CR not
+   at the very end */
+static void
+stats_done(struct text_stats* ts, size_t n)
+{
+    if(ts->seen_cr && n > ts->last_line_end + 1)
+    {
+        ts->n_cr++;
+        ts->seen_cr = 0;
+    }
+    if(n > 0 && n - 1 > ts->last_line_end + MAXLINELEN)
+        ts->has_long_lines = 1;
+}
 
 
 /* try to determine whether text is in some character code we can
    identify. Each of these tests, if it succeeds, will leave
    the text converted into one-unichar-per-character Unicode in
-   ubuf, and the number of characters converted in ulen */
-int file_encoding(struct magic_set* ms, const unsigned char* buf, 
-                  size_t nbytes, unichar** ubuf, size_t* ulen, 
+   ubuf, which must have room for nbytes + 1 of them, and the number
+   of characters converted in ulen; ts is filled in as it goes.
+
+   One pass over the bytes settles ASCII, ISO-8859 and extended ASCII
+   together, and stops at the first byte that never appears in text.
+   Without such a byte the data is text of some kind, so UTF-8 is
+   decoded as it is checked; with one, only UTF-16 (after a BOM) and
+   EBCDIC are left to try. Binary data is not decoded at all, and is
+   left with *ulen == 0 */
+int file_encoding(struct magic_set* ms __attribute__((__unused__)),
+                  const unsigned char* buf, 
+                  size_t nbytes, unichar* ubuf, size_t* ulen, 
                   const char** code, const char** code_mime,
-                  const char** type)
+                  const char** type, struct text_stats* ts)
 {
-    size_t mlen;
-    int rv = 1, ucs_type;
-    unsigned char* nbuf = NULL;
+    int cls, ucs_type = 0, ebcdic = 0;
 
     *type = "text";
-    mlen = (nbytes + 1) * sizeof(nbuf[0]);
-    if((nbuf = CAST(unsigned char*, calloc((size_t)1, mlen))) == NULL)
-    {
-        file_oomem(ms, mlen);
-        goto done;
-    }
-    mlen = (nbytes + 1) * sizeof((*ubuf)[0]);
-    if((*ubuf = CAST(unichar*, calloc((size_t)1, mlen))) == NULL)
+    *ulen = 0;
+    stats_init(ts);
+
+    cls = text_classes(buf, nbytes);
+
+    /* Doesn't look like text at all */
+    if((cls & CLASS_F) != 0 &&
+        !(nbytes >= 2 && ((buf[0] == 0xff && buf[1] == 0xfe) ||
+                          (buf[0] == 0xfe && buf[1] == 0xff))) &&
+        (ebcdic = looks_ebcdic(buf, nbytes)) == 0)
     {
-        file_oomem(ms, mlen);
-        goto done;
+        DPRINTF(("binary"));
+        *type = "binary";
+        return 0;
     }
 
-    if(looks_ascii(buf, nbytes, *ubuf, ulen))
+    if((cls & ~CLASS_T) == 0)
     {
+        *ulen = decode_bytes(buf, nbytes, NULL, ubuf, ts);
         DPRINTF(("ascii %" SIZE_T_FORMAT "u\n", *ulen));
         *code = "ASCII";
         *code_mime = "us-ascii";
-    } else if(looks_utf8_with_BOM(buf, nbytes, *ubuf, ulen) > 0)
+    } else if((cls & CLASS_F) == 0 && nbytes > 3 && buf[0] == 0xef &&
+              buf[1] == 0xbb && buf[2] == 0xbf &&
+              looks_utf8(buf + 3, nbytes - 3, ubuf, ulen, ts) > 0)
     {
         DPRINTF(("utf8/bom %" SIZE_T_FORMAT "u\n", *ulen));
         *code = "UTF-8 Unicode (with BOM)";
         *code_mime = "utf-8";
-    } else if(file_looks_utf8(buf, nbytes, *ubuf, ulen) > 1)
+    } else if((cls & CLASS_F) == 0 &&
+              looks_utf8(buf, nbytes, ubuf, ulen, ts) > 1)
     {
         DPRINTF(("utf8 %" SIZE_T_FORMAT "u\n", *ulen));
-        *code = "UTF-8 Unicode (with BOM)";
         *code = "UTF-8 Unicode";
         *code_mime = "utf-8";
-    } else if((ucs_type = looks_ucs16(buf, nbytes, *ubuf, ulen)) != 0)
+    } else if(ebcdic == 0 &&
+              (ucs_type = looks_ucs16(buf, nbytes, ubuf, ulen, ts)) != 0)
     {
         if(ucs_type == 1)
         {
@@ -75,42 +186,41 @@ int file_encoding(struct magic_set* ms, const unsigned char* buf,
             *code_mime = "utf-16be";
         }
         DPRINTF(("ucs16 %" SIZE_T_FORMAT "u\n", *ulen));
-    } else if(looks_latin1(buf, nbytes, *ubuf, ulen))
+    } else if((cls & (CLASS_F | CLASS_X)) == 0)
     {
+        *ulen = decode_bytes(buf, nbytes, NULL, ubuf, ts);
         DPRINTF(("latin1 %" SIZE_T_FORMAT "u\n", *ulen));
         *code = "ISO-8859";
         *code_mime = "iso-8859-1";
-    } else if(looks_extended(buf, nbytes, *ubuf, ulen))
+    } else if((cls & CLASS_F) == 0)
     {
+        *ulen = decode_bytes(buf, nbytes, NULL, ubuf, ts);
         DPRINTF(("extended %" SIZE_T_FORMAT "u\n", *ulen));
         *code = "Non-ISO extended-ASCII";
         *code_mime = "unknown-8bit";
-    } else
+    } else if(ebcdic != 0 || (ebcdic = looks_ebcdic(buf, nbytes)) != 0)
     {
-        from_ebcdic(buf, nbytes, nbuf);
-
-        if(looks_ascii(nbuf, nbytes, *ubuf, ulen))
+        *ulen = decode_bytes(buf, nbytes, ebcdic_to_ascii, ubuf, ts);
+        if(ebcdic == 1)
         {
             DPRINTF(("ebcdic %" SIZE_T_FORMAT "u\n", *ulen));
             *code = "EBCDIC";
-            *code_mime = "ebcdic";
-        } else if(looks_latin1(nbuf, nbytes, *ubuf, ulen))
+        } else
         {
             DPRINTF(("ebcdic/international %" SIZE_T_FORMAT "u\n", *ulen));
             *code = "International EBCDIC";
-            *code_mime = "ebcdic";
-        } else
-        {
-            /* Doesn't look like text at all */
-            DPRINTF(("binary"));
-            rv = 0;
-            *type = "binary";
         }
+        *code_mime = "ebcdic";
+    } else
+    {
+        /* a UTF-16 BOM, but not UTF-16 after all */
+        DPRINTF(("binary"));
+        *ulen = 0;
+        *type = "binary";
+        return 0;
     }
-done:
-    free(nbuf);
 
-    return rv;
+    return 1;
 }
 
 
@@ -193,6 +303,16 @@ static char text_chars[256] =
 
 
 
+/* Runs of printable ASCII, the bulk of most text, are taken a word at
+   a time: a byte b is in 0x20 ... 0x7e exactly when none of b,
+   b - 0x20 and b + 1 has its top bit set, and as long as that holds
+   for the lower bytes of the word no borrow or carry crosses into
+   the next one */
+#define ONES                ((uint64_t)0x0101010101010101ULL)
+#define PRINTABLE_WORD(w)   \
+    ((((w) | ((w) - ONES * 0x20) | ((w) + ONES)) & (ONES * 0x80)) == 0)
+
+
 /* Decide whether some text looks UTF-8. Returns:
         -1: invalid UTF-8
          0: uses odd control characters, so doesn't look like text
@@ -203,16 +323,39 @@ static char text_chars[256] =
 int file_looks_utf8(const unsigned char* buf, size_t nbytes,
                     unichar* ubuf, size_t* ulen)
 {
-    size_t i;
+    return looks_utf8(buf, nbytes, ubuf, ulen, NULL);
+}
+
+
+/* ... counting what it decodes into ts, if not NULL */
+static int looks_utf8(const unsigned char* buf, size_t nbytes,
+                      unichar* ubuf, size_t* ulen, struct text_stats* ts)
+{
+    size_t i, u = 0;
     int n;
     unichar c;
+    uint64_t w;
     int gotone = 0, ctrl = 0;
+    struct text_stats st;
 
-    if(ubuf)
-        *ulen = 0;
+    stats_init(&st);
 
     for(i = 0; i < nbytes; i++)
     {
+        if(i + sizeof(w) <= nbytes)
+        {
+            (void)memcpy(&w, buf + i, sizeof(w));
+            if(PRINTABLE_WORD(w))
+            {
+                if(ubuf)
+                    for(n = 0; n < (int)sizeof(w); n++)
+                        ubuf[u + n] = buf[i + n];
+                u += sizeof(w);
+                i += sizeof(w) - 1;
+                continue;
+            }
+        }
+
         if((buf[i] & 0x80) == 0)    /* 0xxxxxxx is plain ASCII */
         {
             /* Even if the whole file is valid UTF-8 sequences,
@@ -220,8 +363,11 @@ int file_looks_utf8(const unsigned char* buf, size_t nbytes,
             if(text_chars[buf[i]] != T)
                 ctrl = 1;
 
+            if(stats_chars[buf[i]])
+                stats_char(&st, buf[i], u);
             if(ubuf)
-                ubuf[(*ulen)++] = buf[i];
+                ubuf[u] = buf[i];
+            u++;
         } else if((buf[i] & 0x40) == 0)     /* 10xxxxxx never 1st byte */
             return -1;
         else       /* 11xxxxxx begins UTF-8 */
@@ -263,55 +409,35 @@ int file_looks_utf8(const unsigned char* buf, size_t nbytes,
                 c = (c << 6) + (buf[i] & 0x3f);
             }
 
+            if(STATS_SPECIAL(c))
+                stats_char(&st, c, u);
             if(ubuf)
-                ubuf[(*ulen)++] = c;
+                ubuf[u] = c;
+            u++;
             gotone = 1;
         }
     }
 done:
+    stats_done(&st, u);
+    if(ubuf)
+        *ulen = u;
+    if(ts)
+        *ts = st;
     return ctrl ? 0 : (gotone ? 2 : 1);
 }
 
 
-static int looks_ascii(const unsigned char* buf, size_t nbytes,
-                       unichar* ubuf, size_t* ulen)
-{
-    size_t i;
-
-    *ulen = 0;
-
-    for(i = 0; i < nbytes; i++)
-    {
-        int t = text_chars[buf[i]];
-
-        if(t != T)
-            return 0;
-
-        ubuf[(*ulen)++] = buf[i];
-    }
-
-    return 1;
-}
-
-
-/* Decide whether some text looks like UTF-8 with BOM. If there is no
-   BOM, return -1; otherwise return the result of looks_utf8 on the
-   rest of the text */
-static int looks_utf8_with_BOM(const unsigned char* buf, size_t nbytes,
-                               unichar* ubuf, size_t* ulen)
-{
-    if(nbytes > 3 && buf[0] == 0xef && buf[1] == 0xbb && buf[2] == 0xbf)
-        return file_looks_utf8(buf + 3, nbytes - 3, ubuf, ulen);
-    else
-        return -1;
-}
-
-
+/* Decide whether some text looks like UTF-16 with a BOM: returns 1
+   for little-endian, 2 for big-endian, 0 if not. If ubuf is non-nul,
+   the text is decoded into ubuf, *ulen, and counted into ts; ubuf
+   must be big enough */
 static int looks_ucs16(const unsigned char* buf, size_t nbytes,
-                       unichar* ubuf, size_t* ulen)
+                       unichar* ubuf, size_t* ulen, struct text_stats* ts)
 {
     int bigend;
-    size_t i;
+    size_t i, u = 0;
+    unichar c;
+    struct text_stats st;
 
     if(nbytes < 2)
         return 0;
@@ -323,65 +449,88 @@ static int looks_ucs16(const unsigned char* buf, size_t nbytes,
     else
         return 0;
 
-    *ulen = 0;
+    stats_init(&st);
 
     for(i = 2; i + 1 < nbytes; i += 2)
     {
         /* XXX: fix to properly handle chars > 65536 */
 
         if(bigend)
-            ubuf[(*ulen)++] = buf[i + 1] + 256 * buf[i];
+            c = buf[i + 1] + 256 * buf[i];
         else
-            ubuf[(*ulen)++] = buf[i] + 256 * buf[i + 1];
+            c = buf[i] + 256 * buf[i + 1];
 
-        if(ubuf[*ulen - 1] == 0xfffe)
+        if(c == 0xfffe)
             return 0;
-        if(ubuf[*ulen - 1] < 128 &&
-                text_chars[(size_t)ubuf[*ulen - 1]] != T)
+        if(c < 128 && text_chars[(size_t)c] != T)
             return 0;
+
+        if(STATS_SPECIAL(c))
+            stats_char(&st, c, u);
+        if(ubuf)
+            ubuf[u] = c;
+        u++;
     }
 
+    stats_done(&st, u);
+    if(ubuf)
+        *ulen = u;
+    if(ts)
+        *ts = st;
     return 1 + bigend;
 }
 
 
-static int looks_latin1(const unsigned char* buf, size_t nbytes,
-                        unichar* ubuf, size_t* ulen)
+/* OR together the classes of the bytes in buf, stopping at the first
+   byte that never appears in text */
+static int text_classes(const unsigned char* buf, size_t nbytes)
 {
-    size_t i;
-    *ulen = 0;
+    size_t i = 0;
+    uint64_t w;
+    int cls = 0, t;
 
-    for(i = 0; i < nbytes; i++)
+    while(i < nbytes)
     {
-        int t = text_chars[buf[i]];
-
-        if(t != T && t != I)
-            return 0;
+        if(i + sizeof(w) <= nbytes)
+        {
+            (void)memcpy(&w, buf + i, sizeof(w));
+            if(PRINTABLE_WORD(w))
+            {
+                cls |= CLASS_T;
+                i += sizeof(w);
+                continue;
+            }
+        }
 
-        ubuf[(*ulen)++] = buf[i];
+        t = text_chars[buf[i++]];
+        cls |= 1 << t;
+        if(t == F)
+            break;
     }
 
-    return 1;
+    return cls;
 }
 
 
-static int looks_extended(const unsigned char* buf, size_t nbytes,
-                          unichar* ubuf, size_t* ulen)
+/* Decide whether some data looks like EBCDIC text: returns 1 if its
+   ASCII translation is plain ASCII, 2 if it is ISO-8859, 0 if it
+   is neither */
+static int looks_ebcdic(const unsigned char* buf, size_t nbytes)
 {
     size_t i;
-    *ulen = 0;
+    int t, latin1 = 0;
 
     for(i = 0; i < nbytes; i++)
     {
-        int t = text_chars[buf[i]];
+        t = text_chars[ebcdic_to_ascii[buf[i]]];
 
-        if(t != T && t != I && t != X)
+        if(t == I)
+            latin1 = 1;
+        else if(t != T)
             return 0;
-
-        ubuf[(*ulen)++] = buf[i];
     }
 
-    return 1;
+    return 1 + latin1;
 }
 
 
@@ -429,11 +578,25 @@ static unsigned char ebcdic_to_ascii[] = {
 '0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 250, 251, 252, 253, 254, 255
 };
 
-/* Copy buf[0 ... nbytes-1] into out[], translating EBCDIC to ASCII */
-static void from_ebcdic(const unsigned char* buf, size_t nbytes, unsigned char* out)
+/* Decode one byte per character, through map[] if that is given,
+   counting into ts as it goes */
+static size_t decode_bytes(const unsigned char* buf, size_t nbytes,
+                           const unsigned char* map, unichar* ubuf,
+                           struct text_stats* ts)
 {
     size_t i;
+    unsigned char c;
+    struct text_stats st;
 
+    stats_init(&st);
     for(i = 0; i < nbytes; i++)
-        out[i] = ebcdic_to_ascii[buf[i]];
+    {
+        c = map ? map[buf[i]] : buf[i];
+        ubuf[i] = c;
+        if(stats_chars[c])
+            stats_char(&st, c, i);
+    }
+    stats_done(&st, nbytes);
+    *ts = st;
+    return nbytes;
 }
@@ -3,12 +3,15 @@
 #include <stdlib.h>
 #include <error.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 #include <getopt.h>
 #include <locale.h>
 #include <string.h>
+#include <pthread.h>
+#include <ftw.h>
 
 #include <stdio.h>
 
@@ -24,22 +27,23 @@ static void docprint(const char*);
 static void help(void);
 
 static int  unwrap(struct magic_set*, const char*);
-static int  process(struct magic_set*, const char*, int);
+static int  process(struct magic_set*, const char*, int, FILE*);
+static int  jobs_run(struct magic_set*, char**, int, int);
 static struct magic_set* load(const char*, int);
 
 static size_t file_mbswidth(const char* s);
 
 #ifdef S_IFLNK
-#define FILE_FLAGS "-bchikLlNnprsvz0"
+#define FILE_FLAGS "-bchiKkLlNnprsvz0"
 #else
-#define FILE_FLAGS "-bciklNnprsvz0"
+#define FILE_FLAGS "-bciKklNnprsvz0"
 #endif
 
 #define USAGE       \
     "Usage: %s [" FILE_FLAGS \
-    "] [--apple] [--mime-encoding] [--mime-type]\n" \
+    "] [--apple] [--mime-encoding] [--mime-type] [--profile[=N]]\n" \
     "            [-e testname] [-F separator] [-f namefile] [-m magicfiles] "   \
-    "file ...\n"    \
+    "[-P jobs] file ...\n"    \
     "       %s -C [-m magicfiles]\n"    \
     "       %s [--help]\n"
 
@@ -47,7 +51,12 @@ static int      /* Global command-line options */
     bflag = 0,  /* brief output format */
     nopad = 0,  /* don't pad output */
     nobuffer = 0, /* don't buffer stdout */
-    nulsep = 0;   /* append '\0' to the separator */
+    nulsep = 0,   /* append '\0' to the separator */
+    njobs = 0,    /* classify with a pool of threads */
+    kflag = 0,    /* keep results in a cache */
+    nprofile = -1; /* entries to list for --profile */
+
+static struct file_cache* cache;        /* -K */
 
 static const char* separator = ":";     /* default field separator */
 
@@ -63,7 +72,7 @@ static const struct option long_options[] =
 #undef OPT_LONGONLY
     {NULL, 0, NULL, 0}
 };
-#define OPTSTRING       "bcCde:f:F:hiklLm:nNprsvz0"
+#define OPTSTRING       "bcCde:f:F:hiKklLm:nNpP:rsvz0"
 
 
 static const struct
@@ -163,6 +172,23 @@ int main(int argc, char** argv)
                     case 12:
                         flags |= MAGIC_MIME_ENCODING;
                         break;
+                    case 13:
+                    {
+                        char* end;
+                        long n = 20;
+
+                        flags |= MAGIC_PROFILE;
+                        if(optarg)
+                        {
+                            errno = 0;
+                            n = strtol(optarg, &end, 10);
+                            if(end == optarg || *end != '\0' ||
+                                errno != 0 || n < 0 || n > INT_MAX)
+                                usage();
+                        }
+                        nprofile = (int)n;
+                        break;
+                    }
                 }
                 break;
             case '0':
@@ -205,6 +231,9 @@ int main(int argc, char** argv)
             case 'i':
                 flags |= MAGIC_MIME;
                 break;
+            case 'K':
+                kflag = 1;
+                break;
             case 'k':
                 flags |= MAGIC_CONTINUE;
                 break;
@@ -223,6 +252,10 @@ int main(int argc, char** argv)
             case 'p':
                 flags |= MAGIC_PRESERVE_ATIME;
                 break;
+            case 'P':
+                if((njobs = atoi(optarg)) <= 0)
+                    usage();
+                break;
             case 'r':
                 flags |= MAGIC_RAW;
                 break;
@@ -303,11 +336,25 @@ int main(int argc, char** argv)
             break;
     }
 
+    if(kflag &&
+        (cache = file_cache_open(magic_getpath(magicfile, FILE_LOAD),
+                                 flags)) == NULL)
+    {
+        (void)fprintf(stderr, "%s: no result cache (%s)\n",
+                      progname, strerror(errno));
+    }
+
     if(optind == argc)
     {
         if(!didsomefiles)
             usage();
     }
+    else if(njobs > 0)
+    {
+        if(bflag == 2)
+            bflag = 0;
+        e |= jobs_run(magic, argv + optind, argc - optind, flags);
+    }
     else
     {
         size_t j, wid, nw;
@@ -325,10 +372,13 @@ int main(int argc, char** argv)
             bflag = optind >= argc - 1;
         }
         for(; optind < argc; optind++)
-            e |= process(magic, argv[optind], wid);
+            e |= process(magic, argv[optind], wid, stdout);
     }
+    if(magic && nprofile >= 0)
+        (void)magic_profile(magic, stderr, (size_t)nprofile);
     if(magic)
         magic_close(magic);
+    file_cache_close(cache);
 
     return e;
 }
@@ -394,7 +444,7 @@ unwrap(struct magic_set* ms, const char* fn)
     {
         if(line[len - 1] == '\n')
             line[len - 1] = '\0';
-        e |= process(ms, line, wid);
+        e |= process(ms, line, wid, stdout);
         if(nobuffer)
             (void)fflush(stdout);
     }
@@ -407,34 +457,257 @@ unwrap(struct magic_set* ms, const char* fn)
 
 /* Called for each input file on the command line (or in a list of files) */
 static int
-process(struct magic_set* ms, const char* inname, int wid)
+process(struct magic_set* ms, const char* inname, int wid, FILE* out)
 {
     const char* type;
     int std_in = strcmp(inname, "-") == 0;
+    struct cache_slot key;
+    char cached[sizeof(key.res)];
+    int c = -1;
 
     if(wid > 0 && !bflag)
     {
-        (void)printf("%s", std_in ? "/dev/stdin" : inname);
+        (void)fprintf(out, "%s", std_in ? "/dev/stdin" : inname);
         if(nulsep)
-            (void)putc('\0', stdout);
-        (void)printf("%s", separator);
-        (void)printf("%*s ",
+            (void)putc('\0', out);
+        (void)fprintf(out, "%s", separator);
+        (void)fprintf(out, "%*s ",
                 (int)(nopad ? 0 : (wid - file_mbswidth(inname))), "");
     }
 
-    type = magic_file(ms, std_in ? NULL : inname);
+    if(cache != NULL && !std_in)
+        c = file_cache_get(cache, inname, (ms->flags & MAGIC_SYMLINK) != 0,
+                           &key, cached, sizeof(cached));
+    if(c == 1)
+        type = cached;
+    else if((type = magic_file(ms, std_in ? NULL : inname)) != NULL && c == 0)
+        file_cache_put(cache, inname, &key, type);
+
     if(type == NULL)
     {
-        (void)printf("ERROR: %s\n", magic_error(ms));
+        (void)fprintf(out, "ERROR: %s\n", magic_error(ms));
         return 1;
     } else
     {
-        (void)printf("%s\n", type);
+        (void)fprintf(out, "%s\n", type);
         return 0;
     }
 }
 
 
+/* -P: the operands, and everything under those that are directories,
+   are classified by a pool of threads, each with its own magic_set
+   sharing the loaded magic.  Names are queued into a ring of slots
+   in the order they are found and printed from it in that order, so
+   the output is the same as a serial run; a slow file holds back at
+   most JOB_WINDOW slots per thread before the walk waits for it */
+#define JOB_WINDOW  64
+
+struct job
+{
+    char* name;
+    char* out;          /* what process() printed */
+    size_t outlen;
+    int e;
+    int done;
+};
+
+static struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work;    /* a job was queued, or the walk ended */
+    pthread_cond_t room;    /* the oldest job was printed */
+    struct job* slot;
+    size_t nslot;
+    size_t head;            /* next job to queue */
+    size_t next;            /* next job to classify */
+    size_t tail;            /* next job to print */
+    int eof;
+    int e;
+} jobs = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+           PTHREAD_COND_INITIALIZER, NULL, 0, 0, 0, 0, 0, 0 };
+
+
+/* print the finished jobs at the tail of the ring; called locked */
+static void
+jobs_flush(void)
+{
+    struct job* j;
+
+    while(jobs.tail != jobs.next &&
+        (j = &jobs.slot[jobs.tail % jobs.nslot])->done)
+    {
+        (void)fwrite(j->out, 1, j->outlen, stdout);
+        jobs.e |= j->e;
+        free(j->name);
+        free(j->out);
+        (void)memset(j, 0, sizeof(*j));
+        jobs.tail++;
+    }
+    if(nobuffer)
+        (void)fflush(stdout);
+    (void)pthread_cond_signal(&jobs.room);
+}
+
+
+static void*
+jobs_worker(void* arg)
+{
+    struct magic_set* ms = CAST(struct magic_set*, arg);
+    struct job* j;
+    FILE* out;
+    int e;
+
+    (void)pthread_mutex_lock(&jobs.lock);
+    for(;;)
+    {
+        while(jobs.next == jobs.head && !jobs.eof)
+            (void)pthread_cond_wait(&jobs.work, &jobs.lock);
+        if(jobs.next == jobs.head)
+            break;
+        j = &jobs.slot[jobs.next++ % jobs.nslot];
+        (void)pthread_mutex_unlock(&jobs.lock);
+
+        if((out = open_memstream(&j->out, &j->outlen)) == NULL)
+        {
+            (void)fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+            e = 1;
+        } else
+        {
+            e = process(ms, j->name, 1, out);
+            (void)fclose(out);
+        }
+
+        (void)pthread_mutex_lock(&jobs.lock);
+        j->e = e;
+        j->done = 1;
+        jobs_flush();
+    }
+    (void)pthread_mutex_unlock(&jobs.lock);
+    return NULL;
+}
+
+
+static int
+jobs_add(const char* name)
+{
+    char* s;
+
+    if((s = strdup(name)) == NULL)
+    {
+        (void)fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+        return -1;
+    }
+
+    (void)pthread_mutex_lock(&jobs.lock);
+    while(jobs.head - jobs.tail == jobs.nslot)
+        (void)pthread_cond_wait(&jobs.room, &jobs.lock);
+    jobs.slot[jobs.head++ % jobs.nslot].name = s;
+    (void)pthread_cond_signal(&jobs.work);
+    (void)pthread_mutex_unlock(&jobs.lock);
+    return 0;
+}
+
+
+static int
+jobs_walk(const char* name, const struct stat* sb __attribute__((unused)),
+        int type __attribute__((unused)),
+        struct FTW* ftw __attribute__((unused)))
+{
+    return jobs_add(name) == -1 ? 1 : 0;
+}
+
+
+static int
+jobs_run(struct magic_set* ms, char** names, int nnames, int flags)
+{
+    pthread_t* tid;
+    struct magic_set** mss;
+    struct stat sb;
+    int i, n, e = 0, walk = FTW_PHYS;
+
+    if(flags & MAGIC_SYMLINK)
+        walk = 0;
+
+    /* the names aren't known up front, so there is nothing to pad to */
+    nopad = 1;
+
+    jobs.nslot = (size_t)njobs * JOB_WINDOW;
+    jobs.slot = CAST(struct job*, calloc(jobs.nslot, sizeof(*jobs.slot)));
+    tid = CAST(pthread_t*, calloc((size_t)njobs, sizeof(*tid)));
+    mss = CAST(struct magic_set**, calloc((size_t)njobs, sizeof(*mss)));
+    if(jobs.slot == NULL || tid == NULL || mss == NULL)
+    {
+        (void)fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+        return 1;
+    }
+
+    for(n = 0; n < njobs; n++)
+    {
+        if((mss[n] = n == 0 ? ms : magic_dup(ms)) == NULL)
+        {
+            (void)fprintf(stderr, "%s: %s\n", progname, strerror(errno));
+            break;
+        }
+        if(pthread_create(&tid[n], NULL, jobs_worker, mss[n]) != 0)
+        {
+            (void)fprintf(stderr, "%s: cannot create thread\n", progname);
+            if(n != 0)
+                magic_close(mss[n]);
+            break;
+        }
+    }
+
+    if(n > 0)
+    {
+        for(i = 0; i < nnames; i++)
+        {
+            /* a name that can't be walked is still queued, so that
+               it gets the usual diagnostic in its place */
+            if(strcmp(names[i], "-") == 0 || lstat(names[i], &sb) == -1)
+            {
+                if(jobs_add(names[i]) == -1)
+                    break;
+                continue;
+            }
+            switch(nftw(names[i], jobs_walk, 64, walk))
+            {
+                case 0:
+                    continue;
+                case -1:
+                    (void)fprintf(stderr, "%s: cannot walk `%s' (%s).\n",
+                                    progname, names[i], strerror(errno));
+                    e = 1;
+                    continue;
+                default:
+                    break;
+            }
+            break;
+        }
+    }
+
+    (void)pthread_mutex_lock(&jobs.lock);
+    jobs.eof = 1;
+    (void)pthread_cond_broadcast(&jobs.work);
+    (void)pthread_mutex_unlock(&jobs.lock);
+
+    if(n < njobs || i < nnames)
+        e = 1;
+
+    for(i = 0; i < n; i++)
+    {
+        (void)pthread_join(tid[i], NULL);
+        if(i != 0)
+            magic_close(mss[i]);
+    }
+
+    free(mss);
+    free(tid);
+    free(jobs.slot);
+    return e | jobs.e;
+}
+
+
 static void
 help(void)
 {
@@ -8,6 +8,7 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <time.h>
+#include <regex.h>
 
 #include "cdf.h"
 
@@ -31,6 +32,10 @@
 #define HOWMANY (256 * 1024)    /* how much of the file to look at */
 #endif
 
+#ifndef WINDOW
+#define WINDOW  (4 * 1024)      /* how much to read before a test wants more */
+#endif
+
 #define MAXMAGIC 8192   /* max entries in any one magic file or directory */
 
 #define ENABLE_CONDITIONALS
@@ -274,15 +279,67 @@ struct magic
 
 
 
+/* a FILE_REGEX pattern, compiled once when the magic is loaded and
+   shared by every entry and magic_set that uses the same pattern */
+struct magic_regex
+{
+    struct magic_regex* next;   /* hash chain */
+    char pattern[MAXstring];
+    int cflags;
+    int rc;                     /* regcomp() result, 0 if rx is usable */
+    uint32_t refs;
+    regex_t rx;
+};
+
+#define FILE_REGEX_CFLAGS(m)    (REG_EXTENDED | REG_NEWLINE | \
+    (((m)->str_flags & STRING_IGNORE_CASE) ? REG_ICASE : 0))
+
+/* what MAGIC_PROFILE found an entry to cost; shared by the threads
+   of file -P, so only ever added to atomically */
+struct magic_prof
+{
+    uint64_t calls;             /* times match() tried it */
+    uint64_t hits;              /* times it matched */
+    uint64_t ns;                /* time in its mget() and magiccheck() */
+};
+
+/* run-time data kept beside each entry, parallel to mlist->magic[];
+   unlike struct magic it is never written to a compiled .mgc */
+struct magic_aux
+{
+    struct magic_regex* regex;  /* compiled value.s of a FILE_REGEX */
+    unsigned char* skip;        /* Horspool shifts of a plain FILE_SEARCH */
+    struct magic_prof prof;
+    uint32_t src;               /* its file in mlist->src[], if any */
+};
+
+/* top-level entries bucketed by the byte they need at offset 0 of
+   the buffer; an entry that could match any byte is kept in any[] */
+struct magic_index
+{
+    uint32_t start[257];        /* bucket b is ent[start[b]..start[b+1]) */
+    uint32_t* ent;              /* indices into magic[], ascending */
+    uint32_t* any;
+    uint32_t nany;
+};
+
 /* list of magic entries */
 struct mlist
 {
     struct magic *magic;        /* array of magic entries */
     uint32_t      nmagic;       /* number of entries in array */
+    uint32_t      ntext;        /* of them, top level ones tried on text */
+    struct magic_aux* aux;      /* side table for magic[], or NULL */
+    struct magic_index* index;  /* candidates for match(), or NULL */
     void* map;                  /* internal resources used by entry */
+    const char* name;           /* magic file the entries came from */
+    char* const* src;           /* the files of a magic directory that
+                                   was parsed, by magic_aux.src; or NULL */
     struct mlist *next, *prev;
 };
 
+#define MAGIC_AUX(ml, i)    ((ml)->aux == NULL ? NULL : &(ml)->aux[i])
+
 #ifndef CAST
 #define CAST(T, b)      (T)(b)
 #define RCAST(T, b)     (T)(b)
@@ -309,10 +366,16 @@ struct magic_set
         size_t len;
         struct level_info* li;
     } c;
+#ifdef ENABLE_CONDITIONALS
+    uint32_t last_cont_level;               /* of the last line parse() saw */
+#endif
     struct out
     {
         char* buf;                          /* Accumulation buffer */
+        size_t blen;                        /* bytes in it, less the NUL */
+        size_t bsize;                       /* bytes allocated for it */
         char* pbuf;                         /* Pritable buffer */
+        size_t psize;                       /* bytes allocated for it */
     } o;
     uint32_t offset;
     int error;
@@ -334,15 +397,67 @@ struct magic_set
     /* Make the string dynamically allocated so that e.g.
        strings matched in files can be longer than MAXstring */
     union VALUETYPE ms_value;               /* either number or string */
+
+    /* The start of the file being looked at. Only WINDOW bytes are read
+       at first; if a test looks past them, the rest up to HOWMANY is
+       read and the file is looked at again */
+    struct window
+    {
+        unsigned char* buf;                 /* HOWMANY + SLOP, kept between files */
+        size_t len;                         /* bytes read into buf */
+        int more;                           /* the file goes on past len */
+        int want;                           /* some test looked past len */
+    } w;
+
+    /* Working space kept between files, see file_scratch_get() */
+    struct scratch
+    {
+        void* p;                            /* NULL while lent out */
+        size_t len;
+    } sc[2];
+#define SCRATCH_TEXT    0                   /* decoded text, unichar[] */
+#define SCRATCH_UTF8    1                   /* that as UTF-8 again */
+
+    /* MIME encoding found by the last file_buffer() */
+    const char* code_mime;
+
+    /* results of the batch calls, each string kept once and handed
+       out by its index in str */
+    struct strtab
+    {
+        char** str;
+        uint32_t nstr;
+        uint32_t maxstr;
+        uint32_t* slot;                     /* index + 1, 0 if free */
+        uint32_t nslot;                     /* a power of 2 */
+    } st;
 };
 
 /* Type for Unicode characters */
 typedef unsigned long unichar;
 
+/* What file_encoding() counts as it decodes text, for
+   file_ascmagic_with_encoding() to report */
+struct text_stats
+{
+    int n_crlf;
+    int n_lf;
+    int n_cr;
+    int n_nel;
+    int seen_cr;                            /* the last character was CR */
+    int has_escapes;
+    int has_backspace;
+    int has_long_lines;
+    size_t last_line_end;
+};
+
 #define FILE_T_LOCAL    1
 #define FILE_T_WINDOWS  2
 
 int file_apprentice(struct magic_set*, const char*, int);
+int file_apprentice_share(struct magic_set*, const struct magic_set*);
+int file_apprentice_profile(struct magic_set*, FILE*, size_t);
+uint64_t file_source_gen(const char*);
 int file_check_mem(struct magic_set*, unsigned int);
 int file_looks_utf8(const unsigned char*, size_t,
                     unichar*, size_t*);
@@ -351,6 +466,7 @@ int file_reset(struct magic_set*);
 int file_fsmagic(struct magic_set*, const char*, struct stat*);
 int file_buffer(struct magic_set*, int, const char*, const void*, size_t);
 int file_printf(struct magic_set*, const char*, ...);
+int file_window_want(struct magic_set*, const unsigned char*, size_t, size_t);
 int file_is_tar(struct magic_set*, const unsigned char*, size_t);
 
 void file_error(struct magic_set*, int, const char*, ...);
@@ -372,11 +488,14 @@ ssize_t sread(int, void*, size_t, int __attribute__((__unused__)));
 
 const char* file_getbuffer(struct magic_set* ms);
 int file_encoding(struct magic_set* ms, const unsigned char* buf, 
-                  size_t nbytes, unichar** ubuf, size_t* ulen, 
+                  size_t nbytes, unichar* ubuf, size_t* ulen, 
                   const char** code, const char** code_mime,
-                  const char** type);
+                  const char** type, struct text_stats* ts);
 int file_softmagic(struct magic_set* ms, const unsigned char* buf,
                     size_t nbytes, int mode, int text);
+int file_softmagic_any(const struct magic_set* ms, int mode);
+void* file_scratch_get(struct magic_set* ms, int which, size_t* len);
+void file_scratch_put(struct magic_set* ms, int which, void* p, size_t len);
 
 
 int cdf_timestamp_to_timespec(struct timespec*, cdf_timestamp_t);
@@ -395,12 +514,36 @@ int file_tryelf(struct magic_set* ms, int fd, const unsigned char* buf,
                 size_t nbytes);
 
 size_t file_printedlen(const struct magic_set* ms);
+void file_truncate(struct magic_set* ms, size_t len);
 int file_replace(struct magic_set* ms, const char* pat, const char* rep);
 int file_ascmagic_with_encoding(struct magic_set* ms, const unsigned char* buf,
                             size_t nbytes, unichar* ubuf, size_t ulen, 
-                            const char* code, const char* type, int text);
+                            const char* code, const char* type,
+                            const struct text_stats* ts, int text);
 
 int file_pipe2file(struct magic_set*, int, const void*, size_t);
+
+/* a slot of the result cache of file(1), see cache.c */
+struct cache_slot
+{
+    uint64_t sum;                       /* of the rest; 0 if empty */
+    uint64_t gen;                       /* of the magic it was made with */
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;                      /* ns */
+    int64_t ctime;                      /* ns */
+    int64_t stored;                     /* when it was put here, ns */
+    uint64_t fp;                        /* first block, if racy */
+    char res[184];                      /* NUL terminated */
+};
+
+struct file_cache* file_cache_open(const char*, int);
+void file_cache_close(struct file_cache*);
+int file_cache_get(struct file_cache*, const char*, int, struct cache_slot*,
+                   char*, size_t);
+void file_cache_put(struct file_cache*, const char*, struct cache_slot*,
+                    const char*);
 int file_magicfind(struct magic_set*, const char*, struct mlist*);
 
 void file_badseek(struct magic_set* ms);
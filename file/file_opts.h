@@ -38,6 +38,8 @@ OPT('i', "mime", 0, "                   output MIME type strings (--mime-type an
 OPT_LONGONLY("apple", 0, "                  output the Apple CREATOR/TYPE\n")
 OPT_LONGONLY("mime-type", 0, "              output the MIME type\n")
 OPT_LONGONLY("mime-encoding", 0, "          output the MIME encoding\n")
+OPT_LONGONLY("profile", 2, "[=N]           on exit, print the N magic entries that\n"
+    "                                 took the most time (default 20, 0 for all)\n")
 OPT('k', "keep-going", 0, "             don't stop at the first match\n")
 #ifdef S_IFLNK
 OPT('l', "list", 0, "                   list magic strength\n")
@@ -55,3 +57,7 @@ OPT('s', "special-files", 0, "          treat special (block/char devices) files
     "                                 ordinary ones\n")
 OPT('C', "compile", 0, "                compile file specified by -m\n")
 OPT('d', "debug", 0, "                  print debugging messages\n")
+OPT('P', "jobs", 1, " N                 classify with N threads, looking inside\n"
+    "                                 directories; names are not padded\n")
+OPT('K', "cache", 0, "                  reuse results for files unchanged since\n"
+    "                                 they were last looked at\n")
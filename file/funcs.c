@@ -13,28 +13,63 @@
 #include <wctype.h>
 
 
-/* like printf, only we append to a buffer */
+#define OBUF_MIN    256     /* first allocation for ms->o.buf */
+
+
+/* make room for len more bytes and a NUL at the end of ms->o.buf,
+   at least doubling it so that a run of appends stays linear */
+static int
+obuf_grow(struct magic_set* ms, size_t len)
+{
+    size_t size = ms->o.bsize;
+    char* buf;
+
+    if(len >= SIZE_MAX - ms->o.blen)
+    {
+        errno = ENOMEM;
+        return -1;
+    }
+    if(size < OBUF_MIN)
+        size = OBUF_MIN;
+    while(size <= ms->o.blen + len)
+        size = size > SIZE_MAX / 2 ? ms->o.blen + len + 1 : size * 2;
+    if((buf = CAST(char*, realloc(ms->o.buf, size))) == NULL)
+        return -1;
+    ms->o.buf = buf;
+    ms->o.bsize = size;
+    return 0;
+}
+
+
+/* like printf, only we append to a buffer; the buffer is kept from
+   one file to the next, and formatted into in place */
 int file_vprintf(struct magic_set* ms, const char* fmt, va_list ap)
 {
     int len;
-    char *buf, *newstr;
+    size_t room;
+    va_list aq;
 
-    len = vasprintf(&buf, fmt, ap);
+    room = ms->o.bsize - ms->o.blen;
+    va_copy(aq, ap);
+    len = vsnprintf(room ? ms->o.buf + ms->o.blen : NULL, room, fmt, aq);
+    va_end(aq);
     if(len < 0)
         goto out;
 
-    if(ms->o.buf != NULL)
+    if((size_t)len >= room)
     {
-        len = asprintf(&newstr, "%s%s", ms->o.buf, buf);
-        free(buf);
+        if(obuf_grow(ms, (size_t)len) == -1)
+            goto out;
+        len = vsnprintf(ms->o.buf + ms->o.blen, ms->o.bsize - ms->o.blen,
+                        fmt, ap);
         if(len < 0)
             goto out;
-        free(ms->o.buf);
-        buf = newstr;
     }
-    ms->o.buf = buf;
+    ms->o.blen += (size_t)len;
     return 0;
 out:
+    if(ms->o.buf != NULL)
+        ms->o.buf[ms->o.blen] = '\0';
     file_error(ms, errno, "vasprintf failed");
     return -1;
 }
@@ -62,8 +97,7 @@ file_error_core(struct magic_set* ms, int error, const char* f, va_list va,
         return;
     if(lineno != 0)
     {
-        free(ms->o.buf);
-        ms->o.buf = NULL;
+        file_truncate(ms, 0);
         file_printf(ms, "line %" SIZE_T_FORMAT "u: ", lineno);
     }
     file_vprintf(ms, f, va);
@@ -130,21 +164,79 @@ int file_reset(struct magic_set* ms)
         return -1;
     }
 
-    if(ms->o.buf)
+    /* keep the buffers for the next file */
+    file_truncate(ms, 0);
+
+    ms->event_flags &= ~EVENT_HAD_ERR;
+    ms->error = -1;
+    return 0;
+}
+
+
+/* A test on buf[0 .. nbytes) wants buf[0 .. end). If buf is the
+   window and the file goes on past it, note that the rest has to be
+   read, and return 1 */
+int file_window_want(struct magic_set* ms, const unsigned char* buf,
+                     size_t nbytes, size_t end)
+{
+    if(!ms->w.more || end <= nbytes || buf + nbytes != ms->w.buf + ms->w.len)
+        return 0;
+
+    ms->w.want = 1;
+    return 1;
+}
+
+
+/* Borrow at least *len bytes of the working space kept in ms for
+   which, and learn in *len how much there is, to hand back with
+   file_scratch_put() when done with. It grows by at least half again
+   at a time, so that files of ever so slightly larger sizes don't
+   each pay for a new one; once it is big enough, this costs
+   nothing. A file_buffer() nested in another, on decompressed data,
+   finds it lent out and gets space of its own */
+void* file_scratch_get(struct magic_set* ms, int which, size_t* len)
+{
+    struct scratch* sc = &ms->sc[which];
+    void* p;
+
+    if(sc->p != NULL && sc->len >= *len)
     {
-        free(ms->o.buf);
-        ms->o.buf = NULL;
+        p = sc->p;
+        *len = sc->len;
+        sc->p = NULL;
+        return p;
     }
 
-    if(ms->o.pbuf)
+    /* what it held is of no use: don't have realloc() copy it */
+    if(sc->p != NULL && *len < sc->len + sc->len / 2)
+        *len = sc->len + sc->len / 2;
+    free(sc->p);
+    sc->p = NULL;
+    sc->len = 0;
+    if((p = malloc(*len)) == NULL)
     {
-        free(ms->o.pbuf);
-        ms->o.pbuf = NULL;
+        file_oomem(ms, *len);
+        return NULL;
     }
+    return p;
+}
 
-    ms->event_flags &= ~EVENT_HAD_ERR;
-    ms->error = -1;
-    return 0;
+
+/* Give back p, of len bytes, from file_scratch_get() */
+void file_scratch_put(struct magic_set* ms, int which, void* p, size_t len)
+{
+    struct scratch* sc = &ms->sc[which];
+
+    if(p == NULL)
+        return;
+    if(sc->p != NULL && sc->len >= len)
+    {
+        free(p);
+        return;
+    }
+    free(sc->p);
+    sc->p = p;
+    sc->len = len;
 }
 
 
@@ -154,11 +246,14 @@ int file_buffer(struct magic_set* ms, int fd, const char* inname __attribute__((
     int mime = ms->flags & MAGIC_MIME;
     const unsigned char* ubuf = CAST(const unsigned char*, buf);
     unichar* u8buf = NULL;
-    size_t ulen;
+    size_t ulen = 0, u8len = 0;
+    struct text_stats ts;
     const char* code = NULL;
     const char* code_mime = "binary";
     const char* type = NULL;
 
+    ms->code_mime = code_mime;
+
     if(nb == 0)
     {
         if((!mime || (mime & MAGIC_MIME_TYPE)) &&
@@ -181,8 +276,21 @@ int file_buffer(struct magic_set* ms, int fd, const char* inname __attribute__((
 
     if((ms->flags & MAGIC_NO_CHECK_ENCODING) == 0)
     {
-        looks_text = file_encoding(ms, ubuf, nb, &u8buf, &ulen,
-                        &code, &code_mime, &type);
+        u8len = (nb + 1) * sizeof(*u8buf);
+        if((u8buf = CAST(unichar*,
+                    file_scratch_get(ms, SCRATCH_TEXT, &u8len))) == NULL)
+            return -1;
+        looks_text = file_encoding(ms, ubuf, nb, u8buf, &ulen,
+                        &code, &code_mime, &type, &ts);
+    }
+
+    /* Binary data shows itself early, but whether something is text
+       depends on all of it: read the rest before going on */
+    if(((ms->flags & MAGIC_NO_CHECK_ENCODING) != 0 || looks_text) &&
+        file_window_want(ms, ubuf, nb, nb + 1))
+    {
+        file_scratch_put(ms, SCRATCH_TEXT, u8buf, u8len);
+        return 0;
     }
 
     /* try compression stuff */
@@ -239,7 +347,15 @@ int file_buffer(struct magic_set* ms, int fd, const char* inname __attribute__((
     /* try text properties */
     if((ms->flags & MAGIC_NO_CHECK_TEXT) == 0)
     {
-        if((m = file_ascmagic(ms, ubuf, nb, looks_text)) != 0)
+        /* what file_encoding() made of the data above is just what
+           file_ascmagic() would, unless it has NULs at the end to
+           trim first */
+        if(u8buf != NULL && ubuf[nb - 1] != '\0')
+            m = looks_text ? file_ascmagic_with_encoding(ms, ubuf, nb,
+                                u8buf, ulen, code, type, &ts, looks_text) : 0;
+        else
+            m = file_ascmagic(ms, ubuf, nb, looks_text);
+        if(m != 0)
         {
             if((ms->flags & MAGIC_DEBUG) != 0)
                 (void)fprintf(stderr, "ascmagic %d\n", m);
@@ -252,7 +368,8 @@ int file_buffer(struct magic_set* ms, int fd, const char* inname __attribute__((
             if(looks_text == 0)
             {
                 if((m = file_ascmagic_with_encoding(ms, ubuf,
-                            nb, u8buf, ulen, code, type, looks_text)) != 0)
+                            nb, u8buf, ulen, code, type, &ts,
+                            looks_text)) != 0)
                 {
                     if((ms->flags & MAGIC_DEBUG) != 0)
                         (void)fprintf(stderr, "ascmagic/enc %d\n", m);
@@ -271,6 +388,7 @@ int file_buffer(struct magic_set* ms, int fd, const char* inname __attribute__((
     }
 
 done:
+    ms->code_mime = code_mime;
     if((ms->flags & MAGIC_MIME_ENCODING) != 0)
     {
         if(ms->flags & MAGIC_MIME_TYPE)
@@ -279,7 +397,7 @@ done:
         if(file_printf(ms, "%s", code_mime) == -1)
             rv = -1;
     }
-    free(u8buf);
+    file_scratch_put(ms, SCRATCH_TEXT, u8buf, u8len);
     if(rv)
         return rv;
 
@@ -290,7 +408,17 @@ done:
 
 size_t file_printedlen(const struct magic_set* ms)
 {
-    return ms->o.buf == NULL ? 0 : strlen(ms->o.buf);
+    return ms->o.blen;
+}
+
+
+/* drop what was printed after the first len bytes */
+void file_truncate(struct magic_set* ms, size_t len)
+{
+    if(len >= ms->o.blen)
+        return;
+    ms->o.blen = len;
+    ms->o.buf[len] = '\0';
 }
 
 
@@ -310,12 +438,25 @@ int file_replace(struct magic_set* ms, const char* pat, const char* rep)
     {
         regmatch_t rm;
         int nm = 0;
-        while(regexec(&rx, ms->o.buf, 1, &rm, 0) == 0)
+        char* tail;
+        while(ms->o.blen != 0 && regexec(&rx, ms->o.buf, 1, &rm, 0) == 0)
         {
-            ms->o.buf[rm.rm_so] = '\0';
-            if(file_printf(ms, "%s%s", rep,
-                            rm.rm_eo != 0 ? ms->o.buf + rm.rm_eo : "") == -1)
+            /* the rest is printed back into the same buffer */
+            if((tail = strdup(rm.rm_eo != 0 ? ms->o.buf + rm.rm_eo : "")) ==
+                NULL)
+            {
+                file_oomem(ms, ms->o.blen);
+                regfree(&rx);
+                return -1;
+            }
+            file_truncate(ms, (size_t)rm.rm_so);
+            rc = file_printf(ms, "%s%s", rep, tail);
+            free(tail);
+            if(rc == -1)
+            {
+                regfree(&rx);
                 return -1;
+            }
             nm++;
         }
         regfree(&rx);
@@ -342,26 +483,30 @@ file_getbuffer(struct magic_set* ms)
     if(ms->event_flags & EVENT_HAD_ERR)
         return NULL;
 
+    if(ms->o.blen == 0)
+        return NULL;
+
     if(ms->flags & MAGIC_RAW)
         return ms->o.buf;
 
-    if(ms->o.buf == NULL)
-        return NULL;
-
     /* * 4 is for octal representation, + 1 is for NUL */
-    len = strlen(ms->o.buf);
+    len = ms->o.blen;
     if(len > (SIZE_MAX - 1) / 4)
     {
         file_oomem(ms, len);
         return NULL;
     }
     psize = len * 4 + 1;
-    if((pbuf = CAST(char*, realloc(ms->o.buf, psize))) == NULL)
+    if(psize > ms->o.psize)
     {
-        file_oomem(ms, psize);
-        return NULL;
+        if((pbuf = CAST(char*, realloc(ms->o.pbuf, psize))) == NULL)
+        {
+            file_oomem(ms, psize);
+            return NULL;
+        }
+        ms->o.pbuf = pbuf;
+        ms->o.psize = psize;
     }
-    ms->o.buf = pbuf;
 
     {
         mbstate_t state;
@@ -82,6 +82,15 @@ int magic_list(struct magic_set* ms, const char* magicfile)
     return file_apprentice(ms, magicfile, FILE_LIST);
 }
 
+/* With MAGIC_PROFILE: print to f the n magic entries (all if 0) that
+   took the most time so far */
+int magic_profile(struct magic_set* ms, FILE* f, size_t n)
+{
+    if(ms == NULL)
+        return -1;
+    return file_apprentice_profile(ms, f, n);
+}
+
 const char*
 magic_error(struct magic_set* ms)
 {
@@ -109,6 +118,25 @@ magic_open(int flags)
     return file_ms_alloc(flags);
 }
 
+/* a new magic_set with the flags and loaded magic of ms, for another
+   thread to use; ms must not be closed before the copy */
+struct magic_set*
+magic_dup(struct magic_set* ms)
+{
+    struct magic_set* dup;
+
+    if(ms == NULL)
+        return NULL;
+    if((dup = file_ms_alloc(ms->flags)) == NULL)
+        return NULL;
+    if(file_apprentice_share(dup, ms) == -1)
+    {
+        file_ms_free(dup);
+        return NULL;
+    }
+    return dup;
+}
+
 void magic_close(struct magic_set* ms)
 {
     if(ms == NULL)
@@ -169,13 +197,19 @@ file_or_fd(struct magic_set* ms, const char* inname, int fd)
     unsigned char* buf;
     struct stat sb;
     ssize_t nbytes = 0;     /* number of bytes read from a datafile */
+    ssize_t r;
+    size_t olen;
     int ispipe = 0;
 
     /* one extra for terminating '\0' and
        some overlapping space for matches near EOF */
 #define SLOP (1 + sizeof(union VALUETYPE))
-    if((buf = CAST(unsigned char*, malloc(HOWMANY + SLOP))) == NULL)
+    if(ms->w.buf == NULL &&
+        (ms->w.buf = CAST(unsigned char*, malloc(HOWMANY + SLOP))) == NULL)
         return NULL;
+    buf = ms->w.buf;
+    ms->w.len = 0;
+    ms->w.more = ms->w.want = 0;
 
     if(file_reset(ms) == -1)
         goto done;
@@ -228,8 +262,6 @@ file_or_fd(struct magic_set* ms, const char* inname, int fd)
     /* try looking at the first HOWMANY bytes */
     if(ispipe)
     {
-        ssize_t r = 0;
-
         while((r = sread(fd, (void*)&buf[nbytes],
                 (size_t)(HOWMANY - nbytes), 1)) > 0)
         {
@@ -247,19 +279,52 @@ file_or_fd(struct magic_set* ms, const char* inname, int fd)
         }
     } else
     {
-        if((nbytes = read(fd, (char*)buf, HOWMANY)) == -1)
+        /* A named file is read from its start, so the rest of it can
+           be fetched with pread if it turns out to be needed. Where
+           we were given a descriptor, read it all now */
+        if((nbytes = read(fd, (char*)buf,
+                inname == NULL ? HOWMANY : WINDOW)) == -1)
         {
             file_error(ms, errno, "cannot read `%s'", inname);
             goto done;
         }
+        ms->w.more = inname != NULL && nbytes == WINDOW;
     }
 
+    ms->w.len = (size_t)nbytes;
     (void)memset(buf + nbytes, 0, SLOP);    /* NULL terminated */
+    olen = file_printedlen(ms);
     if(file_buffer(ms, fd, inname, buf, (size_t)nbytes) == -1)
         goto done;
+
+    if(ms->w.want)
+    {
+        /* a test looked past the window: read the rest and start over */
+        while(nbytes < HOWMANY && (r = pread(fd, buf + nbytes,
+                (size_t)(HOWMANY - nbytes), (off_t)nbytes)) != 0)
+        {
+            if(r == -1)
+            {
+                if(errno == EINTR)
+                    continue;
+                file_error(ms, errno, "cannot read `%s'", inname);
+                goto done;
+            }
+            nbytes += r;
+        }
+
+        ms->w.len = (size_t)nbytes;
+        ms->w.more = ms->w.want = 0;
+        (void)memset(buf + nbytes, 0, SLOP);
+
+        /* keep what file_fsmagic() said, drop the rest */
+        file_truncate(ms, olen);
+        if(file_buffer(ms, fd, inname, buf, (size_t)nbytes) == -1)
+            goto done;
+    }
     rv = 0;
 done:
-    free(buf);
+    ms->w.more = 0;
     close_and_restore(ms, inname, fd, &sb);
     return rv == 0 ? file_getbuffer(ms) : NULL;
 }
@@ -276,6 +341,220 @@ magic_file(struct magic_set* ms, const char* inname)
 }
 
 
+/* the id of s in the string table of ms, adding it if it is new;
+   -1 if out of memory */
+static int
+strtab_id(struct magic_set* ms, const char* s)
+{
+    struct strtab* st = &ms->st;
+    uint32_t h = 0, i, id;
+    const char* p;
+
+    for(p = s; *p; p++)
+        h = h * 31 + (unsigned char)*p;
+
+    if(st->nslot != 0)
+    {
+        for(i = h & (st->nslot - 1); st->slot[i] != 0;
+            i = (i + 1) & (st->nslot - 1))
+        {
+            if(strcmp(st->str[st->slot[i] - 1], s) == 0)
+                return (int)(st->slot[i] - 1);
+        }
+    }
+
+    if(st->nstr == st->maxstr)
+    {
+        uint32_t max = st->maxstr ? st->maxstr * 2 : 64;
+        char** str = CAST(char**, realloc(st->str, max * sizeof(*str)));
+
+        if(str == NULL)
+        {
+            file_oomem(ms, max * sizeof(*str));
+            return -1;
+        }
+        st->str = str;
+        st->maxstr = max;
+    }
+
+    /* keep the slots at most half full */
+    if(2 * (st->nstr + 1) > st->nslot)
+    {
+        uint32_t n = st->nslot ? st->nslot * 2 : 128;
+        uint32_t* slot = CAST(uint32_t*, calloc(n, sizeof(*slot)));
+
+        if(slot == NULL)
+        {
+            file_oomem(ms, n * sizeof(*slot));
+            return -1;
+        }
+        for(id = 0; id < st->nstr; id++)
+        {
+            uint32_t g = 0;
+
+            for(p = st->str[id]; *p; p++)
+                g = g * 31 + (unsigned char)*p;
+            for(i = g & (n - 1); slot[i] != 0; i = (i + 1) & (n - 1))
+                continue;
+            slot[i] = id + 1;
+        }
+        free(st->slot);
+        st->slot = slot;
+        st->nslot = n;
+    }
+
+    if((st->str[st->nstr] = strdup(s)) == NULL)
+    {
+        file_oomem(ms, strlen(s) + 1);
+        return -1;
+    }
+    for(i = h & (st->nslot - 1); st->slot[i] != 0; i = (i + 1) & (st->nslot - 1))
+        continue;
+    st->slot[i] = ++st->nstr;
+    return (int)(st->nstr - 1);
+}
+
+
+/* the id of what file_buffer() printed, as magic_file() would return
+   it; -1 if out of memory */
+static int
+batch_string(struct magic_set* ms)
+{
+    const char* s = file_getbuffer(ms);
+
+    return strtab_id(ms, s ? s : "");
+}
+
+
+/* look at one buffer of a batch, once for the description and once
+   more for the MIME type if that was asked for */
+static int
+batch_one(struct magic_set* ms, int fd, const void* buf, size_t nb,
+          struct magic_result* res)
+{
+    int flags = ms->flags;
+    int rv = -1;
+
+    res->desc = res->mime = res->encoding = -1;
+
+    ms->flags = flags & ~MAGIC_MIME;
+    if(file_reset(ms) == -1)
+        goto done;
+    (void)file_buffer(ms, fd, NULL, buf, nb);
+    if((ms->event_flags & EVENT_HAD_ERR) != 0 ||
+        (res->desc = batch_string(ms)) == -1)
+        goto done;
+
+    if((flags & MAGIC_MIME_ENCODING) != 0 &&
+        (res->encoding = strtab_id(ms, ms->code_mime)) == -1)
+        goto done;
+
+    if((flags & MAGIC_MIME_TYPE) != 0)
+    {
+        ms->flags = (flags & ~MAGIC_MIME) | MAGIC_MIME_TYPE;
+        if(file_reset(ms) == -1)
+            goto done;
+        (void)file_buffer(ms, fd, NULL, buf, nb);
+        if((ms->event_flags & EVENT_HAD_ERR) != 0 ||
+            (res->mime = batch_string(ms)) == -1)
+            goto done;
+    }
+    rv = 0;
+done:
+    ms->flags = flags;
+    return rv;
+}
+
+
+/* Classify n buffers, filling in res[0 .. n). Returns how many of
+   them failed, or -1 if the arguments are bad; magic_error() tells
+   about the last item only */
+int
+magic_buffers(struct magic_set* ms, const void* const* bufs,
+              const size_t* lens, size_t n, struct magic_result* res)
+{
+    size_t i;
+    int bad = 0;
+
+    if(ms == NULL || (n != 0 && (bufs == NULL || lens == NULL || res == NULL)))
+        return -1;
+
+    for(i = 0; i < n; i++)
+        if(batch_one(ms, -1, bufs[i], lens[i], &res[i]) == -1)
+            bad++;
+    return bad;
+}
+
+
+/* Like magic_buffers(), for the first HOWMANY bytes of each of n
+   open descriptors, read from where they are. Nothing is known of
+   their names, so file_fsmagic() has no say */
+int
+magic_descriptors(struct magic_set* ms, const int* fds, size_t n,
+                  struct magic_result* res)
+{
+    size_t i;
+    ssize_t nbytes;
+    int bad = 0;
+
+    if(ms == NULL || (n != 0 && (fds == NULL || res == NULL)))
+        return -1;
+
+    if(ms->w.buf == NULL &&
+        (ms->w.buf = CAST(unsigned char*, malloc(HOWMANY + SLOP))) == NULL)
+        return -1;
+
+    for(i = 0; i < n; i++)
+    {
+        if((nbytes = sread(fds[i], ms->w.buf, HOWMANY, 1)) == -1)
+        {
+            res[i].desc = res[i].mime = res[i].encoding = -1;
+            file_error(ms, errno, "cannot read descriptor %d", fds[i]);
+            bad++;
+            continue;
+        }
+
+        ms->w.len = (size_t)nbytes;
+        (void)memset(ms->w.buf + nbytes, 0, SLOP);
+        if(batch_one(ms, fds[i], ms->w.buf, (size_t)nbytes, &res[i]) == -1)
+            bad++;
+    }
+    return bad;
+}
+
+
+/* the string behind an id from magic_buffers() or magic_descriptors() */
+const char*
+magic_string(const struct magic_set* ms, int id)
+{
+    if(ms == NULL || id < 0 || (uint32_t)id >= ms->st.nstr)
+        return NULL;
+    return ms->st.str[id];
+}
+
+
+/* drop the strings kept by magic_buffers() and magic_descriptors();
+   the ids they gave out are no longer valid and will be handed out
+   again for other strings. The table grows with every new string
+   until this is called, so a caller classifying an open-ended stream
+   of items should call it after each batch it is done with */
+void
+magic_strings_reset(struct magic_set* ms)
+{
+    struct strtab* st;
+    uint32_t i;
+
+    if(ms == NULL)
+        return;
+    st = &ms->st;
+    for(i = 0; i < st->nstr; i++)
+        free(st->str[i]);
+    st->nstr = 0;
+    if(st->slot != NULL)
+        (void)memset(st->slot, 0, st->nslot * sizeof(*st->slot));
+}
+
+
 /* load a magic file */
 int magic_load(struct magic_set* ms, const char* magicfile)
 {
@@ -27,6 +27,7 @@
 #define MAGIC_NO_CHECK_CDF          0x040000    /* don't check for cdf files */
 #define MAGIC_NO_CHECK_TOKENS       0x100000    /* don't check tokens */
 #define MAGIC_NO_CHECK_ENCODING     0x200000    /* don't check text encodings */
+#define MAGIC_PROFILE               0x400000    /* count and time each magic entry */
 
 /* No built-in tests; only consult the magic file */
 #define MAGIC_NO_CHECK_BUILTIN  (   \
@@ -61,8 +62,27 @@ int magic_load(struct magic_set*, const char*);
 int file_apprentice(struct magic_set*, const char*, int);
 
 struct magic_set* magic_open(int);
+struct magic_set* magic_dup(struct magic_set*);
 
 const char* magic_file(struct magic_set*, const char*);
+
+/* What magic_buffers() and magic_descriptors() give for each item:
+   ids of strings kept in the magic_set, see magic_string(). They stay
+   valid until magic_strings_reset() or magic_close() */
+struct magic_result
+{
+    int desc;               /* description, -1 if it failed */
+    int mime;               /* MIME type, if MAGIC_MIME_TYPE, else -1 */
+    int encoding;           /* MIME encoding, if MAGIC_MIME_ENCODING, else -1 */
+};
+
+int magic_buffers(struct magic_set*, const void* const*, const size_t*,
+                  size_t, struct magic_result*);
+int magic_descriptors(struct magic_set*, const int*, size_t,
+                      struct magic_result*);
+const char* magic_string(const struct magic_set*, int);
+void magic_strings_reset(struct magic_set*);
+int magic_profile(struct magic_set*, FILE*, size_t);
 const char* magic_error(struct magic_set*);
 const char* magic_getpath(const char*, int);
 
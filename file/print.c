@@ -2,6 +2,7 @@
 
 #include "file_.h"
 
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
@@ -16,6 +17,8 @@ void file_magwarn(struct magic_set* ms, const char* f, ...)
     /* because we use stdout for most, stderr here */
     (void)fflush(stdout);
 
+    /* magic directories are parsed by several threads at once */
+    flockfile(stderr);
     if(ms->file)
         (void)fprintf(stderr, "%s, %lu: ", ms->file,
                 (unsigned long)ms->line);
@@ -24,6 +27,20 @@ void file_magwarn(struct magic_set* ms, const char* f, ...)
     (void)vfprintf(stderr, f, va);
     va_end(va);
     (void)fputc('\n', stderr);
+    funlockfile(stderr);
+}
+
+
+static pthread_once_t dst_once = PTHREAD_ONCE_INIT;
+static int dst;    /* DST in effect at the first call, -1 if unknown */
+
+static void dst_init(void)
+{
+    time_t now;
+    struct tm tm1;
+
+    (void)time(&now);
+    dst = localtime_r(&now, &tm1) == NULL ? -1 : tm1.tm_isdst > 0;
 }
 
 
@@ -32,7 +49,7 @@ file_fmttime(uint64_t v, int flags, char* buf)
 {
     char* pp;
     time_t t = (time_t)v;
-    struct tm* tm;
+    struct tm tm;
 
     if(flags & FILE_T_WINDOWS)
     {
@@ -46,25 +63,15 @@ file_fmttime(uint64_t v, int flags, char* buf)
         pp = ctime_r(&t, buf);
     } else
     {
-        static int daylight = 0;
-        static time_t now = (time_t)0;
-
-        if(now == (time_t)0)
-        {
-            struct tm* tm1;
-            (void)time(&now);
-            tm1 = localtime(&now);
-            if(tm1 == NULL)
-                goto out;
-            daylight = tm1->tm_isdst;
-        }
-
-        if(daylight)
+        /* the _r forms, as file -P calls this from several threads */
+        (void)pthread_once(&dst_once, dst_init);
+        if(dst < 0)
+            goto out;
+        if(dst)
             t += 3600;
-        tm = gmtime(&t);
-        if(tm == NULL)
+        if(gmtime_r(&t, &tm) == NULL)
             goto out;
-        pp = asctime_r(tm ,buf);
+        pp = asctime_r(&tm ,buf);
     }
 
     if(pp == NULL)
@@ -201,11 +201,14 @@ int file_trycdf(struct magic_set *ms, int fd, const unsigned char *buf,
     info.i_fd = fd;
     info.i_buf = buf;
     info.i_len = nbytes;
+    info.i_map = NULL;
+    info.i_maplen = 0;
     if(ms->flags & MAGIC_APPLE)
         return 0;
     if(cdf_read_header(&info, &h) == -1)
         return 0;
     cdf_dump_header(&h);
+    cdf_map(&info);
 
     if((i = cdf_read_sat(&info, &h, &sat)) == -1) 
     {
@@ -277,7 +280,10 @@ int file_trycdf(struct magic_set *ms, int fd, const unsigned char *buf,
             }
         }
         if(file_printf(ms, "application/%s", str) == -1)
+        {
+            cdf_unmap(&info);
             return -1;
+        }
         i = 1;
     }
     free(scn.sst_tab);
@@ -290,6 +296,7 @@ out2:
 out1:
     free(sat.sat_tab);
 out0:
+    cdf_unmap(&info);
     if (i != 1) 
     {
         if (i == -1) 
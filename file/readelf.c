@@ -3,6 +3,8 @@
 #include "magic_.h"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
@@ -91,6 +93,38 @@ getu64(int swap, uint64_t value)
 #define elf_getu64(swap, value) getu64(swap, value)
 
 
+/* The file being looked at: mapped whole when it could be, so that
+   walking its headers and notes costs no system calls, else read
+   from fd as needed */
+struct elf_file
+{
+    int fd;
+    const unsigned char* map;
+    size_t maplen;
+};
+
+
+/* pread() from ef, out of the mapping if there is one */
+static ssize_t
+elf_pread(const struct elf_file* ef, void* buf, size_t len, off_t off)
+{
+    if(ef->map == NULL)
+        return pread(ef->fd, buf, len, off);
+
+    if(off < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    if((uint64_t)off >= ef->maplen)
+        return 0;
+    if(len > ef->maplen - (size_t)off)
+        len = ef->maplen - (size_t)off;
+    (void)memcpy(buf, ef->map + off, len);
+    return (ssize_t)len;
+}
+
+
 #define xph_addr    (clazz == ELFCLASS32 ? (void*) &ph32 : (void*) &ph64)
 #define xph_sizeof  (clazz == ELFCLASS32 ? sizeof(ph32) : sizeof(ph64))
 #define xph_type    (clazz == ELFCLASS32        \
@@ -666,7 +700,8 @@ core:
 
 
 static int
-dophn_core(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
+dophn_core(struct magic_set* ms, int clazz, int swap,
+            const struct elf_file* ef, off_t off,
             int num, size_t size, off_t fsize, int* flags)
 {
     Elf32_Phdr  ph32;
@@ -685,7 +720,7 @@ dophn_core(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
     /* Loop through all the program headers */
     for(; num; num--)
     {
-        if(pread(fd, xph_addr, xph_sizeof, off) == -1)
+        if(elf_pread(ef, xph_addr, xph_sizeof, off) == -1)
         {
             file_badread(ms);
             return -1;
@@ -704,7 +739,7 @@ dophn_core(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
         /* This is a PT_NOTE section; loop through all the notes
            in the section */
         len = xph_filesz < sizeof(nbuf) ? xph_filesz : sizeof(nbuf);
-        if((bufsize = pread(fd, nbuf, len, xph_offset)) == -1)
+        if((bufsize = elf_pread(ef, nbuf, len, xph_offset)) == -1)
         {
             file_badread(ms);
             return -1;
@@ -728,7 +763,8 @@ dophn_core(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
    for a PT_INTERP section; if one is found, it's dynamically linked,
    otherwise it's statically linked */
 static int
-dophn_exec(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
+dophn_exec(struct magic_set* ms, int clazz, int swap,
+           const struct elf_file* ef, off_t off,
            int num, size_t size, off_t fsize, int* flags, int sh_num)
 {
     Elf32_Phdr ph32;
@@ -748,7 +784,7 @@ dophn_exec(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
 
     for(; num; num--)
     {
-        if(pread(fd, xph_addr, xph_sizeof, off) == -1)
+        if(elf_pread(ef, xph_addr, xph_sizeof, off) == -1)
         {
             file_badread(ms);
             return -1;
@@ -791,7 +827,7 @@ dophn_exec(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
                    in the section. */
                 len = xph_filesz < sizeof(nbuf) ? xph_filesz
                         : sizeof(nbuf);
-                bufsize = pread(fd, nbuf, len, xph_offset);
+                bufsize = elf_pread(ef, nbuf, len, xph_offset);
                 if(bufsize == -1)
                 {
                     file_badread(ms);
@@ -876,7 +912,8 @@ static const cap_desc_t cap_desc_386[] =
 
 
 
-static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
+static int doshn(struct magic_set* ms, int clazz, int swap,
+                const struct elf_file* ef, off_t off,
                 int num, size_t size, off_t fsize, int* flags, int mach, int strtab)
 {
     Elf32_Shdr sh32;
@@ -896,7 +933,7 @@ static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
     }
 
     /* Read offset of name section to be able to read section names later */
-    if(pread(fd, xsh_addr, xsh_sizeof, off + size * strtab) == -1)
+    if(elf_pread(ef, xsh_addr, xsh_sizeof, off + size * strtab) == -1)
     {
         file_badread(ms);
         return -1;
@@ -906,7 +943,7 @@ static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
     for(; num; num--)
     {
         /* Read the name of this section */
-        if(pread(fd, name, sizeof(name), name_off + xsh_name) == -1)
+        if(elf_pread(ef, name, sizeof(name), name_off + xsh_name) == -1)
         {
             file_badread(ms);
             return -1;
@@ -915,7 +952,7 @@ static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
         if(strcmp(name, ".debug_info") == 0)
             stripped = 0;
 
-        if(pread(fd, xsh_addr, xsh_sizeof, off) == -1)
+        if(elf_pread(ef, xsh_addr, xsh_sizeof, off) == -1)
         {
             file_badread(ms);
             return -1;
@@ -944,7 +981,7 @@ static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
                                           " for note");
                     return -1;
                 }
-                if(pread(fd, nbuf, xsh_size, xsh_offset) == -1)
+                if(elf_pread(ef, nbuf, xsh_size, xsh_offset) == -1)
                 {
                     file_badread(ms);
                     free(nbuf);
@@ -976,11 +1013,6 @@ static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
                         goto skip;
                 }
 
-                if(lseek(fd, xsh_offset, SEEK_SET) == (off_t)-1)
-                {
-                    file_badseek(ms);
-                    return -1;
-                }
                 coff = 0;
                 for(;;)
                 {
@@ -989,7 +1021,9 @@ static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
                     char cbuf[MAX(sizeof cap32, sizeof cap64)];
                     if((coff += xcap_sizeof) > (off_t)xsh_size)
                         break;
-                    if(read(fd, cbuf, (size_t)xcap_sizeof) != (ssize_t)xcap_sizeof)
+                    if(elf_pread(ef, cbuf, (size_t)xcap_sizeof,
+                            (off_t)xsh_offset + coff - (off_t)xcap_sizeof) !=
+                        (ssize_t)xcap_sizeof)
                     {
                         file_badread(ms);
                         return -1;
@@ -1092,8 +1126,10 @@ static int doshn(struct magic_set* ms, int clazz, int swap, int fd, off_t off,
 
 
 
-int file_tryelf(struct magic_set* ms, int fd, const unsigned char* buf,
-                size_t nbytes)
+/* Describe the ELF file ef, whose first nbytes are in buf */
+static int
+doelf(struct magic_set* ms, const struct elf_file* ef,
+      const unsigned char* buf, size_t nbytes, off_t fsize)
 {
     union
     {
@@ -1102,13 +1138,44 @@ int file_tryelf(struct magic_set* ms, int fd, const unsigned char* buf,
     } u;
     int clazz;
     int swap;
-    struct stat st;
-    off_t fsize;
     int flags = 0;
     Elf32_Ehdr elf32hdr;
     Elf64_Ehdr elf64hdr;
     uint16_t type;
 
+    clazz = buf[EI_CLASS];
+
+    switch(clazz)
+    {
+        case ELFCLASS32:
+#undef elf_getu
+#define elf_getu(a, b) elf_getu32(a, b)
+#undef elfhdr
+#define elfhdr elf32hdr
+#include "elfclass.h"
+        case ELFCLASS64:
+#undef elf_getu
+#define elf_getu(a, b) elf_getu64(a, b)
+#undef elfhdr
+#define elfhdr elf64hdr
+#include "elfclass.h"
+        default:
+            if(file_printf(ms, ", unknown class %d", clazz) == -1)
+                return -1;
+            break;
+    }
+    return 0;
+}
+
+
+int file_tryelf(struct magic_set* ms, int fd, const unsigned char* buf,
+                size_t nbytes)
+{
+    struct stat st;
+    struct elf_file ef;
+    void* p;
+    int rv;
+
     if(ms->flags & (MAGIC_MIME | MAGIC_APPLE))
         return 0;
 
@@ -1132,28 +1199,22 @@ int file_tryelf(struct magic_set* ms, int fd, const unsigned char* buf,
         file_badread(ms);
         return -1;
     }
-    fsize = st.st_size;
-    clazz = buf[EI_CLASS];
 
-    switch(clazz)
+    ef.fd = fd;
+    ef.map = NULL;
+    ef.maplen = 0;
+    if(S_ISREG(st.st_mode) && st.st_size > 0 &&
+        (off_t)(size_t)st.st_size == st.st_size &&
+        (p = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd,
+                  (off_t)0)) != MAP_FAILED)
     {
-        case ELFCLASS32:
-#undef elf_getu
-#define elf_getu(a, b) elf_getu32(a, b)
-#undef elfhdr
-#define elfhdr elf32hdr
-#include "elfclass.h"
-        case ELFCLASS64:
-#undef elf_getu
-#define elf_getu(a, b) elf_getu64(a, b)
-#undef elfhdr
-#define elfhdr elf64hdr
-#include "elfclass.h"
-        default:
-            if(file_printf(ms, ", unknown class %d", clazz) == -1)
-                return -1;
-            break;
+        ef.map = CAST(const unsigned char*, p);
+        ef.maplen = (size_t)st.st_size;
     }
-    return 0;
-}
 
+    rv = doelf(ms, &ef, buf, nbytes, st.st_size);
+
+    if(ef.map != NULL)
+        (void)munmap(CAST(void*, ef.map), ef.maplen);
+    return rv;
+}
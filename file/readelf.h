@@ -3,7 +3,7 @@
 
 #include <stdint.h>
 
-typedef uint32_t Elf32_Char;
+typedef uint8_t  Elf32_Char;
 typedef uint16_t Elf32_Half;
 typedef uint32_t Elf32_Off;
 typedef uint32_t Elf32_Word;
@@ -15,7 +15,7 @@ typedef uint64_t Elf64_Addr;
 typedef uint64_t Elf64_Off;
 typedef uint64_t Elf64_Xword;
 typedef uint16_t Elf64_Half;
-typedef uint16_t Elf64_Word;
+typedef uint32_t Elf64_Word;
 typedef uint8_t  Elf64_Char;
 
 
@@ -14,7 +14,7 @@ static int mget(struct magic_set*, const unsigned char*,
                 struct magic*, size_t, size_t, unsigned int, int, int, int, int*);
 static int mcopy(struct magic_set*, union VALUETYPE*, int, int,
                 const unsigned char*, uint32_t, size_t, size_t);
-static int match(struct magic_set*, struct magic*, uint32_t,
+static int match(struct magic_set*, struct mlist*,
                 const unsigned char*, size_t, size_t, int, int, int, int*);
 
 static int
@@ -28,6 +28,8 @@ mcopy(struct magic_set* ms, union VALUETYPE* p, int type, int indir,
         switch(type)
         {
             case FILE_SEARCH:
+                (void)file_window_want(ms, s, nbytes,
+                        offset + linecnt + sizeof(p->s));
                 ms->search.s = RCAST(const char*, s) + offset;
                 ms->search.s_len = nbytes - offset;
                 ms->search.offset = offset;
@@ -59,7 +61,10 @@ mcopy(struct magic_set* ms, union VALUETYPE* p, int type, int indir,
                         b++;
                 }
                 if(lines)
+                {
                     last = RCAST(const char*, s) + nbytes;
+                    (void)file_window_want(ms, s, nbytes, nbytes + 1);
+                }
 
                 ms->search.s = buf;
                 ms->search.s_len = last - buf;
@@ -77,6 +82,8 @@ mcopy(struct magic_set* ms, union VALUETYPE* p, int type, int indir,
 
                 if(type == FILE_BESTRING16)
                     src++;
+                (void)file_window_want(ms, s, nbytes,
+                        offset + 2 * sizeof(p->s));
 
                 /* Check that offset is within range */
                 if(offset >= nbytes)
@@ -109,6 +116,8 @@ mcopy(struct magic_set* ms, union VALUETYPE* p, int type, int indir,
         }
     }
 
+    (void)file_window_want(ms, s, nbytes, offset + sizeof(*p));
+
     if(offset >= nbytes)
     {
         memset(p, '\0', sizeof(*p));
@@ -427,6 +436,7 @@ mget(struct magic_set* ms, const unsigned char* s, struct magic* m,
     uint32_t count = m->str_range;
     int rv;
     char *sbuf, *rbuf;
+    size_t olen;
     union VALUETYPE* p = &ms->ms_value;
     struct mlist ml;
 
@@ -970,25 +980,32 @@ mget(struct magic_set* ms, const unsigned char* s, struct magic* m,
         case FILE_INDIRECT:
             if(nbytes < offset)
                 return 0;
-            sbuf = ms->o.buf;
-            ms->o.buf = NULL;
+            /* the indirect result is printed after what we have so
+               far, then moved behind our own description */
+            olen = file_printedlen(ms);
             ms->offset = 0;
             rv = file_softmagic(ms, s + offset, nbytes - offset,
                             BINTEST, text);
             if((ms->flags & MAGIC_DEBUG) != 0)
                 fprintf(stderr, "indirect @offs=%u[%d]\n", offset, rv);
-            if(rv == 1)
+            if(rv == 1 && (ms->flags & (MAGIC_MIME | MAGIC_APPLE)) == 0)
             {
-                rbuf = ms->o.buf;
-                ms->o.buf = sbuf;
-                if((ms->flags & (MAGIC_MIME | MAGIC_APPLE)) == 0 &&
-                    file_printf(ms, m->desc, offset) == -1)
+                if((rbuf = strdup(file_printedlen(ms) > olen ?
+                                  ms->o.buf + olen : "")) == NULL)
+                {
+                    file_oomem(ms, file_printedlen(ms) - olen);
                     return -1;
-                if(file_printf(ms, "%s", rbuf) == -1)
+                }
+                file_truncate(ms, olen);
+                if(file_printf(ms, m->desc, offset) == -1 ||
+                    file_printf(ms, "%s", rbuf) == -1)
+                {
+                    free(rbuf);
                     return -1;
+                }
                 free(rbuf);
-            } else
-                ms->o.buf = sbuf;
+            } else if(rv != 1)
+                file_truncate(ms, olen);
             return rv;
 
         case FILE_USE:
@@ -1006,7 +1023,7 @@ mget(struct magic_set* ms, const unsigned char* s, struct magic* m,
                 file_error(ms, 0, "cannot find entry `%s'", sbuf);
                 return -1;
             }
-            return match(ms, ml.magic, ml.nmagic, s, nbytes, offset,
+            return match(ms, &ml, s, nbytes, offset,
                     mode, text, flip, returnval);
 
         case FILE_NAME:
@@ -1024,6 +1041,32 @@ mget(struct magic_set* ms, const unsigned char* s, struct magic* m,
 }
 
 
+/* Horspool: where the slen bytes of p first appear in s[0 .. n),
+   or -1 */
+static size_t
+search_scan(const unsigned char* s, size_t n, const unsigned char* p,
+            size_t slen, const unsigned char* skip)
+{
+    size_t i = 0, last = slen - 1;
+    const unsigned char* q;
+    unsigned char c;
+
+    if(slen == 1)
+    {
+        q = CAST(const unsigned char*, memchr(s, p[0], n));
+        return q == NULL ? (size_t)-1 : (size_t)(q - s);
+    }
+    while(i + slen <= n)
+    {
+        c = s[i + last];
+        if(c == p[last] && memcmp(s + i, p, last) == 0)
+            return i;
+        i += skip[c];
+    }
+    return (size_t)-1;
+}
+
+
 static uint64_t
 file_strncmp(const char* s1, const char* s2, size_t len, uint32_t flags)
 {
@@ -1101,28 +1144,22 @@ file_strncmp16(const char* a, const char* b, size_t len, uint32_t flags)
 }
 
 
+/* does the description have a "%[-0-9\.]*s" conversion? this used to
+   compile that regex for every printed entry, so scan for it directly */
 static int
-check_fmt(struct magic_set* ms, struct magic* m)
+check_fmt(struct magic_set* ms __attribute__((unused)), struct magic* m)
 {
-    regex_t rx;
-    int rc;
-
-    if(strchr(m->desc, '%') == NULL)
-        return 0;
+    const char *p, *q;
 
-    rc = regcomp(&rx, "%[-0-9\\.]*s", REG_EXTENDED | REG_NOSUB);
-    if(rc)
+    for(p = strchr(m->desc, '%'); p != NULL; p = strchr(p + 1, '%'))
     {
-        char errmsg[512];
-        regerror(rc, &rx, errmsg, sizeof(errmsg));
-        file_magerror(ms, "regex error %d, (%s)", rc, errmsg);
-        return -1;
-    } else
-    {
-        rc = regexec(&rx, m->desc, 0, 0, 0);
-        regfree(&rx);
-        return !rc;
+        for(q = p + 1; *q == '-' || *q == '.' || *q == '\\' ||
+            isdigit((unsigned char)*q); q++)
+            continue;
+        if(*q == 's')
+            return 1;
     }
+    return 0;
 }
 
 
@@ -1460,7 +1497,7 @@ mprint(struct magic_set* ms, struct magic* m)
 
 
 static int
-magiccheck(struct magic_set* ms, struct magic* m)
+magiccheck(struct magic_set* ms, struct magic* m, struct magic_aux* aux)
 {
     uint64_t l = m->value.q;
     uint64_t v;
@@ -1591,6 +1628,26 @@ magiccheck(struct magic_set* ms, struct magic* m)
             l = 0;
             v = 0;
 
+            if(aux != NULL && aux->skip != NULL)
+            {
+                /* a plain compare: skip along with the shifts worked
+                   out at load time */
+                size_t n = ms->search.s_len;
+
+                if(m->str_range != 0 && m->str_range - 1 + slen < n)
+                    n = m->str_range - 1 + slen;
+                if(slen > n)
+                    break;
+                if((idx = search_scan(
+                        RCAST(const unsigned char*, ms->search.s), n,
+                        RCAST(const unsigned char*, m->value.s), slen,
+                        aux->skip)) == (size_t)-1)
+                    v = 1;
+                else
+                    ms->search.offset += idx;
+                break;
+            }
+
             for(idx = 0; m->str_range == 0 || idx < m->str_range; idx++)
             {
                 if(slen + idx > ms->search.s_len)
@@ -1608,19 +1665,27 @@ magiccheck(struct magic_set* ms, struct magic* m)
         case FILE_REGEX:
         {
             int rc;
-            regex_t rx;
+            regex_t rxbuf, *rx;
             char errmsg[512];
 
             if(ms->search.s == NULL)
                 return 0;
 
             l = 0;
-            rc = regcomp(&rx, m->value.s,
-                        REG_EXTENDED | REG_NEWLINE |
-                        ((m->str_flags & STRING_IGNORE_CASE) ? REG_ICASE : 0));
+
+            /* use the copy compiled when the magic was loaded */
+            if(aux != NULL && aux->regex != NULL)
+            {
+                rx = &aux->regex->rx;
+                rc = aux->regex->rc;
+            } else
+            {
+                rx = &rxbuf;
+                rc = regcomp(rx, m->value.s, FILE_REGEX_CFLAGS(m));
+            }
             if(rc)
             {
-                regerror(rc, &rx, errmsg, sizeof(errmsg));
+                regerror(rc, rx, errmsg, sizeof(errmsg));
                 file_magerror(ms, "regex error %d, (%s)",
                                 rc, errmsg);
                 v = (uint64_t)-1;
@@ -1637,7 +1702,7 @@ magiccheck(struct magic_set* ms, struct magic* m)
                 pmatch[0].rm_so = 0;
                 pmatch[0].rm_eo = ms->search.s_len;
 #endif
-                rc = regexec(&rx, (const char*)ms->search.s, 1,
+                rc = regexec(rx, (const char*)ms->search.s, 1,
                             pmatch, REG_STARTEND);
 #if REG_STARTEND == 0
                 ((char*)(intptr_t)ms->search.s)[l] = c;
@@ -1648,20 +1713,21 @@ magiccheck(struct magic_set* ms, struct magic* m)
                         ms->search.s += (int)pmatch[0].rm_so;
                         ms->search.offset += (size_t)pmatch[0].rm_so;
                         ms->search.rm_len =
-                            (size_t)(pmatch[0].rm_so - pmatch[0].rm_so);
+                            (size_t)(pmatch[0].rm_eo - pmatch[0].rm_so);
                         v = 0;
                         break;
                     case REG_NOMATCH:
                         v = 1;
                         break;
                     default:
-                        regerror(rc, &rx, errmsg, sizeof(errmsg));
+                        regerror(rc, rx, errmsg, sizeof(errmsg));
                         file_magerror(ms, "regexec error %d, (%s)",
                                 rc, errmsg);
                         v = (uint64_t)-1;
                         break;
                 }
-                regfree(&rx);
+                if(rx == &rxbuf)
+                    regfree(rx);
             }
             if(v == (uint64_t)-1)
                 return -1;
@@ -1797,6 +1863,79 @@ print_sep(struct magic_set* ms, int firstline)
 
 
 
+/* top-level entries still to try: the bucket of the buffer's first
+   byte merged with the entries that can't be bucketed */
+struct magic_cursor
+{
+    const uint32_t *b, *be;
+    const uint32_t *a, *ae;
+};
+
+static uint32_t
+cursor_next(struct magic_cursor* c, const struct mlist* ml, uint32_t magindex)
+{
+    if(c->a == NULL)
+        return magindex + 1;
+    if(c->b == c->be && c->a == c->ae)
+        return ml->nmagic;
+    return c->b != c->be && (c->a == c->ae || *c->b < *c->a) ?
+        *c->b++ : *c->a++;
+}
+
+static uint32_t
+cursor_first(struct magic_cursor* c, const struct mlist* ml,
+        const unsigned char* s, size_t nbytes, size_t offset, int flip)
+{
+    unsigned char key;
+
+    /* FILE_USE subsets and flipped or offset matches walk everything */
+    if(ml->index == NULL || offset != 0 || flip)
+    {
+        c->b = c->be = c->a = c->ae = NULL;
+        return 0;
+    }
+
+    key = nbytes > 0 ? s[0] : 0;
+    c->b = ml->index->ent + ml->index->start[key];
+    c->be = ml->index->ent + ml->index->start[key + 1];
+    c->a = ml->index->any;
+    c->ae = ml->index->any + ml->index->nany;
+    return cursor_next(c, ml, 0);
+}
+
+
+/* With MAGIC_PROFILE, when an entry started being tried */
+static uint64_t
+prof_start(const struct magic_set* ms)
+{
+    struct timespec ts;
+
+    if((ms->flags & MAGIC_PROFILE) == 0)
+        return 0;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+
+/* ... and charge the time since to it */
+static void
+prof_stop(const struct magic_set* ms, struct magic_aux* aux, uint64_t t0,
+          int hit)
+{
+    struct timespec ts;
+    uint64_t t;
+
+    if((ms->flags & MAGIC_PROFILE) == 0 || aux == NULL)
+        return;
+    (void)clock_gettime(CLOCK_MONOTONIC, &ts);
+    t = (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+    (void)__atomic_fetch_add(&aux->prof.calls, 1, __ATOMIC_RELAXED);
+    if(hit)
+        (void)__atomic_fetch_add(&aux->prof.hits, 1, __ATOMIC_RELAXED);
+    (void)__atomic_fetch_add(&aux->prof.ns, t - t0, __ATOMIC_RELAXED);
+}
+
+
 /* Go through the whole list, stopping if you find a match. Process all
    the continuations of that match before returning.
 
@@ -1824,11 +1963,16 @@ print_sep(struct magic_set* ms, int firstline)
     so that higher-level continuations are processed. */
 
 static int
-match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
+match(struct magic_set* ms, struct mlist* ml,
         const unsigned char* s, size_t nbytes, size_t offset, int mode,
         int text, int flip, int* returnval)
 {
+    uint64_t t0;
+    int rv;
+    struct magic* magic = ml->magic;
+    uint32_t nmagic = ml->nmagic;
     uint32_t magindex = 0;
+    struct magic_cursor cursor;
     unsigned int cont_level = 0;
     int need_separator = 0;
     int returnvalv = 0, e;      /* if a match is found it is set to 1 */
@@ -1842,7 +1986,9 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
     if(file_check_mem(ms, cont_level) == -1)
         return -1;
 
-    for(magindex = 0; magindex < nmagic; magindex++)
+    for(magindex = cursor_first(&cursor, ml, s, nbytes, offset, flip);
+        magindex < nmagic;
+        magindex = cursor_next(&cursor, ml, magindex))
     {
         int flush = 0;
         struct magic* m = &magic[magindex];
@@ -1866,6 +2012,7 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
         ms->line = m->lineno;
 
         /* if main entry matches, print it ...*/
+        t0 = prof_start(ms);
         switch(mget(ms, s, m, nbytes, offset, cont_level, mode, text,
                 flip, returnval))
         {
@@ -1878,7 +2025,7 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
                 if(m->type == FILE_INDIRECT)
                     *returnval = 1;
 
-                switch(magiccheck(ms, m))
+                switch(magiccheck(ms, m, MAGIC_AUX(ml, magindex)))
                 {
                     case -1:
                         return -1;
@@ -1891,6 +2038,7 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
                 }
                 break;
         }
+        prof_stop(ms, MAGIC_AUX(ml, magindex), t0, !flush);
         if(flush)
         {
             /* main entry didn't match,
@@ -1955,6 +2103,7 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
                     continue;
             }
 #endif
+            t0 = prof_start(ms);
             switch(mget(ms, s, m, nbytes, offset, cont_level, mode,
                         text, flip, returnval))
             {
@@ -1962,7 +2111,10 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
                     return -1;
                 case 0:
                     if(m->reln != '!')
+                    {
+                        prof_stop(ms, MAGIC_AUX(ml, magindex), t0, 0);
                         continue;
+                    }
                     flush = 1;
                     break;
                 default:
@@ -1972,7 +2124,9 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
                     break;
             }
 
-            switch(flush ? 1 : magiccheck(ms, m))
+            rv = flush ? 1 : magiccheck(ms, m, MAGIC_AUX(ml, magindex));
+            prof_stop(ms, MAGIC_AUX(ml, magindex), t0, rv > 0);
+            switch(rv)
             {
                 case -1:
                     return -1;
@@ -2055,6 +2209,18 @@ match(struct magic_set* ms, struct magic* magic, uint32_t nmagic,
 
 
 
+/* Whether file_softmagic() in mode has any entries to try at all */
+int file_softmagic_any(const struct magic_set* ms, int mode)
+{
+    struct mlist* ml;
+
+    for(ml = ms->mlist[0]->next; ml != ms->mlist[0]; ml = ml->next)
+        if(mode != TEXTTEST || ml->ntext != 0)
+            return 1;
+    return 0;
+}
+
+
 /* softmagic - lookup one file in parsed, in-memory copy of database
    Passed the name and FILE* of one file to be typed */
 
@@ -2065,7 +2231,7 @@ int file_softmagic(struct magic_set* ms, const unsigned char* buf,
     int rv;
     for(ml = ms->mlist[0]->next; ml != ms->mlist[0]; ml = ml->next)
     {
-        if((rv = match(ms, ml->magic, ml->nmagic, buf, nbytes, 0, mode,
+        if((rv = match(ms, ml, buf, nbytes, 0, mode,
                         text, 0, NULL)) != 0)
             return rv;
     }
@@ -33,6 +33,8 @@
  * Externals
  */
 
+struct fcache;
+
 extern char command[];      // the command being processed
 extern int  connected;      // true if we're connected to host
 extern char hostname[];     // name of host system
@@ -41,6 +43,9 @@ extern int  interactive;    // true if we're running interactive
 extern jmp_buf jmp_mainloop;// to return to main command loop
 extern int  lastsend;       // #bytes of data in last data package
 extern FILE *localfp;       // fp of local file to read or write
+extern struct fcache *localcache;  // cached packets to send instead
+extern int  mmsgflag;       // true if all sessions share one socket (-m)
+extern int  mmsgbatch;      // #datagrams per recvmmsg/sendmmsg call (-b)
 extern int  modetype;       // see MODE_xxx values
 extern int  nextblknum;     // next block# to send or rcv
 extern int  *pname;         // the name by which we are invoked
@@ -49,6 +54,7 @@ extern char *prompt;        // prompt string, for interactive use
 extern long totnbytes;      // for get or put statistics printing
 extern int  traceflag;      // -t command line option, or "trace" cmd
 extern int  verboseflag;    // -v command line option
+extern int  nworkers;       // #SO_REUSEPORT worker processes (-w)
 
 #define MODE_ASCII  0       // ascii == netascii
 #define MODE_BINARY 1       // binary == octet
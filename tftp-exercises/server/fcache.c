@@ -0,0 +1,365 @@
+/*
+ * In-memory file cache for the single-socket server.
+ *
+ * Network boot storms ask for the same few files over and over. The
+ * first RRQ for a file reads it all and splits it into ready-to-send
+ * DATA packets; later RRQs for the same file, mode and block size just
+ * take a reference to those packets, so recv_ACK() does no reads, no
+ * netascii conversion and, inside FCACHE_RECHECK seconds of the last
+ * check, not even a stat().
+ *
+ * fcache_stat()    stat() the file, or reuse the cached result if it
+ *                      is recent enough
+ * fcache_get()     Find or load the packets for a file whose stat()
+ *                      result the caller already has
+ * fcache_packet()  Return DATA packet blknum of a cached file
+ * fcache_release() Drop a session's reference
+ *
+ * Everything is kept under "fcachemax" bytes by freeing the least
+ * recently used files that no session is sending.
+ */
+
+#define _GNU_SOURCE             // IOV_MAX
+
+#include "fcache.h"
+#include "file.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+#include <arpa/inet.h>
+
+long fcachemax = 64L * 1024 * 1024;
+
+static struct fcache*  fc_hash[FCACHE_HASHSIZE];
+static struct fcache*  lru_head = NULL;    // most recently used
+static struct fcache*  lru_tail = NULL;    // least recently used
+static long            fc_total = 0;       // bytes of packets cached
+
+static unsigned int fcache_hash(char* filename)
+{
+    unsigned int h = 0;
+
+    while(*filename)
+        h = h * 31 + (unsigned char) *filename++;
+    return h % FCACHE_HASHSIZE;
+}
+
+static void lru_unlink(struct fcache* fc)
+{
+    if(fc->lru_prev)
+        fc->lru_prev->lru_next = fc->lru_next;
+    else
+        lru_head = fc->lru_next;
+    if(fc->lru_next)
+        fc->lru_next->lru_prev = fc->lru_prev;
+    else
+        lru_tail = fc->lru_prev;
+    fc->lru_prev = fc->lru_next = NULL;
+}
+
+static void lru_push(struct fcache* fc)
+{
+    fc->lru_prev = NULL;
+    fc->lru_next = lru_head;
+    if(lru_head)
+        lru_head->lru_prev = fc;
+    else
+        lru_tail = fc;
+    lru_head = fc;
+}
+
+/*
+ * Take a file out of the table. It's freed now if no session is
+ * sending it, otherwise by the last fcache_release().
+ */
+
+static void fcache_remove(struct fcache* fc)
+{
+    struct fcache** pp;
+
+    for(pp = &fc_hash[fcache_hash(fc->filename)]; *pp != NULL; pp = &(*pp)->next)
+        if(*pp == fc)
+        {
+            *pp = fc->next;
+            break;
+        }
+    lru_unlink(fc);
+    fc_total -= fc->nblocks * (4 + fc->blksize);
+
+    D_printf("fcache_remove: %s, %ld bytes cached\n", fc->filename, fc_total);
+
+    if(fc->refcnt > 0)
+        fc->stale = 1;
+    else
+    {
+        free(fc->packets);
+        free(fc);
+    }
+}
+
+/*
+ * Free least recently used files until "need" more bytes fit.
+ */
+
+static void fcache_evict(long need)
+{
+    struct fcache *fc, *prev;
+
+    for(fc = lru_tail; fc != NULL && fc_total + need > fcachemax; fc = prev)
+    {
+        prev = fc->lru_prev;
+        if(fc->refcnt == 0)
+            fcache_remove(fc);
+    }
+}
+
+/*
+ * Same file as when we loaded it?
+ */
+
+static int fcache_same(struct stat* a, struct stat* b)
+{
+    return a->st_dev   == b->st_dev  &&
+           a->st_ino   == b->st_ino  &&
+           a->st_size  == b->st_size &&
+           a->st_mtime == b->st_mtime;
+}
+
+/*
+ * stat() a file that may be cached.
+ * If any cached copy of it was compared with the file less than
+ * FCACHE_RECHECK seconds ago, that result is returned without a
+ * system call. Otherwise the file is stat()ed, and copies that no
+ * longer match are removed.
+ * Return 0 on success, -1 on error.
+ */
+
+int fcache_stat(char* filename, struct stat* sbp)
+{
+    struct fcache *fc, *next;
+    time_t now = time(NULL);
+    unsigned int h = fcache_hash(filename);
+
+    for(fc = fc_hash[h]; fc != NULL; fc = fc->next)
+        if(strcmp(fc->filename, filename) == 0 &&
+           now - fc->checked < FCACHE_RECHECK)
+        {
+            *sbp = fc->statbuff;
+            return 0;
+        }
+
+    if(stat(filename, sbp) < 0)
+        return -1;
+
+    for(fc = fc_hash[h]; fc != NULL; fc = next)
+    {
+        next = fc->next;
+        if(strcmp(fc->filename, filename) != 0)
+            continue;
+        if(fcache_same(&fc->statbuff, sbp))
+            fc->checked = now;
+        else
+            fcache_remove(fc);
+    }
+    return 0;
+}
+
+/*
+ * Read the whole file into packets of "blksize" data bytes.
+ * Binary files are read straight into the packets with readv(),
+ * skipping over the 4-byte headers. Netascii goes through
+ * file_read(), so the cached data is exactly what it would send.
+ * Return 0 on success, -1 on error.
+ */
+
+static int fcache_load(struct fcache* fc)
+{
+    FILE* fp;
+    char* pkt;
+    long  k, n, want;
+    int   i, slot = 4 + fc->blksize;
+    struct iovec iov[IOV_MAX];
+
+    if((fp = fopen(fc->filename, "r")) == NULL)
+        return -1;
+    file_setstate(0, -1);       // as file_open() does
+
+    fc->nbytes = 0;
+    for(k = 0; k < fc->nblocks; k++)
+    {
+        pkt = fc->packets + k * slot;
+        stshort(OP_DATA, pkt);
+        stshort((k + 1) & 0xffff, pkt + 2);
+    }
+
+    if(fc->modetype == MODE_BINARY)
+    {
+        for(k = 0; k < fc->nblocks; k += i)
+        {
+            for(i = 0; i < IOV_MAX && k + i < fc->nblocks; i++)
+            {
+                iov[i].iov_base = fc->packets + (k + i) * slot + 4;
+                iov[i].iov_len  = fc->blksize;
+            }
+            want = (long) i * fc->blksize;
+            if((n = readv(fileno(fp), iov, i)) < 0)
+                goto error;
+            fc->nbytes += n;
+            if(n < want)
+                break;
+        }
+    } else
+    {
+        for(k = 0; k < fc->nblocks; k++)
+        {
+            n = file_read(fp, fc->packets + k * slot + 4, fc->blksize, fc->modetype);
+            fc->nbytes += n;
+            if(n < fc->blksize)
+                break;
+        }
+    }
+
+    /*
+     * The file can't have grown past nblocks - 1 full blocks, since
+     * nblocks came from its size; if it did, don't cache it.
+     */
+
+    if(fc->nbytes >= fc->nblocks * fc->blksize)
+        goto error;
+    fc->nblocks = fc->nbytes / fc->blksize + 1;
+
+    fclose(fp);
+    return 0;
+
+error:
+    fclose(fp);
+    return -1;
+}
+
+/*
+ * Return the packets for a file, loading them if they aren't cached.
+ * "sbp" is the caller's fresh fcache_stat() result.
+ * The caller gets a reference, and must fcache_release() it.
+ * Return NULL if the file can't or shouldn't be cached; the caller
+ * then reads it the usual way.
+ */
+
+struct fcache* fcache_get(char* filename, int mode, int blksize,
+                          struct stat* sbp)
+{
+    struct fcache* fc;
+    unsigned int h;
+    long nblocks, size;
+
+    if(fcachemax <= 0 || !S_ISREG(sbp->st_mode) ||
+       strlen(filename) >= MAXFILENAME)
+        return NULL;
+
+    h = fcache_hash(filename);
+    for(fc = fc_hash[h]; fc != NULL; fc = fc->next)
+        if(fc->modetype == mode && fc->blksize == blksize &&
+           strcmp(fc->filename, filename) == 0 &&
+           fcache_same(&fc->statbuff, sbp))
+        {
+            D_printf("fcache_get: hit %s\n", filename);
+            lru_unlink(fc);
+            lru_push(fc);
+            fc->refcnt++;
+            return fc;
+        }
+
+    /*
+     * Netascii can double the size (every LF becomes CR, LF).
+     */
+
+    nblocks = sbp->st_size * (mode == MODE_ASCII ? 2 : 1) / blksize + 1;
+    size    = nblocks * (4 + blksize);
+    if(size > fcachemax / 2)
+        return NULL;        // would push everything else out
+
+    fcache_evict(size);
+    if(fc_total + size > fcachemax)
+        return NULL;        // the rest are all being sent
+
+    if((fc = calloc(1, sizeof(struct fcache))) == NULL)
+        return NULL;
+    if((fc->packets = malloc(size)) == NULL)
+    {
+        free(fc);
+        return NULL;
+    }
+
+    strcpy(fc->filename, filename);
+    fc->modetype = mode;
+    fc->blksize  = blksize;
+    fc->statbuff = *sbp;
+    fc->checked  = time(NULL);
+    fc->nblocks  = nblocks;
+
+    if(fcache_load(fc) < 0)
+    {
+        D_printf("fcache_get: can't load %s\n", filename);
+        free(fc->packets);
+        free(fc);
+        return NULL;
+    }
+
+    /*
+     * Give back what netascii didn't need.
+     */
+
+    if(fc->nblocks != nblocks)
+    {
+        char* p = realloc(fc->packets, fc->nblocks * (4 + blksize));
+        if(p != NULL)
+            fc->packets = p;
+    }
+
+    fc_total += fc->nblocks * (4 + blksize);
+    fc->next = fc_hash[h];
+    fc_hash[h] = fc;
+    lru_push(fc);
+    fc->refcnt = 1;
+
+    D_printf("fcache_get: loaded %s, %ld blocks, %ld bytes cached\n",
+             filename, fc->nblocks, fc_total);
+
+    return fc;
+}
+
+/*
+ * Return DATA packet# blknum (1, 2, ...) and store its number of data
+ * bytes through "nbytesp". Past the end, return NULL and 0 bytes, just
+ * as file_read() returns 0 at EOF.
+ */
+
+char* fcache_packet(struct fcache* fc, int blknum, int* nbytesp)
+{
+    if(blknum < 1 || blknum > fc->nblocks)
+    {
+        *nbytesp = 0;
+        return NULL;
+    }
+
+    if(blknum < fc->nblocks)
+        *nbytesp = fc->blksize;
+    else
+        *nbytesp = fc->nbytes - (fc->nblocks - 1) * fc->blksize;
+
+    return fc->packets + (long) (blknum - 1) * (4 + fc->blksize);
+}
+
+void fcache_release(struct fcache* fc)
+{
+    if(--fc->refcnt > 0)
+        return;
+
+    if(fc->stale)
+    {
+        free(fc->packets);
+        free(fc);
+    }
+}
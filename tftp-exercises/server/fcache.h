@@ -0,0 +1,47 @@
+#ifndef __FCACHE_H__
+#define __FCACHE_H__
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "defs.h"
+
+#define FCACHE_RECHECK  1   // seconds before a cached stat() is redone
+#define FCACHE_HASHSIZE 64  // #hash chains
+
+/*
+ * One cached file, already split into DATA packets.
+ * Packet k (1, 2, ...) lives at packets + (k - 1) * (4 + blksize), with
+ * its opcode and block# filled in, so sending it needs no file I/O
+ * and no conversion. The last packet is the short (maybe empty) one
+ * that ends the transfer.
+ */
+
+struct fcache {
+    struct fcache*  next;           // next on this hash chain
+    struct fcache*  lru_prev;       // toward most recently used
+    struct fcache*  lru_next;       // toward least recently used
+
+    char    filename[MAXFILENAME];
+    int     modetype;               // MODE_ASCII or MODE_BINARY
+    int     blksize;                // data bytes per packet
+    struct stat statbuff;           // what the file looked like when loaded
+    time_t  checked;                // last time statbuff was compared
+    int     refcnt;                 // #sessions sending from this
+    int     stale;                  // file changed, free on last release
+
+    long    nbytes;                 // total data bytes
+    long    nblocks;                // #packets, including the last one
+    char*   packets;
+};
+
+extern long fcachemax;              // memory cap in bytes, 0 disables
+
+int   fcache_stat(char* filename, struct stat* sbp);
+struct fcache* fcache_get(char* filename, int mode, int blksize,
+                          struct stat* sbp);
+char* fcache_packet(struct fcache* fc, int blknum, int* nbytesp);
+void  fcache_release(struct fcache* fc);
+
+#endif
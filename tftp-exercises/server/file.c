@@ -7,6 +7,7 @@
  */
 
 #include "defs.h"
+#include "fsm.h"
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -41,6 +42,24 @@ FILE* file_open(char* filename, char* mode, int initblknum)
     return fp;
 }
 
+/*
+ * Save and restore the netascii conversion state above.
+ * The single-socket server (-m) interleaves many transfers in one
+ * process, so each session keeps its own copy of these.
+ */
+
+void file_getstate(int* lastcrp, int* nextcharp)
+{
+    *lastcrp   = lastcr;
+    *nextcharp = nextchar;
+}
+
+void file_setstate(int savedcr, int savedchar)
+{
+    lastcr   = savedcr;
+    nextchar = savedchar;
+}
+
 /*
  * Close the local file.
  * This causes the standard i/o system to flush its buffers for this file
@@ -51,12 +70,12 @@ void file_close(FILE* fp)
     if(lastcr)
     {
         D_printf("file_close: final character was a CR\n");
-        exit(-1);
+        fsm_exit(-1);
     }
     if(nextchar >= 0)
     {
         D_printf("file_close: nextchar >= 0\n");
-        exit(-1);
+        fsm_exit(-1);
     }
 
     if(fp == stdout)
@@ -64,7 +83,7 @@ void file_close(FILE* fp)
     else if(fclose(fp) == EOF)
     {
         D_printf("file_close: fclose error\n");
-        exit(-1);
+        fsm_exit(-1);
     }
 }
 
@@ -87,7 +106,7 @@ int file_read(FILE* fp, char* ptr, int maxnbytes, int mode)
         if(count < 0)
         {
             D_printf("file_read: read error on local file.\n");
-            exit(-1);
+            fsm_exit(-1);
         }
         return count;
     } else if(mode == MODE_ASCII)
@@ -119,7 +138,7 @@ int file_read(FILE* fp, char* ptr, int maxnbytes, int mode)
                 if(ferror(fp))
                 {
                     D_printf("file_read: read err from getc on local file.\n");
-                    exit(-1);
+                    fsm_exit(-1);
                 }
                 return count;
             } else if(c == '\n')
@@ -140,7 +159,7 @@ int file_read(FILE* fp, char* ptr, int maxnbytes, int mode)
     } else
     {
         D_printf("file_read: unknown MODE value\n");
-        exit(-1);
+        fsm_exit(-1);
     }
 }
 
@@ -163,7 +182,7 @@ void file_write(FILE* fp, char* ptr, int nbytes, int mode)
         if(i != nbytes)
         {
             D_printf("file_write: write error to local file, i = %d\n", i);
-            exit(-1);
+            fsm_exit(-1);
         }
     } else if(mode == MODE_ASCII)
     {
@@ -193,7 +212,7 @@ void file_write(FILE* fp, char* ptr, int nbytes, int mode)
                 else
                 {
                     D_printf("file_write: CR followed by 0x%02x\n", c);
-                    exit(-1);
+                    fsm_exit(-1);
                 }
                 lastcr = 0;
             } else if(c == '\r')
@@ -205,12 +224,12 @@ void file_write(FILE* fp, char* ptr, int nbytes, int mode)
             if(putc(c, fp) == EOF)
             {
                 D_printf("file_write: write error from putc to local file\n");
-                exit(-1);
+                fsm_exit(-1);
             }
         }
     } else
     {
         D_printf("file_write: unknown MODE value\n");
-        exit(-1);
+        fsm_exit(-1);
     }
 }
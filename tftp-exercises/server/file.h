@@ -6,5 +6,7 @@ FILE* file_open(char* filename, char* mode, int initblknum);
 void  file_close(FILE* fp);
 int   file_read(FILE* fp, char* ptr, int maxnbytes, int mode);
 void  file_write(FILE* fp, char* ptr, int nbytes, int mode);
+void  file_getstate(int* lastcrp, int* nextcharp);
+void  file_setstate(int savedcr, int savedchar);
 
 #endif
@@ -6,8 +6,10 @@
 #include "rtt.h"
 #include "net_udp.h"
 #include "sendrecv.h"
+#include "fsm.h"
 
 #include <signal.h>
+#include <setjmp.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <arpa/inet.h>
@@ -18,6 +20,20 @@ static int    rttfirst = 1;
 int tout_flag;  // set to 1 by SIGALRM handler
 
 
+/*
+ * Give up on the current transfer.
+ * The fork()ing server just exits the child. The single-socket server
+ * has every session in this one process, so it jumps back to the
+ * session dispatcher instead, which drops only this session.
+ */
+
+void fsm_exit(int code)
+{
+    if(mmsgflag)
+        longjmp(jmp_mainloop, 1);
+    exit(code);
+}
+
 /*
  * Error packet received and we weren't expecting it.
  */
@@ -25,7 +41,7 @@ int tout_flag;  // set to 1 by SIGALRM handler
 int fsm_error(char* ptr, int nbytes)  
 {
     D_printf("error received: op_sent = %d, op_recv = %d\n", op_sent, op_recv);
-    exit(-1);
+    fsm_exit(-1);
 }
 
 /*
@@ -36,7 +52,7 @@ int fsm_invalid(char* ptr, int nbytes)
 {
     D_printf("protocol botch: op_sent = %d, op_recv = %d\n",
                 op_sent, op_recv);
-    exit(-1);
+    fsm_exit(-1);
 }
 
 /*
@@ -168,32 +184,7 @@ int fsm_loop(int opcode)
         tout_flag = 0;
         rtt_stop(&rttinfo); // stop RTT timer, calc new values
 
-        if(nbytes < 4)
-        {
-            D_printf("fsm_loop: receive length = %d bytes\n", nbytes);
-            exit(-1);
-        }
-
-        op_recv = ldshort(recvbuff);
-
-
-        if(op_recv < OP_MIN || op_recv > OP_MAX)
-        {
-            D_printf("fsm_loop: invalid opcode received: %d\n", op_recv);
-            exit(-1);
-        }
-
-        /*
-         * We call the appropriate function, passing the address
-         * of the received buffer and its length. These arguments
-         * ignore the received-opcode, which we've already processed.
-         *
-         * We assume the called function will send a response to the 
-         * other side. It is the called funciton's responsibility to
-         * set op_sent to the op-code that it sends to the other side.
-         */
-
-        if((*fsm_ptr[op_sent][op_recv])(recvbuff + 2, nbytes - 2) < 0)
+        if(fsm_process(recvbuff, nbytes) < 0)
         {
             /*
              * When the called function returns -1, this loop
@@ -207,3 +198,39 @@ int fsm_loop(int opcode)
     }
 }
 
+/*
+ * Process one received packet.
+ * Validate the opcode and call the appropriate function from the
+ * state table. Used by fsm_loop() above and by the single-socket
+ * server, which does its own receiving and timing.
+ * Return the value of the called function: -1 when the transfer is done.
+ */
+
+int fsm_process(char* buff, int nbytes)
+{
+    if(nbytes < 4)
+    {
+        D_printf("fsm_process: receive length = %d bytes\n", nbytes);
+        fsm_exit(-1);
+    }
+
+    op_recv = ldshort(buff);
+
+    if(op_recv < OP_MIN || op_recv > OP_MAX)
+    {
+        D_printf("fsm_process: invalid opcode received: %d\n", op_recv);
+        fsm_exit(-1);
+    }
+
+    /*
+     * We call the appropriate function, passing the address
+     * of the received buffer and its length. These arguments
+     * ignore the received-opcode, which we've already processed.
+     *
+     * We assume the called function will send a response to the 
+     * other side. It is the called funciton's responsibility to
+     * set op_sent to the op-code that it sends to the other side.
+     */
+
+    return (*fsm_ptr[op_sent][op_recv])(buff + 2, nbytes - 2);
+}
@@ -1,6 +1,8 @@
 #ifndef __FSM_H__
 #define __FSM_H__
 
-int fsm_loop(int opcode);
+int  fsm_loop(int opcode);
+int  fsm_process(char* buff, int nbytes);
+void fsm_exit(int code) __attribute__((noreturn));
 
 #endif
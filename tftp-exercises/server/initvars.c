@@ -11,6 +11,9 @@ int  inetdflag              = 1;
 int  interactive            = 1;
 int  lastsend               = 0;
 FILE *localfp               = NULL;
+struct fcache *localcache   = NULL;
+int  mmsgflag               = 0;
+int  mmsgbatch              = 32;
 int  modetype               = MODE_ASCII;
 int  nextblknum             = 0;
 int  port                   = 0;
@@ -21,5 +24,6 @@ int  sendlen                = 0;
 long totnbytes              = 0;
 int  op_sent                = 0;
 int  op_recv                = 0;
+int  nworkers               = 1;
 
 jmp_buf jmp_mainloop;
@@ -2,6 +2,12 @@
  * tftp - Trivial File Transfer Protocol.
  *
  * -p port# specifies a different port# to listen on
+ * -m       serve every client from the one listening socket, reading
+ *          and writing datagrams in batches, instead of fork()ing
+ * -b n     #datagrams per batch with -m
+ * -w n     with -m, run n worker processes sharing the port through
+ *          SO_REUSEPORT
+ * -c n     with -m, cache up to n Mbytes of files in memory (0: none)
  */
 
 
@@ -10,13 +16,16 @@
 #include "net_udp.h"
 #include "rtt.h"
 #include "fsm.h"
+#include "session.h"
+#include "fcache.h"
 
 #include <stdlib.h>
+#include <unistd.h>
 
 
 int main(int argc, char** argv)
 {
-    int childpid;
+    int childpid, i;
     char* s;
 
     D_printf("main: simple tftpd\n");
@@ -39,6 +48,43 @@ int main(int argc, char** argv)
                     D_printf("main: port: %d\n", port);
                     break;
 
+                case 'm':
+                    mmsgflag = 1;
+                    break;
+
+                case 'b':
+                    if(--argc <= 0)
+                    {
+                        D_printf("main: -b requires another argument\n");
+                        exit(1);
+                    }
+                    mmsgbatch = atoi(*++argv);
+                    break;
+
+                case 'c':
+                    if(--argc <= 0)
+                    {
+                        D_printf("main: -c requires another argument\n");
+                        exit(1);
+                    }
+                    fcachemax = atol(*++argv) * 1024 * 1024;
+                    break;
+
+                case 'w':
+                    if(--argc <= 0)
+                    {
+                        D_printf("main: -w requires another argument\n");
+                        exit(1);
+                    }
+                    nworkers = atoi(*++argv);
+                    if(nworkers < 1)
+                    {
+                        D_printf("main: Invalid #workers: %d\n", nworkers);
+                        exit(1);
+                    }
+                    mmsgflag = 1;
+                    break;
+
                 default:
                 {
                     D_printf("main: unknown command line option: %c\n", *s);
@@ -46,6 +92,25 @@ int main(int argc, char** argv)
                 }
             }
 
+    if(mmsgflag)
+    {
+        /*
+         * Single-socket server. The parent is worker 0; each worker
+         * binds its own socket and serves its share of the clients.
+         */
+
+        for(i = 1; i < nworkers; i++)
+            if((childpid = fork()) < 0)
+            {
+                D_printf("main: cannot fork worker %d\n", i);
+                exit(1);
+            } else if(childpid == 0)
+                break;
+
+        net_init(TFTP_SERVICE, port);
+        session_loop(mmsgbatch);
+    }
+
     net_init(TFTP_SERVICE, port);
 
     /*
@@ -0,0 +1,164 @@
+/*
+ * Batched datagram I/O for the single-socket server.
+ *
+ * mmsg_recv()  Waits for the socket to become readable, then pulls up
+ *                  to "nbatch" datagrams off it with one recvmmsg()
+ * mmsg_getpkt()    Returns the i'th datagram of the last mmsg_recv()
+ * mmsg_queue() Copies an outgoing datagram into the transmit batch
+ * mmsg_flush() Hands the whole transmit batch to the kernel with one
+ *                  sendmmsg(), once per trip around the server loop
+ *
+ * net_send() calls mmsg_queue() when "mmsgflag" is set, so the
+ * routines in sendrecv.c don't know their packets are being batched.
+ */
+
+#define _GNU_SOURCE             // recvmmsg, sendmmsg
+
+#include "net_mmsg.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+static int              nbatch = 1;
+
+static struct mmsg_pkt  rxpkt[MMSG_MAXBATCH];
+static struct mmsghdr   rxhdr[MMSG_MAXBATCH];
+static struct iovec     rxiov[MMSG_MAXBATCH];
+
+static struct mmsg_pkt  txpkt[MMSG_MAXBATCH];
+static struct mmsghdr   txhdr[MMSG_MAXBATCH];
+static struct iovec     txiov[MMSG_MAXBATCH];
+static int              ntx = 0;    // #datagrams queued in txpkt[]
+
+/*
+ * Set up the message headers once; only the lengths change per call.
+ */
+
+void mmsg_init(int n)
+{
+    int i;
+
+    if(n < 1)
+        n = 1;
+    else if(n > MMSG_MAXBATCH)
+        n = MMSG_MAXBATCH;
+    nbatch = n;
+
+    for(i = 0; i < MMSG_MAXBATCH; i++)
+    {
+        rxiov[i].iov_base = rxpkt[i].buff;
+        rxiov[i].iov_len  = MAXBUFF;
+        rxhdr[i].msg_hdr.msg_iov    = &rxiov[i];
+        rxhdr[i].msg_hdr.msg_iovlen = 1;
+        rxhdr[i].msg_hdr.msg_name   = &rxpkt[i].addr;
+
+        txiov[i].iov_base = txpkt[i].buff;
+        txhdr[i].msg_hdr.msg_iov    = &txiov[i];
+        txhdr[i].msg_hdr.msg_iovlen = 1;
+        txhdr[i].msg_hdr.msg_name   = &txpkt[i].addr;
+    }
+
+    D_printf("mmsg_init: %d datagrams per call\n", nbatch);
+}
+
+/*
+ * Wait up to "timeout" milliseconds (-1 for ever) for the socket to
+ * become readable, then read as many datagrams as are waiting, up to
+ * the batch size.
+ * Return the number of datagrams read, 0 on timeout or signal.
+ */
+
+int mmsg_recv(int fd, int timeout)
+{
+    struct pollfd pfd;
+    int i, n;
+
+    pfd.fd     = fd;
+    pfd.events = POLLIN;
+
+    if((n = poll(&pfd, 1, timeout)) <= 0)
+    {
+        if(n < 0 && errno != EINTR)
+            D_printf("mmsg_recv: poll error\n");
+        return 0;
+    }
+
+    for(i = 0; i < nbatch; i++)
+        rxhdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    if((n = recvmmsg(fd, rxhdr, nbatch, MSG_DONTWAIT, NULL)) < 0)
+    {
+        if(errno != EINTR && errno != EAGAIN)
+            D_printf("mmsg_recv: recvmmsg error\n");
+        return 0;
+    }
+
+    for(i = 0; i < n; i++)
+        rxpkt[i].len = rxhdr[i].msg_len;
+
+    D_printf("mmsg_recv: got %d datagrams\n", n);
+
+    return n;
+}
+
+struct mmsg_pkt* mmsg_getpkt(int i)
+{
+    return &rxpkt[i];
+}
+
+/*
+ * Queue a datagram for the next mmsg_flush().
+ * The caller's buffer is copied, since sendbuff[] is reused by the
+ * next session before the batch goes out.
+ */
+
+void mmsg_queue(int fd, char* buff, int len, struct sockaddr_in* to)
+{
+    if(ntx == nbatch)
+        mmsg_flush(fd);
+
+    if(len > MAXBUFF)
+        len = MAXBUFF;
+    memcpy(txpkt[ntx].buff, buff, len);
+    txpkt[ntx].len  = len;
+    txpkt[ntx].addr = *to;
+    ntx++;
+}
+
+/*
+ * Send everything queued by mmsg_queue().
+ * A datagram the kernel won't take is dropped; the session's
+ * retransmit timer will send it again.
+ */
+
+void mmsg_flush(int fd)
+{
+    int i, n, sent;
+
+    for(i = 0; i < ntx; i++)
+    {
+        txiov[i].iov_len = txpkt[i].len;
+        txhdr[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+    }
+
+    for(sent = 0; sent < ntx; sent += n)
+    {
+        if((n = sendmmsg(fd, &txhdr[sent], ntx - sent, 0)) <= 0)
+        {
+            if(n < 0 && errno == EINTR)
+            {
+                n = 0;
+                continue;
+            }
+            D_printf("mmsg_flush: sendmmsg error, dropped datagram to %s\n",
+                     inet_ntoa(txpkt[sent].addr.sin_addr));
+            n = 1;      // skip the one the kernel refused
+        }
+    }
+
+    ntx = 0;
+}
@@ -0,0 +1,27 @@
+#ifndef __NET_MMSG_H__
+#define __NET_MMSG_H__
+
+#include <netinet/in.h>
+
+#include "defs.h"
+
+#define MMSG_MAXBATCH   64  // max #datagrams per recvmmsg/sendmmsg call
+
+/*
+ * One datagram, either received by mmsg_recv() or queued for
+ * mmsg_flush(), with the address of the other end.
+ */
+
+struct mmsg_pkt {
+    char                buff[MAXBUFF];
+    int                 len;
+    struct sockaddr_in  addr;
+};
+
+void mmsg_init(int nbatch);
+int  mmsg_recv(int fd, int timeout);
+struct mmsg_pkt* mmsg_getpkt(int i);
+void mmsg_queue(int fd, char* buff, int len, struct sockaddr_in* to);
+void mmsg_flush(int fd);
+
+#endif
@@ -9,6 +9,7 @@
 #include <arpa/inet.h>          // inet_not
 #include <errno.h>
 #include <strings.h>            // bzero
+#include <string.h>
 #include <stdlib.h>
 
 #include <sys/types.h>
@@ -16,11 +17,12 @@
 #include <unistd.h>
 
 #include "net_udp.h"
+#include "net_mmsg.h"
 
 extern int errno;
 extern char recvbuff[];     // this is declared in initvars.c 
 
-int tout_flag = 0;
+extern int tout_flag;       // this is declared in fsm.c
 
 int  sockfd = -1;
 
@@ -43,6 +45,24 @@ void net_init(char* service, int port)
         exit(1);
     }
 
+    /*
+     * With several worker processes, each one binds its own socket
+     * to the same port and the kernel spreads the clients across
+     * them by address hash, so a client's packets always reach the
+     * worker that holds its session.
+     */
+
+    if(nworkers > 1)
+    {
+        int on = 1;
+
+        if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+        {
+            D_printf("net_init: cannot set SO_REUSEPORT\n");
+            exit(1);
+        }
+    }
+
     /*
      * Bind local address so that any client can send to it
      */
@@ -142,6 +162,9 @@ int net_open(int inetdflag)
 
 void net_close()
 {
+    if(mmsgflag)
+        return;         // the socket is shared by every session
+
     D_printf("net_close: fd = %d\n", sockfd);
     close(sockfd);
     sockfd = -1;
@@ -150,6 +173,8 @@ void net_close()
 /*
  * Send a record to the other end
  * The "struct sockaddr_in cli_addr" specifies the client's address
+ * In the single-socket server, the record is only queued here, and
+ * goes out with the rest of the batch at the end of the server loop.
  */
 
 void net_send(char* buff, int len)
@@ -159,6 +184,12 @@ void net_send(char* buff, int len)
              len, inet_ntoa(udp_cli_addr.sin_addr),
              ntohs(udp_cli_addr.sin_port));
 
+    if(mmsgflag)
+    {
+        mmsg_queue(sockfd, buff, len, &udp_cli_addr);
+        return;
+    }
+
     rc = sendto(sockfd, buff, len, 0, (struct sockaddr*)&udp_cli_addr, 
                  sizeof(udp_cli_addr));
 
@@ -169,6 +200,32 @@ void net_send(char* buff, int len)
     }
 }
 
+/*
+ * Tell a stray host that it isn't part of our transfer.
+ * This is the "Unknown transfer ID" error of RFC 1350; it's sent
+ * directly, so sendbuff[] still holds our last packet for the
+ * real client.
+ */
+
+void net_reject(struct sockaddr_in* to)
+{
+    char errbuff[64];
+    int  len;
+
+    stshort(OP_ERROR, errbuff);
+    stshort(ERR_BADID, errbuff + 2);
+    strcpy(errbuff + 4, "Unknown transfer ID");
+    len = 4 + strlen(errbuff + 4) + 1;
+
+    D_printf("net_reject: host %s, port# %d\n",
+             inet_ntoa(to->sin_addr), ntohs(to->sin_port));
+
+    if(mmsgflag)
+        mmsg_queue(sockfd, errbuff, len, to);
+    else
+        sendto(sockfd, errbuff, len, 0, (struct sockaddr*)to, sizeof(*to));
+}
+
 /*
  * Receive a record from the other end
  * We're called not only by the user, but also by net_open(),
@@ -237,14 +294,17 @@ again:
     
     /*
      * Make sure the message is from the expected client.
+     * Anyone else gets an error packet, and we keep waiting.
      */
 
     if(udp_cli_addr.sin_port != 0 &&
-       udp_cli_addr.sin_port != from_addr.sin_port)
+       (udp_cli_addr.sin_port != from_addr.sin_port ||
+        udp_cli_addr.sin_addr.s_addr != from_addr.sin_addr.s_addr))
     {
-        D_printf("net_recv: received from port %d, expected from port %d",
+        D_printf("net_recv: received from port %d, expected from port %d\n",
                  ntohs(from_addr.sin_port), ntohs(udp_cli_addr.sin_port));
-        exit(1);
+        net_reject(&from_addr);
+        goto again;
     }
 
     return nbytes;      // return the actual length of the message
@@ -5,6 +5,8 @@
 #include "defs.h"
 #include "net_udp.h"
 #include "file.h"
+#include "fsm.h"
+#include "fcache.h"
 
 #include <sys/stat.h>
 #include <arpa/inet.h>
@@ -32,7 +34,8 @@ void strlccpy(char* dest, char* src)
 /*
  * Send an error packet.
  * Note that an error packet isn't retransmitted or acknowledged by
- * the other end, so once we're done sending it, we can exit.
+ * the other end, so once we're done sending it, we can exit (or, in
+ * the single-socket server, drop just this session).
  */
 void send_ERROR(int ecode, char* errstring)
 {
@@ -48,7 +51,7 @@ void send_ERROR(int ecode, char* errstring)
 
     net_close();
 
-    exit(0);
+    fsm_exit(0);
 }
 
 
@@ -74,7 +77,7 @@ void recv_xRQ(int opcode, char* ptr, int nbytes)
             goto FileOK;
     {
         D_printf("recv_xRQ: Invalid filename\n");
-        exit(-1);
+        fsm_exit(-1);
     }
 
 FileOK:
@@ -86,7 +89,7 @@ FileOK:
             goto ModeOK;
     {
         D_printf("recv_xRQ: Invalid Mode\n");
-        exit(-1);
+        fsm_exit(-1);
     }
 
 ModeOK:
@@ -119,9 +122,10 @@ ModeOK:
         /*
          * Read request - verify that the file exists
          * and that it has world read permission.
+         * A cached file may not need a stat() at all.
          */
 
-        if(stat(filename, &statbuff) < 0)
+        if(fcache_stat(filename, &statbuff) < 0)
             send_ERROR(ERR_ACCESS, "filename get stat buffer error");
         if((statbuff.st_mode & (S_IREAD >> 6)) == 0)  // S_IROTH
             send_ERROR(ERR_ACCESS, "File doesn't allow world read permission");
@@ -146,7 +150,22 @@ ModeOK:
      } else
      {
          D_printf("recv_xRQ: unknown opcode\n");
-         exit(-1);
+         fsm_exit(-1);
+     }
+
+     /*
+      * The single-socket server keeps hot files in memory, already
+      * split into DATA packets, and shares them between sessions.
+      */
+
+     localcache = NULL;
+     if(opcode == OP_RRQ && mmsgflag)
+         localcache = fcache_get(filename, modetype, MAXDATA, &statbuff);
+
+     if(localcache != NULL)
+     {
+         nextblknum = 0;         // as file_open() does
+         return;
      }
 
      localfp = file_open(filename, (opcode == OP_RRQ) ? "r" : "w", 0);
@@ -218,7 +237,7 @@ int recv_DATA(char* ptr, int nbytes)
     if(nbytes > MAXDATA)
     {
         D_printf("recv_DATA: data packet received with length = %d bytes\n", nbytes);
-        exit(-1);
+        fsm_exit(-1);
     }
 
     if(recvblknum == nextblknum)
@@ -249,7 +268,10 @@ int recv_DATA(char* ptr, int nbytes)
          */
 
          if(nbytes < MAXDATA)
+         {
              file_close(localfp);
+             localfp = NULL;
+         }
     } else if(recvblknum < (nextblknum - 1))
     {
         /*
@@ -261,7 +283,7 @@ int recv_DATA(char* ptr, int nbytes)
          */
 
         D_printf("recv_DATA: recvblknum < nextblknum - 1\n");
-        exit(-1);
+        fsm_exit(-1);
     } else if(recvblknum > nextblknum)
     {
         /*
@@ -272,7 +294,7 @@ int recv_DATA(char* ptr, int nbytes)
          */
 
         D_printf("recv_DATA: recvblknum > nextblknum\n");
-        exit(-1);
+        fsm_exit(-1);
     }
 
     /* 
@@ -303,12 +325,13 @@ int recv_DATA(char* ptr, int nbytes)
 int recv_ACK(char* ptr, int nbytes)
 {
     int recvblknum;
+    char *pkt;
 
     recvblknum = ldshort(ptr);
     if(nbytes != 2)
     {
         D_printf("recv_ACK: ACK packet received with length = %d bytes\n", nbytes + 2);
-        exit(-1);
+        fsm_exit(-1);
     }
 
     D_printf("recv_ACK: ACK received, block# %d\n", recvblknum);
@@ -325,9 +348,18 @@ int recv_ACK(char* ptr, int nbytes)
          * containing 0-511 bytes of data. If the length of the
          * last packet that we sent was exactly 512 bytes, then we
          * must send a 0-length data packet.
+         * A cached file's packets are already built; we copy the
+         * whole thing, header and all.
          */
 
-        if((nbytes = file_read(localfp, sendbuff + 4, MAXDATA, modetype)) == 0)
+        if(localcache != NULL)
+        {
+            if((pkt = fcache_packet(localcache, nextblknum + 1, &nbytes)) != NULL)
+                memcpy(sendbuff, pkt, nbytes + 4);
+        } else
+            nbytes = file_read(localfp, sendbuff + 4, MAXDATA, modetype);
+
+        if(nbytes == 0)
         {
             if(lastsend < MAXDATA)
                 return -1;  // done
@@ -352,7 +384,7 @@ int recv_ACK(char* ptr, int nbytes)
          */
 
         D_printf("recv_ACK: recvblknum < nextblknum - 1\n");
-        exit(-1);
+        fsm_exit(-1);
     } else if(recvblknum > nextblknum)
     {
         /*
@@ -364,7 +396,7 @@ int recv_ACK(char* ptr, int nbytes)
          */
 
         D_printf("recv_ACK: recvblknum > nextblknum\n");
-        exit(-1);
+        fsm_exit(-1);
     } else
     {
         /* 
@@ -0,0 +1,304 @@
+/*
+ * Session table for the single-socket server.
+ *
+ * With "-m" every transfer shares the listening socket instead of
+ * getting a fork()ed child with a socket of its own. Datagrams are
+ * read in batches by mmsg_recv() and demultiplexed by the client's
+ * address and port (its TID) to a session. A session holds the
+ * per-transfer state that the fork()ing server keeps in globals;
+ * it's loaded into those globals before the packet is handed to the
+ * finite state machine and saved back afterwards, so the routines in
+ * sendrecv.c and file.c work unchanged.
+ *
+ * Each session has its own RTT estimators and retransmit deadline,
+ * which replace the alarm() that fsm_loop() uses.
+ */
+
+#include "defs.h"
+#include "rtt.h"
+#include "fsm.h"
+#include "file.h"
+#include "net_udp.h"
+#include "net_mmsg.h"
+#include "session.h"
+#include "fcache.h"
+
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#define SESS_HASHSIZE   256     // #hash chains, sessions are unlimited
+
+struct session {
+    struct session*     next;       // next on this hash chain
+    struct sockaddr_in  addr;       // client's address, the key
+
+    FILE*   localfp;                // the globals of the same name
+    struct fcache* localcache;
+    int     modetype;
+    int     nextblknum;
+    int     lastsend;
+    long    totnbytes;
+    int     op_sent;
+    int     lastcr;                 // file.c netascii state
+    int     nextchar;
+    int     sendlen;
+    char    sendbuff[MAXBUFF];      // last packet, for retransmission
+
+    struct rtt_struct  rttinfo;
+    struct timeval     expire;      // when to retransmit sendbuff
+};
+
+extern int sockfd;                      // declared in net_udp.c
+extern struct sockaddr_in udp_cli_addr; // declared in net_udp.c
+
+static struct session* sess_hash[SESS_HASHSIZE];
+static int    nsessions = 0;
+
+static unsigned int session_hash(struct sockaddr_in* addr)
+{
+    return (ntohl(addr->sin_addr.s_addr) * 31 + ntohs(addr->sin_port))
+                % SESS_HASHSIZE;
+}
+
+static struct session* session_find(struct sockaddr_in* addr)
+{
+    struct session* s;
+
+    for(s = sess_hash[session_hash(addr)]; s != NULL; s = s->next)
+        if(s->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+           s->addr.sin_port == addr->sin_port)
+            return s;
+    return NULL;
+}
+
+static struct session* session_new(struct sockaddr_in* addr)
+{
+    struct session* s;
+    unsigned int h;
+
+    if((s = calloc(1, sizeof(struct session))) == NULL)
+    {
+        D_printf("session_new: out of memory\n");
+        return NULL;
+    }
+
+    s->addr     = *addr;
+    s->modetype = MODE_ASCII;
+    s->nextchar = -1;
+    rtt_init(&s->rttinfo);
+    rtt_newpack(&s->rttinfo);
+
+    h = session_hash(addr);
+    s->next = sess_hash[h];
+    sess_hash[h] = s;
+    nsessions++;
+
+    D_printf("session_new: host %s, port# %d, %d sessions\n",
+             inet_ntoa(addr->sin_addr), ntohs(addr->sin_port), nsessions);
+
+    return s;
+}
+
+static void session_free(struct session* s)
+{
+    struct session** pp;
+
+    for(pp = &sess_hash[session_hash(&s->addr)]; *pp != NULL; pp = &(*pp)->next)
+        if(*pp == s)
+        {
+            *pp = s->next;
+            break;
+        }
+
+    if(s->localfp != NULL && s->localfp != stdout)
+        fclose(s->localfp);
+    if(s->localcache != NULL)
+        fcache_release(s->localcache);
+
+    nsessions--;
+    D_printf("session_free: host %s, port# %d, %ld bytes, %d sessions\n",
+             inet_ntoa(s->addr.sin_addr), ntohs(s->addr.sin_port),
+             s->totnbytes, nsessions);
+
+    free(s);
+}
+
+/*
+ * Switch the globals to this session, and back.
+ */
+
+static void session_load(struct session* s)
+{
+    localfp      = s->localfp;
+    localcache   = s->localcache;
+    modetype     = s->modetype;
+    nextblknum   = s->nextblknum;
+    lastsend     = s->lastsend;
+    totnbytes    = s->totnbytes;
+    op_sent      = s->op_sent;
+    sendlen      = s->sendlen;
+    udp_cli_addr = s->addr;
+    memcpy(sendbuff, s->sendbuff, sendlen);
+    file_setstate(s->lastcr, s->nextchar);
+}
+
+static void session_save(struct session* s)
+{
+    s->localfp    = localfp;
+    s->localcache = localcache;
+    s->modetype   = modetype;
+    s->nextblknum = nextblknum;
+    s->lastsend   = lastsend;
+    s->totnbytes  = totnbytes;
+    s->op_sent    = op_sent;
+    s->sendlen    = sendlen;
+    memcpy(s->sendbuff, sendbuff, sendlen);
+    file_getstate(&s->lastcr, &s->nextchar);
+}
+
+/*
+ * Start the retransmit timer for the packet just sent.
+ */
+
+static void session_settimer(struct session* s)
+{
+    gettimeofday(&s->expire, (struct timezone*)0);
+    s->expire.tv_sec += rtt_start(&s->rttinfo);
+}
+
+/*
+ * Hand one received datagram to its session.
+ * An RRQ or WRQ from a new address starts a session; anything else
+ * from an unknown address is rejected, as the fork()ing server's
+ * children do in net_recv().
+ */
+
+static void session_input(struct mmsg_pkt* pkt)
+{
+    static struct session* s;   // static, so it survives a longjmp()
+    int opcode, rc;
+
+    if(pkt->len < 4)
+    {
+        D_printf("session_input: receive length = %d bytes\n", pkt->len);
+        return;
+    }
+
+    opcode = ldshort(pkt->buff);
+
+    if((s = session_find(&pkt->addr)) == NULL)
+    {
+        if(opcode != OP_RRQ && opcode != OP_WRQ)
+        {
+            net_reject(&pkt->addr);
+            return;
+        }
+        if((s = session_new(&pkt->addr)) == NULL)
+            return;
+    } else if(opcode == OP_RRQ || opcode == OP_WRQ)
+    {
+        /*
+         * The client retransmitted its request before our first
+         * response got there. The session is already running.
+         */
+
+        D_printf("session_input: duplicate request ignored\n");
+        return;
+    } else
+        rtt_stop(&s->rttinfo);
+
+    session_load(s);
+
+    /*
+     * fsm_exit() jumps back here if the transfer has to be abandoned.
+     */
+
+    if(setjmp(jmp_mainloop) == 0)
+        rc = fsm_process(pkt->buff, pkt->len);
+    else
+        rc = -1;
+
+    session_save(s);
+
+    if(rc < 0)
+        session_free(s);
+    else
+    {
+        rtt_newpack(&s->rttinfo);
+        session_settimer(s);
+    }
+}
+
+/*
+ * Retransmit the last packet of every session whose timer has
+ * expired, or give up on it.
+ * Return the number of milliseconds until the next timer expires,
+ * or -1 if there are no sessions.
+ */
+
+static int session_timeouts()
+{
+    struct session *s, *next;
+    struct timeval  now;
+    long   ms, wait = -1;
+    int    h;
+
+    gettimeofday(&now, (struct timezone*)0);
+
+    for(h = 0; h < SESS_HASHSIZE; h++)
+        for(s = sess_hash[h]; s != NULL; s = next)
+        {
+            next = s->next;
+
+            ms = (s->expire.tv_sec - now.tv_sec) * 1000
+                    + (s->expire.tv_usec - now.tv_usec) / 1000;
+
+            if(ms <= 0)
+            {
+                if(rtt_timeout(&s->rttinfo) < 0)
+                {
+                    D_printf("session_timeouts: giving up on port# %d\n",
+                             ntohs(s->addr.sin_port));
+                    session_free(s);
+                    continue;
+                }
+
+                mmsg_queue(sockfd, s->sendbuff, s->sendlen, &s->addr);
+                session_settimer(s);
+
+                ms = (s->expire.tv_sec - now.tv_sec) * 1000;
+            }
+
+            if(wait < 0 || ms < wait)
+                wait = ms;
+        }
+
+    return (int) wait;
+}
+
+/*
+ * Main loop of the single-socket server: one recvmmsg() to collect
+ * the waiting datagrams, dispatch each to its session, retransmit
+ * for any sessions that have timed out, then one sendmmsg() for all
+ * the responses. Never returns.
+ */
+
+void session_loop(int nbatch)
+{
+    int i, n, wait;
+
+    mmsg_init(nbatch);
+
+    for(; ;)
+    {
+        wait = session_timeouts();
+        mmsg_flush(sockfd);
+
+        n = mmsg_recv(sockfd, wait);
+        for(i = 0; i < n; i++)
+            session_input(mmsg_getpkt(i));
+    }
+}
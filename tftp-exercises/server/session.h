@@ -0,0 +1,6 @@
+#ifndef __SESSION_H__
+#define __SESSION_H__
+
+void session_loop(int nbatch);
+
+#endif